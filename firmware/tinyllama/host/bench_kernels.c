@@ -0,0 +1,137 @@
+/**
+ * The llm_kernels.c and rope_rotate() esp-dsp builds against their scalar
+ * references.
+ *
+ * Each kernel runs on the same pseudo-random inputs in both builds, at the
+ * vector sizes forward() uses for stories260K and a few larger models. The
+ * largest relative difference has to stay within float rounding; the exit
+ * status is non-zero when it does not, and ctest runs it (kernels). On a PC
+ * the esp-dsp routines are their portable versions, which checks the glue
+ * (strides, aliasing, reciprocal scaling); speed only means something on the
+ * S3.
+ *
+ * usage: bench_kernels [iterations]
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "llm.h"
+#include "llm_kernels.h"
+#include "llm_rope.h"
+#include "esp_timer.h"
+
+#define TOLERANCE 1e-5f // relative to the largest magnitude in the reference output
+
+static unsigned long long bench_rng = 1234;
+
+static void fill(float *x, int n, float spread)
+{
+    for (int i = 0; i < n; i++)
+    {
+        x[i] = spread * (2.0f * random_f32(&bench_rng) - 1.0f);
+    }
+}
+
+static float max_rel_diff(const float *a, const float *b, int n)
+{
+    float scale = 0.0f, diff = 0.0f;
+    for (int i = 0; i < n; i++)
+    {
+        scale = fmaxf(scale, fabsf(a[i]));
+        diff = fmaxf(diff, fabsf(a[i] - b[i]));
+    }
+    return scale > 0.0f ? diff / scale : diff;
+}
+
+typedef struct
+{
+    const char *name;
+    void (*ansi)(float *out, const float *a, const float *b, int n);
+    void (*dsp)(float *out, const float *a, const float *b, int n);
+} Kernel;
+
+// every kernel behind one signature: out is updated in place, a and b are read-only inputs
+
+static void rmsnorm_ansi(float *out, const float *a, const float *b, int n) { llm_rmsnorm_ansi(out, a, b, n); }
+static void rmsnorm_dsp(float *out, const float *a, const float *b, int n) { llm_rmsnorm_dsp(out, a, b, n); }
+static void softmax_ansi(float *out, const float *a, const float *b, int n) { llm_softmax_ansi(out, n); }
+static void softmax_dsp(float *out, const float *a, const float *b, int n) { llm_softmax_dsp(out, n); }
+static void residual_ansi(float *out, const float *a, const float *b, int n) { llm_residual_ansi(out, a, n); }
+static void residual_dsp(float *out, const float *a, const float *b, int n) { llm_residual_dsp(out, a, n); }
+static void swiglu_ansi(float *out, const float *a, const float *b, int n) { llm_swiglu_ansi(out, a, n); }
+static void swiglu_dsp(float *out, const float *a, const float *b, int n) { llm_swiglu_dsp(out, a, n); }
+// a and b stand in for the cos and sin rows: one head of n values, then heads of 8 (stories260K's
+// size, 4 where n is not a multiple of 8) that all reuse the start of the rows
+static void rope_ansi(float *out, const float *a, const float *b, int n) { rope_rotate_ansi(out, n, a, b, n); }
+static void rope_dsp(float *out, const float *a, const float *b, int n) { rope_rotate_dsp(out, n, a, b, n); }
+static void rope_heads_ansi(float *out, const float *a, const float *b, int n) { rope_rotate_ansi(out, n, a, b, n % 8 ? 4 : 8); }
+static void rope_heads_dsp(float *out, const float *a, const float *b, int n) { rope_rotate_dsp(out, n, a, b, n % 8 ? 4 : 8); }
+
+static const Kernel kernels[] = {
+    {"rmsnorm", rmsnorm_ansi, rmsnorm_dsp},
+    {"softmax", softmax_ansi, softmax_dsp},
+    {"residual", residual_ansi, residual_dsp},
+    {"swiglu", swiglu_ansi, swiglu_dsp},
+    {"rope", rope_ansi, rope_dsp},
+    {"rope/heads", rope_heads_ansi, rope_heads_dsp},
+};
+
+static double time_kernel(void (*fn)(float *, const float *, const float *, int), float *out, const float *init,
+                          const float *a, const float *b, int n, int iterations)
+{
+    int64_t total = 0;
+    for (int it = 0; it < iterations; it++)
+    {
+        memcpy(out, init, n * sizeof(float));
+        int64_t start = esp_timer_get_time();
+        fn(out, a, b, n);
+        total += esp_timer_get_time() - start;
+    }
+    return (double)total / iterations;
+}
+
+int main(int argc, char **argv)
+{
+    int iterations = argc > 1 ? atoi(argv[1]) : 1000;
+    const int sizes[] = {64, 172, 512, 768, 2048, 32000};
+    int failures = 0;
+
+    printf("%-10s %6s %10s %10s %12s\n", "kernel", "n", "ansi us", "dsp us", "max rel diff");
+    for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++)
+    {
+        for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+        {
+            int n = sizes[s];
+            float *init = malloc(n * sizeof(float));
+            float *a = malloc(n * sizeof(float));
+            float *b = malloc(n * sizeof(float));
+            float *ref = malloc(n * sizeof(float));
+            float *out = malloc(n * sizeof(float));
+            if (!init || !a || !b || !ref || !out)
+            {
+                fprintf(stderr, "malloc failed!\n");
+                return EXIT_FAILURE;
+            }
+            fill(init, n, 8.0f);
+            fill(a, n, 4.0f);
+            fill(b, n, 1.0f);
+
+            double t_ansi = time_kernel(kernels[k].ansi, ref, init, a, b, n, iterations);
+            double t_dsp = time_kernel(kernels[k].dsp, out, init, a, b, n, iterations);
+            float diff = max_rel_diff(ref, out, n);
+            int ok = diff <= TOLERANCE;
+            failures += !ok;
+            printf("%-10s %6d %10.3f %10.3f %12.2e%s\n", kernels[k].name, n, t_ansi, t_dsp, diff, ok ? "" : "  FAIL");
+
+            free(init);
+            free(a);
+            free(b);
+            free(ref);
+            free(out);
+        }
+    }
+    printf("%s\n", failures ? "FAIL" : "PASS");
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,400 @@
+/**
+ * End-to-end inference benchmark: prefill and decode speed, a per-op
+ * breakdown of forward() and memory use, on one checkpoint.
+ *
+ * The run is deterministic: a fixed prompt, greedy sampling and a fixed
+ * number of steps, so every build does the same work and the hash of the
+ * generated tokens changes only when the output does. The per-op table times
+ * the kernels forward() is built from at the model's shapes, one token's
+ * worth of calls per iteration; attention and the rest of forward() are what
+ * is left of the measured decode time.
+ *
+ * Perplexity is measured teacher-forced on a fixed reference text, with the
+ * log-softmax taken in double precision, so it moves only with what forward()
+ * computes. The bench_llm_exp_fast/_lut builds run the same code with the
+ * llm_math.h approximations in attention and SwiGLU; the difference in their
+ * perplexity line is what the approximation costs.
+ *
+ * bench_llm_spec decodes through speculate(), LLM_SPEC_DRAFT tokens drafted
+ * and verified per pass; its tokens hash has to be the plain build's, which
+ * ctest checks (hash_spec).
+ *
+ * usage: bench_llm [checkpoint] [steps] [tokenizer]
+ */
+
+#include <malloc.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include "llm.h"
+#include "llm_kernels.h"
+#include "llm_rope.h"
+#include "esp_timer.h"
+
+#define BENCH_PROMPT "Once upon a time"
+#define BENCH_STEPS 256
+#define OP_ITERATIONS 200
+#define BENCH_REFERENCE_TEXT                                                                                   \
+    "Once upon a time, there was a little girl named Lily. She loved to play outside in the park. One day, " \
+    "she saw a big red ball under a tree. She ran to get it, but a dog took the ball and ran away. Lily was " \
+    "sad, so her mom gave her a hug and they went home to bake cookies together."
+
+// kernels forward() is built from; llm.c exports them but keeps them out of llm.h
+void quantize(QuantizedTensor *qx, float *x, int n, int group_size);
+void matmul(float *xout, float *x, float *w, int n, int d);
+void matmul_q8(float *xout, QuantizedTensor *x, QuantizedTensor *w, int n, int d, int group_size);
+void matmul_qkv(RunState *s, TransformerWeights *w, int l, int dim, int kv_dim);
+void matmul_swiglu(RunState *s, TransformerWeights *w, int l, int dim, int hidden_dim);
+int classifier_sparse(Transformer *transformer, Sampler *sampler, v4sf *x);
+
+typedef struct
+{
+    Transformer *t;
+    Sampler *sampler;
+} Bench;
+
+// each op runs everything of its kind that forward() does for one token
+
+static void op_rmsnorm(Bench *b)
+{
+    Config *p = &b->t->config;
+    TransformerWeights *w = &b->t->weights;
+    RunState *s = &b->t->state;
+    for (int l = 0; l < p->n_layers; l++)
+    {
+        llm_rmsnorm(s->xb, s->x, w->rms_att_weight + l * p->dim, p->dim);
+        llm_rmsnorm(s->xb, s->x, w->rms_ffn_weight + l * p->dim, p->dim);
+    }
+    llm_rmsnorm(s->xb, s->x, w->rms_final_weight, p->dim);
+}
+
+static void op_qkv(Bench *b)
+{
+    Config *p = &b->t->config;
+    TransformerWeights *w = &b->t->weights;
+    RunState *s = &b->t->state;
+    int kv_dim = p->dim * p->n_kv_heads / p->n_heads;
+    for (int l = 0; l < p->n_layers; l++)
+    {
+        if (w->group_size)
+        {
+            quantize(&s->xq, s->xb, p->dim, w->group_size);
+        }
+        matmul_qkv(s, w, l, p->dim, kv_dim);
+    }
+}
+
+static void op_rope(Bench *b)
+{
+    Config *p = &b->t->config;
+    RunState *s = &b->t->state;
+    int head_size = p->dim / p->n_heads;
+    int kv_dim = p->dim * p->n_kv_heads / p->n_heads;
+    rope_row(&s->rope, p->seq_len / 2, s->rope_cos, s->rope_sin);
+    for (int l = 0; l < p->n_layers; l++)
+    {
+        rope_rotate(s->q, p->dim, s->rope_cos, s->rope_sin, head_size);
+        rope_rotate(s->k, kv_dim, s->rope_cos, s->rope_sin, head_size);
+    }
+}
+
+static void op_wo(Bench *b)
+{
+    Config *p = &b->t->config;
+    TransformerWeights *w = &b->t->weights;
+    RunState *s = &b->t->state;
+    for (int l = 0; l < p->n_layers; l++)
+    {
+        if (w->group_size)
+        {
+            quantize(&s->xq, s->xb, p->dim, w->group_size);
+            matmul_q8(s->xb2, &s->xq, w->q_wo + l, p->dim, p->dim, w->group_size);
+        }
+        else
+        {
+            matmul(s->xb2, s->xb, w->wo + l * p->dim * p->dim, p->dim, p->dim);
+        }
+    }
+}
+
+static void op_w1w3(Bench *b)
+{
+    Config *p = &b->t->config;
+    TransformerWeights *w = &b->t->weights;
+    RunState *s = &b->t->state;
+    for (int l = 0; l < p->n_layers; l++)
+    {
+        if (w->group_size)
+        {
+            quantize(&s->xq, s->xb, p->dim, w->group_size);
+        }
+        matmul_swiglu(s, w, l, p->dim, p->hidden_dim);
+    }
+}
+
+static void op_w2(Bench *b)
+{
+    Config *p = &b->t->config;
+    TransformerWeights *w = &b->t->weights;
+    RunState *s = &b->t->state;
+    for (int l = 0; l < p->n_layers; l++)
+    {
+        if (w->group_size)
+        {
+            quantize(&s->hq, s->hb, p->hidden_dim, w->group_size);
+            matmul_q8(s->xb, &s->hq, w->q_w2 + l, p->hidden_dim, p->dim, w->group_size);
+        }
+        else
+        {
+            matmul(s->xb, s->hb, w->w2 + l * p->dim * p->hidden_dim, p->hidden_dim, p->dim);
+        }
+    }
+}
+
+#if LLM_SPARSE_CLASSIFIER
+// forward_sample()'s classifier: the int8 pre-score and pruning (greedy, fp32) and the
+// matmul of the rows left, at the state the last decoded token left
+static void op_classifier(Bench *b)
+{
+    classifier_sparse(b->t, b->sampler, b->t->state.x);
+}
+#else
+static void op_classifier(Bench *b)
+{
+    Config *p = &b->t->config;
+    TransformerWeights *w = &b->t->weights;
+    RunState *s = &b->t->state;
+    if (w->group_size)
+    {
+        quantize(&s->xq, s->x, p->dim, w->group_size);
+        matmul_q8(s->logits, &s->xq, w->q_wcls, p->dim, p->vocab_size, w->group_size);
+    }
+    else
+    {
+        matmul(s->logits, s->x, w->wcls, p->dim, p->vocab_size);
+    }
+}
+#endif
+
+static const struct
+{
+    const char *name;
+    void (*fn)(Bench *b);
+} forward_ops[] = {
+    {"rmsnorm", op_rmsnorm},
+    {"qkv", op_qkv},
+    {"rope", op_rope},
+    {"wo", op_wo},
+    {"w1/w3+swiglu", op_w1w3},
+    {"w2", op_w2},
+#if LLM_SPARSE_CLASSIFIER
+    {"sparse cls", op_classifier},
+#else
+    {"classifier", op_classifier},
+#endif
+};
+
+static double time_op(void (*fn)(Bench *b), Bench *b)
+{
+    fn(b); // warm up
+    int64_t start = esp_timer_get_time();
+    for (int it = 0; it < OP_ITERATIONS; it++)
+    {
+        fn(b);
+    }
+    return (double)(esp_timer_get_time() - start) / OP_ITERATIONS;
+}
+
+// exp of the mean negative log-likelihood of each reference token given the ones before it
+static double perplexity(Transformer *t, Tokenizer *tok, int *n_scored)
+{
+    Config *p = &t->config;
+    int *tokens = malloc((strlen(BENCH_REFERENCE_TEXT) + 3) * sizeof(int));
+    int n = 0;
+    if (!tokens)
+    {
+        fprintf(stderr, "malloc failed!\n");
+        exit(EXIT_FAILURE);
+    }
+    encode(tok, BENCH_REFERENCE_TEXT, 1, 0, tokens, &n);
+    n = n < p->seq_len ? n : p->seq_len;
+
+    double nll = 0.0;
+    for (int pos = 0; pos + 1 < n; pos++)
+    {
+        float *logits = forward(t, tokens[pos], pos);
+        double max_val = logits[0];
+        for (int i = 1; i < p->vocab_size; i++)
+        {
+            max_val = logits[i] > max_val ? logits[i] : max_val;
+        }
+        double sum = 0.0;
+        for (int i = 0; i < p->vocab_size; i++)
+        {
+            sum += exp(logits[i] - max_val);
+        }
+        nll += max_val + log(sum) - logits[tokens[pos + 1]];
+    }
+    free(tokens);
+    *n_scored = n - 1;
+    return exp(nll / (n - 1));
+}
+
+static unsigned int fnv1a(unsigned int hash, int token)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        hash = (hash ^ ((token >> (8 * i)) & 0xff)) * 16777619u;
+    }
+    return hash;
+}
+
+static const char *basename_of(const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    return slash ? slash + 1 : path;
+}
+
+int main(int argc, char **argv)
+{
+    char *checkpoint = argc > 1 ? argv[1] : BENCH_MODEL_DIR "/stories260K.bin";
+    int steps = argc > 2 ? atoi(argv[2]) : BENCH_STEPS;
+    char *tokenizer_path = argc > 3 ? argv[3] : BENCH_DATA_DIR "/tok512.bin";
+
+    Transformer transformer;
+    Tokenizer tokenizer;
+    Sampler sampler;
+    int64_t start = esp_timer_get_time();
+    build_transformer(&transformer, checkpoint);
+    int64_t build_us = esp_timer_get_time() - start;
+    build_tokenizer(&tokenizer, tokenizer_path, transformer.config.vocab_size);
+    build_sampler(&sampler, transformer.config.vocab_size, 0.0f, 0.9f, 42);
+    struct mallinfo2 heap = mallinfo2();
+    size_t heap_after_build = heap.uordblks + heap.hblkhd; // large buffers are mmapped by glibc
+    Config *p = &transformer.config;
+
+    int *tokens = malloc((strlen(BENCH_PROMPT) + 3) * sizeof(int));
+    int n_prompt = 0;
+    if (!tokens)
+    {
+        fprintf(stderr, "malloc failed!\n");
+        return EXIT_FAILURE;
+    }
+    encode(&tokenizer, BENCH_PROMPT, 1, 0, tokens, &n_prompt);
+    if (steps < 1 || n_prompt + steps > p->seq_len)
+    {
+        fprintf(stderr, "steps must be in [1, %d]\n", p->seq_len - n_prompt);
+        return EXIT_FAILURE;
+    }
+
+    // prefill the prompt, then decode greedily, timing forward() and sample() apart
+    start = esp_timer_get_time();
+    float *logits = forward_prefill(&transformer, tokens, n_prompt, 0);
+    int64_t prefill_us = esp_timer_get_time() - start;
+
+    unsigned int hash = 2166136261u;
+    int64_t forward_us = 0, sample_us = 0;
+    int pos = n_prompt - 1;
+    int next = sample(&sampler, logits);
+#if LLM_SPEC_DRAFT
+    // the token at every position, for the drafter, and the tokens of the last pass still to go
+    int *context = malloc(p->seq_len * sizeof(int));
+    int queue[LLM_SPEC_DRAFT + 1];
+    int n_queued = 0, queued = 0;
+    SpecStats spec = {0};
+    if (!context)
+    {
+        fprintf(stderr, "malloc failed!\n");
+        return EXIT_FAILURE;
+    }
+    memcpy(context, tokens, n_prompt * sizeof(int));
+#endif
+    for (int i = 0; i < steps; i++)
+    {
+        hash = fnv1a(hash, next);
+        pos++;
+#if LLM_SPEC_DRAFT
+        // a pass samples every position it verifies, so the two are timed together
+        context[pos] = next;
+        if (queued == n_queued)
+        {
+            start = esp_timer_get_time();
+            n_queued = speculate(&transformer, &sampler, context, pos, &spec, queue);
+            forward_us += esp_timer_get_time() - start;
+            queued = 0;
+        }
+        next = queue[queued++];
+#elif LLM_SPARSE_CLASSIFIER
+        // the classifier only scores what the sampler can pick, so the two are timed together
+        start = esp_timer_get_time();
+        next = forward_sample(&transformer, &sampler, next, pos);
+        forward_us += esp_timer_get_time() - start;
+#else
+        start = esp_timer_get_time();
+        logits = forward(&transformer, next, pos);
+        forward_us += esp_timer_get_time() - start;
+
+        start = esp_timer_get_time();
+        next = sample(&sampler, logits);
+        sample_us += esp_timer_get_time() - start;
+#endif
+    }
+
+    int n_scored;
+    double ppl = perplexity(&transformer, &tokenizer, &n_scored);
+
+    // per-op breakdown on the decode path
+    Bench b = {.t = &transformer, .sampler = &sampler};
+    double forward_per_token = (double)forward_us / steps;
+    double ops_total = 0.0;
+    double op_us[sizeof(forward_ops) / sizeof(forward_ops[0])];
+    for (size_t i = 0; i < sizeof(forward_ops) / sizeof(forward_ops[0]); i++)
+    {
+        op_us[i] = time_op(forward_ops[i].fn, &b);
+        ops_total += op_us[i];
+    }
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    printf("model            %s (dim %d, layers %d, heads %d/%d, vocab %d, %s)\n", basename_of(checkpoint),
+           p->dim, p->n_layers, p->n_heads, p->n_kv_heads, p->vocab_size,
+           transformer.weights.group_size ? "q8" : "fp32");
+    printf("build            %.2f ms\n", build_us / 1000.0);
+    printf("prefill          %d tokens, %.2f ms, %.1f tok/s\n", n_prompt, prefill_us / 1000.0,
+           n_prompt * 1e6 / (prefill_us ? prefill_us : 1));
+    printf("decode           %d tokens, %.2f us/token, %.1f tok/s\n", steps,
+           (double)(forward_us + sample_us) / steps, steps * 1e6 / (forward_us + sample_us ? forward_us + sample_us : 1));
+    printf("tokens hash      0x%08x\n", hash);
+#if LLM_SPEC_DRAFT
+    printf("speculation      %d passes, %.2f tokens/pass, %d of %d drafts accepted\n", spec.passes,
+           spec.passes ? (double)spec.produced / spec.passes : 0.0, spec.accepted, spec.drafted);
+#endif
+    printf("perplexity       %.6f over %d reference tokens\n", ppl, n_scored);
+    printf("heap after build %zu KB\n", heap_after_build / 1024);
+    printf("peak rss         %ld KB\n", usage.ru_maxrss);
+    printf("\n%-16s %10s %7s\n", "op", "us/token", "share");
+    for (size_t i = 0; i < sizeof(forward_ops) / sizeof(forward_ops[0]); i++)
+    {
+        printf("%-16s %10.2f %6.1f%%\n", forward_ops[i].name, op_us[i], 100.0 * op_us[i] / forward_per_token);
+    }
+    double rest = forward_per_token > ops_total ? forward_per_token - ops_total : 0.0;
+    printf("%-16s %10.2f %6.1f%%\n", "attention+rest", rest, 100.0 * rest / forward_per_token);
+    printf("%-16s %10.2f\n", "forward", forward_per_token);
+#if LLM_SPEC_DRAFT || LLM_SPARSE_CLASSIFIER
+    printf("%-16s %s\n", "sample", "included in forward");
+#else
+    printf("%-16s %10.2f\n", "sample", (double)sample_us / steps);
+#endif
+#if LLM_SPEC_DRAFT
+    free(context);
+#endif
+
+    free(tokens);
+    free_sampler(&sampler);
+    free_tokenizer(&tokenizer);
+    free_transformer(&transformer);
+    return 0;
+}
@@ -0,0 +1,154 @@
+/**
+ * The llm_math.h exp() implementations against libm.
+ *
+ * Accuracy: the largest relative error of fast_expf, lut_expf and their
+ * sigmoids over the ranges softmax and SwiGLU feed them, measured in double
+ * against libm. Speed: a softmax built on each exp() at the lengths attention
+ * sees (one score per cached position) and the vocabulary sizes the sampler
+ * normalizes. The binary carries all three variants whatever llm_expf()
+ * resolves to, so one run compares them; bench_llm_exp_fast/_lut give the
+ * end-to-end view, perplexity included.
+ *
+ * usage: bench_math [iterations]
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "llm.h"
+#include "llm_math.h"
+#include "esp_timer.h"
+
+#define ACCURACY_SAMPLES 1000000
+
+static unsigned long long bench_rng = 1234;
+
+typedef struct
+{
+    const char *name;
+    float (*exp)(float x);
+} ExpImpl;
+
+static float exact_expf(float x) { return expf(x); }
+static float fast_expf_fn(float x) { return fast_expf(x); }
+static float lut_expf_fn(float x) { return lut_expf(x); }
+
+static const ExpImpl impls[] = {
+    {"exact", exact_expf},
+    {"fast", fast_expf_fn},
+    {"lut", lut_expf_fn},
+};
+#define N_IMPLS (sizeof(impls) / sizeof(impls[0]))
+
+// worst relative error over uniform samples of [lo, hi], plus both ends
+static double max_rel_error(float (*fn)(float), int sigmoid, float lo, float hi)
+{
+    double worst = 0.0;
+    for (int i = 0; i <= ACCURACY_SAMPLES + 1; i++)
+    {
+        float x = i == 0 ? lo : i == 1 ? hi : lo + (hi - lo) * random_f32(&bench_rng);
+        double ref = sigmoid ? 1.0 / (1.0 + exp(-(double)x)) : exp((double)x);
+        double got = sigmoid ? 1.0f / (1.0f + fn(-x)) : fn(x);
+        if (ref < 1e-37)
+        {
+            continue; // flushed to zero by design
+        }
+        double err = fabs(got - ref) / ref;
+        worst = err > worst ? err : worst;
+    }
+    return worst;
+}
+
+// llm_softmax_ansi with the exp() passed in, so every variant runs the same loop
+static inline void softmax_with(float *x, int size, float (*exp_fn)(float))
+{
+    float max_val = x[0];
+    for (int i = 1; i < size; i++)
+    {
+        max_val = x[i] > max_val ? x[i] : max_val;
+    }
+    float sum = 0.0f;
+    for (int i = 0; i < size; i++)
+    {
+        x[i] = exp_fn(x[i] - max_val);
+        sum += x[i];
+    }
+    for (int i = 0; i < size; i++)
+    {
+        x[i] /= sum;
+    }
+}
+
+// direct calls rather than through the pointer, so each exp() can inline as it does in llm.c
+static void softmax_exact(float *x, int n) { softmax_with(x, n, expf); }
+static void softmax_fast(float *x, int n) { softmax_with(x, n, fast_expf); }
+static void softmax_lut(float *x, int n) { softmax_with(x, n, lut_expf); }
+static void (*const softmaxes[N_IMPLS])(float *x, int n) = {softmax_exact, softmax_fast, softmax_lut};
+
+static double time_softmax(void (*fn)(float *, int), float *x, const float *init, int n, int iterations)
+{
+    int64_t total = 0;
+    for (int it = 0; it < iterations; it++)
+    {
+        memcpy(x, init, n * sizeof(float));
+        int64_t start = esp_timer_get_time();
+        fn(x, n);
+        total += esp_timer_get_time() - start;
+    }
+    return (double)total / iterations;
+}
+
+int main(int argc, char **argv)
+{
+    int iterations = argc > 1 ? atoi(argv[1]) : 2000;
+
+    printf("%-6s %14s %14s %14s\n", "exp", "exp [-87, 0]", "exp [-10, 10]", "sigmoid [-20, 20]");
+    for (size_t i = 1; i < N_IMPLS; i++)
+    {
+        printf("%-6s %14.2e %14.2e %14.2e\n", impls[i].name, max_rel_error(impls[i].exp, 0, -87.0f, 0.0f),
+               max_rel_error(impls[i].exp, 0, -10.0f, 10.0f), max_rel_error(impls[i].exp, 1, -20.0f, 20.0f));
+    }
+
+    // attention scores of a small model, then sampler logits from stories260K up to Llama 2
+    const struct
+    {
+        const char *use;
+        int n;
+        float spread;
+    } cases[] = {
+        {"attention", 64, 4.0f},
+        {"attention", 128, 4.0f},
+        {"attention", 256, 4.0f},
+        {"attention", 512, 4.0f},
+        {"sampler", 512, 8.0f},
+        {"sampler", 32000, 8.0f},
+    };
+    printf("\n%-10s %6s %10s %10s %10s %8s %8s\n", "softmax", "n", "exact us", "fast us", "lut us", "fast x", "lut x");
+    for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++)
+    {
+        int n = cases[c].n;
+        float *init = malloc(n * sizeof(float));
+        float *x = malloc(n * sizeof(float));
+        if (!init || !x)
+        {
+            fprintf(stderr, "malloc failed!\n");
+            return EXIT_FAILURE;
+        }
+        for (int i = 0; i < n; i++)
+        {
+            init[i] = cases[c].spread * (2.0f * random_f32(&bench_rng) - 1.0f);
+        }
+        int reps = n > 4096 ? iterations / 20 + 1 : iterations;
+        double us[N_IMPLS];
+        for (size_t i = 0; i < N_IMPLS; i++)
+        {
+            us[i] = time_softmax(softmaxes[i], x, init, n, reps);
+        }
+        printf("%-10s %6d %10.3f %10.3f %10.3f %7.2fx %7.2fx\n", cases[c].use, n, us[0], us[1], us[2],
+               us[0] / us[1], us[0] / us[2]);
+        free(init);
+        free(x);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,202 @@
+/**
+ * Nucleus sampling latency across vocabulary sizes.
+ *
+ * Times sample() from llm.c against two references on the same synthetic
+ * logits: the bubble sort it used to run and a full qsort of every
+ * probability (llama2.c without the cutoff). The qsort reference also checks
+ * that every token sample() returns lies inside the nucleus.
+ *
+ * usage: bench_sampler [iterations]
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "llm.h"
+#include "esp_timer.h"
+
+#define TOPP 0.9f
+#define BUBBLE_MAX_VOCAB 4096 // quadratic, pointless to wait for beyond this
+
+static unsigned long long bench_rng = 1234;
+
+static float bench_gaussian(void)
+{
+    // Box-Muller over an xorshift stream, so every run sees the same logits
+    float u1 = ((random_u32(&bench_rng) >> 8) + 1) / 16777217.0f;
+    float u2 = (random_u32(&bench_rng) >> 8) / 16777216.0f;
+    return sqrtf(-2.0f * logf(u1)) * cosf(6.2831853f * u2);
+}
+
+static void bench_softmax(float *x, int n)
+{
+    float max_val = x[0];
+    for (int i = 1; i < n; i++)
+    {
+        max_val = x[i] > max_val ? x[i] : max_val;
+    }
+    float sum = 0.0f;
+    for (int i = 0; i < n; i++)
+    {
+        x[i] = expf(x[i] - max_val);
+        sum += x[i];
+    }
+    for (int i = 0; i < n; i++)
+    {
+        x[i] /= sum;
+    }
+}
+
+static int compare_desc(const void *a, const void *b)
+{
+    const ProbIndex *a_ = a;
+    const ProbIndex *b_ = b;
+    return (a_->prob < b_->prob) - (a_->prob > b_->prob);
+}
+
+static int nucleus_size(ProbIndex *probindex, int n)
+{
+    float cumulative_prob = 0.0f;
+    for (int i = 0; i < n; i++)
+    {
+        cumulative_prob += probindex[i].prob;
+        if (cumulative_prob >= TOPP)
+        {
+            return i + 1;
+        }
+    }
+    return n;
+}
+
+static int walk_sorted(ProbIndex *probindex, int n, float coin)
+{
+    int last_idx = nucleus_size(probindex, n) - 1;
+    float cumulative_prob = 0.0f;
+    for (int i = 0; i <= last_idx; i++)
+    {
+        cumulative_prob += probindex[i].prob;
+    }
+    float r = coin * cumulative_prob;
+    float cdf = 0.0f;
+    for (int i = 0; i <= last_idx; i++)
+    {
+        cdf += probindex[i].prob;
+        if (r < cdf)
+        {
+            return probindex[i].index;
+        }
+    }
+    return probindex[last_idx].index;
+}
+
+static int topp_qsort(float *probs, int n, ProbIndex *probindex, float coin)
+{
+    for (int i = 0; i < n; i++)
+    {
+        probindex[i] = (ProbIndex){probs[i], i};
+    }
+    qsort(probindex, n, sizeof(ProbIndex), compare_desc);
+    return walk_sorted(probindex, n, coin);
+}
+
+static int topp_bubble(float *probs, int n, ProbIndex *probindex, float coin)
+{
+    for (int i = 0; i < n; i++)
+    {
+        probindex[i] = (ProbIndex){probs[i], i};
+    }
+    for (int i = 0; i < n - 1; i++)
+    {
+        for (int j = 0; j < n - i - 1; j++)
+        {
+            if (probindex[j].prob < probindex[j + 1].prob)
+            {
+                ProbIndex tmp = probindex[j];
+                probindex[j] = probindex[j + 1];
+                probindex[j + 1] = tmp;
+            }
+        }
+    }
+    return walk_sorted(probindex, n, coin);
+}
+
+int main(int argc, char **argv)
+{
+    int iterations = argc > 1 ? atoi(argv[1]) : 200;
+    const int vocab_sizes[] = {256, 512, 4096, 32000};
+    const float sharpness[] = {1.0f, 3.0f}; // logit spread: flat-ish and peaked distributions
+
+    printf("%8s %6s %12s %12s %12s %10s\n", "vocab", "spread", "bubble us", "qsort us", "sample us", "outside");
+    for (size_t v = 0; v < sizeof(vocab_sizes) / sizeof(vocab_sizes[0]); v++)
+    {
+        int n = vocab_sizes[v];
+        float *logits = malloc(n * sizeof(float));
+        float *work = malloc(n * sizeof(float));
+        ProbIndex *ref_index = malloc(n * sizeof(ProbIndex));
+        if (!logits || !work || !ref_index)
+        {
+            fprintf(stderr, "malloc failed!\n");
+            return EXIT_FAILURE;
+        }
+        for (size_t k = 0; k < sizeof(sharpness) / sizeof(sharpness[0]); k++)
+        {
+            for (int i = 0; i < n; i++)
+            {
+                logits[i] = sharpness[k] * bench_gaussian();
+            }
+            Sampler sampler;
+            build_sampler(&sampler, n, 1.0f, TOPP, 42);
+
+            int64_t t_bubble = 0, t_qsort = 0, t_sample = 0;
+            int outside = 0;
+            for (int it = 0; it < iterations; it++)
+            {
+                // sample() draws the coin from its rng first thing; replay it for the references
+                unsigned long long state = sampler.rng_state;
+                float coin = random_f32(&state);
+
+                memcpy(work, logits, n * sizeof(float));
+                int64_t start = esp_timer_get_time();
+                int next = sample(&sampler, work);
+                t_sample += esp_timer_get_time() - start;
+
+                memcpy(work, logits, n * sizeof(float));
+                start = esp_timer_get_time();
+                bench_softmax(work, n);
+                topp_qsort(work, n, ref_index, coin);
+                t_qsort += esp_timer_get_time() - start;
+                int in_nucleus = 0;
+                for (int i = 0, size = nucleus_size(ref_index, n); i < size; i++)
+                {
+                    in_nucleus |= ref_index[i].index == next;
+                }
+                outside += !in_nucleus;
+
+                if (n <= BUBBLE_MAX_VOCAB)
+                {
+                    memcpy(work, logits, n * sizeof(float));
+                    start = esp_timer_get_time();
+                    bench_softmax(work, n);
+                    topp_bubble(work, n, ref_index, coin);
+                    t_bubble += esp_timer_get_time() - start;
+                }
+            }
+            free_sampler(&sampler);
+
+            if (n <= BUBBLE_MAX_VOCAB)
+            {
+                printf("%8d %6.1f %12.2f", n, sharpness[k], (double)t_bubble / iterations);
+            }
+            else
+            {
+                printf("%8d %6.1f %12s", n, sharpness[k], "-");
+            }
+            printf(" %12.2f %12.2f %10d\n", (double)t_qsort / iterations, (double)t_sample / iterations, outside);
+        }
+        free(logits);
+        free(work);
+        free(ref_index);
+    }
+    return 0;
+}
@@ -0,0 +1,29 @@
+# ctest helper: runs BENCH (a bench_llm build) on MODEL and checks its "tokens hash" line
+# against HASH. With CORRUPT set, MODEL is copied to CORRUPT with one byte in the middle
+# flipped first, and the run has to fail on the container's CRC instead
+if(CORRUPT)
+    execute_process(COMMAND ${PYTHON} -c
+        "import sys; d = bytearray(open(sys.argv[1], 'rb').read()); d[len(d) // 2] ^= 0xff; open(sys.argv[2], 'wb').write(d)"
+        ${MODEL} ${CORRUPT} RESULT_VARIABLE result)
+    if(NOT result EQUAL 0)
+        message(FATAL_ERROR "could not write ${CORRUPT}")
+    endif()
+    set(MODEL ${CORRUPT})
+endif()
+execute_process(COMMAND ${BENCH} ${MODEL} OUTPUT_VARIABLE out ERROR_VARIABLE err RESULT_VARIABLE result)
+if(CORRUPT)
+    file(REMOVE ${CORRUPT})
+    if(result EQUAL 0 OR NOT err MATCHES "CRC mismatch")
+        message(FATAL_ERROR "${MODEL} with a flipped byte was not rejected on its CRC (${result})\n${err}")
+    endif()
+    message(STATUS "rejected: ${CMAKE_MATCH_0}")
+    return()
+endif()
+if(NOT result EQUAL 0)
+    message(FATAL_ERROR "${BENCH} ${MODEL} failed (${result})\n${err}")
+endif()
+string(REGEX MATCH "tokens hash +0x[0-9a-f]+" found "${out}")
+message(STATUS "${MODEL}: ${found}")
+if(NOT found MATCHES "${HASH}$")
+    message(FATAL_ERROR "expected tokens hash ${HASH}")
+endif()
@@ -0,0 +1,329 @@
+/**
+ * The slice of ESP-IDF and FreeRTOS that llm.c and llm_pool.c use, on top of
+ * pthreads and libc, so the inference code can be built and profiled on a PC.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_cpu.h"
+#include "esp_err.h"
+#include "esp_heap_caps.h"
+#include "esp_partition.h"
+#include "esp_rom_crc.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "dsps_dotprod.h"
+#include "dspm_mult.h"
+
+// ----------------------------------------------------------------------------
+// tasks and direct-to-task notifications
+
+struct host_task
+{
+    pthread_t thread;
+    TaskFunction_t fn;
+    void *arg;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint32_t notify;
+    volatile int started;
+};
+
+static struct host_task main_task = {.lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER};
+static __thread struct host_task *current_task = NULL;
+
+static void *task_entry(void *arg)
+{
+    struct host_task *t = arg;
+    current_task = t;
+    t->started = 1;
+    t->fn(t->arg);
+    return NULL;
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t fn, const char *name, uint32_t stack, void *arg,
+                                   UBaseType_t prio, TaskHandle_t *out, BaseType_t core)
+{
+    struct host_task *t = calloc(1, sizeof(*t));
+    if (!t)
+    {
+        return pdFALSE;
+    }
+    t->fn = fn;
+    t->arg = arg;
+    pthread_mutex_init(&t->lock, NULL);
+    pthread_cond_init(&t->cond, NULL);
+    if (out)
+    {
+        *out = t;
+    }
+    if (pthread_create(&t->thread, NULL, task_entry, t) != 0)
+    {
+        return pdFALSE;
+    }
+    pthread_detach(t->thread);
+    // a new higher priority task runs before its creator returns on the target
+    while (!t->started)
+    {
+        sched_yield();
+    }
+    return pdPASS;
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void)
+{
+    return current_task ? current_task : &main_task;
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+    struct timespec ts = {ticks / 1000, (ticks % 1000) * 1000000L};
+    nanosleep(&ts, NULL);
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t ticks)
+{
+    struct host_task *t = xTaskGetCurrentTaskHandle();
+    pthread_mutex_lock(&t->lock);
+    while (!t->notify)
+    {
+        pthread_cond_wait(&t->cond, &t->lock);
+    }
+    uint32_t value = t->notify;
+    t->notify = clear ? 0 : value - 1;
+    pthread_mutex_unlock(&t->lock);
+    return value;
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t t)
+{
+    pthread_mutex_lock(&t->lock);
+    t->notify++;
+    pthread_cond_signal(&t->cond);
+    pthread_mutex_unlock(&t->lock);
+    return pdPASS;
+}
+
+// ----------------------------------------------------------------------------
+// heap, timers, partitions
+
+void *heap_caps_malloc(size_t size, uint32_t caps)
+{
+    return malloc(size);
+}
+
+void *heap_caps_calloc(size_t n, size_t size, uint32_t caps)
+{
+    return calloc(n, size);
+}
+
+void *heap_caps_aligned_alloc(size_t alignment, size_t size, uint32_t caps)
+{
+    // aligned_alloc wants a multiple of the alignment; the result is released with free()
+    return aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+}
+
+size_t heap_caps_get_free_size(uint32_t caps)
+{
+    return 0;
+}
+
+size_t heap_caps_get_largest_free_block(uint32_t caps)
+{
+    // no internal RAM to prefer on the host, so capability placement always falls back
+    return 0;
+}
+
+uint32_t esp_get_free_heap_size(void)
+{
+    return 0;
+}
+
+int64_t esp_timer_get_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+uint32_t esp_cpu_get_cycle_count(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)((uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec);
+}
+
+// ----------------------------------------------------------------------------
+// flash partitions, backed by files
+
+#define HOST_PARTITIONS 4
+#define HOST_MMAPS 4
+#define HOST_ERASE_SIZE 4096
+
+static struct
+{
+    esp_partition_t partition;
+    FILE *file;
+} partitions[HOST_PARTITIONS];
+static int n_partitions;
+static void *mmaps[HOST_MMAPS]; // copies handed out by esp_partition_mmap(), handle - 1
+
+void host_partition_file(const char *label, const char *path, uint32_t size)
+{
+    if (n_partitions == HOST_PARTITIONS)
+    {
+        fprintf(stderr, "host_partition_file: too many partitions\n");
+        exit(EXIT_FAILURE);
+    }
+    FILE *file = fopen(path, "r+b");
+    if (!file)
+    {
+        // a new file starts out erased
+        file = fopen(path, "w+b");
+        for (uint32_t i = 0; file && i < size; i++)
+        {
+            fputc(0xff, file);
+        }
+    }
+    if (!file)
+    {
+        fprintf(stderr, "host_partition_file: can't open %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    partitions[n_partitions].partition = (esp_partition_t){strdup(label), size, HOST_ERASE_SIZE};
+    partitions[n_partitions].file = file;
+    n_partitions++;
+}
+
+static FILE *partition_file(const esp_partition_t *partition, size_t offset, size_t size)
+{
+    for (int i = 0; i < n_partitions; i++)
+    {
+        if (&partitions[i].partition == partition && offset + size <= partition->size &&
+            fseek(partitions[i].file, offset, SEEK_SET) == 0)
+        {
+            return partitions[i].file;
+        }
+    }
+    return NULL;
+}
+
+const esp_partition_t *esp_partition_find_first(esp_partition_type_t type, esp_partition_subtype_t subtype, const char *label)
+{
+    for (int i = 0; i < n_partitions; i++)
+    {
+        if (strcmp(partitions[i].partition.label, label) == 0)
+        {
+            return &partitions[i].partition;
+        }
+    }
+    return NULL;
+}
+
+esp_err_t esp_partition_read(const esp_partition_t *partition, size_t src_offset, void *dst, size_t size)
+{
+    FILE *file = partition_file(partition, src_offset, size);
+    return file && fread(dst, 1, size, file) == size ? ESP_OK : ESP_FAIL;
+}
+
+esp_err_t esp_partition_mmap(const esp_partition_t *partition, size_t offset, size_t size,
+                             esp_partition_mmap_memory_t memory, const void **out_ptr, esp_partition_mmap_handle_t *out_handle)
+{
+    // a private copy, which is all a read-only mapping needs to be
+    for (int h = 0; h < HOST_MMAPS; h++)
+    {
+        if (!mmaps[h])
+        {
+            void *copy = malloc(size);
+            if (!copy || esp_partition_read(partition, offset, copy, size) != ESP_OK)
+            {
+                free(copy);
+                return ESP_FAIL;
+            }
+            mmaps[h] = copy;
+            *out_ptr = copy;
+            *out_handle = h + 1;
+            return ESP_OK;
+        }
+    }
+    return ESP_FAIL;
+}
+
+void esp_partition_munmap(esp_partition_mmap_handle_t handle)
+{
+    if (handle >= 1 && handle <= HOST_MMAPS)
+    {
+        free(mmaps[handle - 1]);
+        mmaps[handle - 1] = NULL;
+    }
+}
+
+esp_err_t esp_partition_write(const esp_partition_t *partition, size_t dst_offset, const void *src, size_t size)
+{
+    uint8_t *old = malloc(size ? size : 1);
+    if (!old || esp_partition_read(partition, dst_offset, old, size) != ESP_OK)
+    {
+        free(old);
+        return ESP_FAIL;
+    }
+    for (size_t i = 0; i < size; i++)
+    {
+        old[i] &= ((const uint8_t *)src)[i];
+    }
+    FILE *file = partition_file(partition, dst_offset, size);
+    esp_err_t err = file && fwrite(old, 1, size, file) == size && fflush(file) == 0 ? ESP_OK : ESP_FAIL;
+    free(old);
+    return err;
+}
+
+esp_err_t esp_partition_erase_range(const esp_partition_t *partition, size_t offset, size_t size)
+{
+    if (offset % HOST_ERASE_SIZE || size % HOST_ERASE_SIZE)
+    {
+        return ESP_FAIL;
+    }
+    FILE *file = partition_file(partition, offset, size);
+    for (size_t i = 0; file && i < size; i++)
+    {
+        fputc(0xff, file);
+    }
+    return file && fflush(file) == 0 ? ESP_OK : ESP_FAIL;
+}
+
+uint32_t esp_rom_crc32_le(uint32_t crc, uint8_t const *buf, uint32_t len)
+{
+    crc = ~crc;
+    for (uint32_t i = 0; i < len; i++)
+    {
+        crc ^= buf[i];
+        for (int b = 0; b < 8; b++)
+        {
+            crc = (crc >> 1) ^ (0xedb88320u & -(crc & 1));
+        }
+    }
+    return ~crc;
+}
+
+const char *esp_err_to_name(esp_err_t code)
+{
+    return code == ESP_OK ? "ESP_OK" : "ESP_FAIL";
+}
+
+// ----------------------------------------------------------------------------
+// the ESP32-S3 esp-dsp kernels llm.c calls by name, backed by the portable versions
+
+esp_err_t dsps_dotprod_f32_aes3(const float *src1, const float *src2, float *dest, int len)
+{
+    return dsps_dotprod_f32_ansi(src1, src2, dest, len);
+}
+
+esp_err_t dspm_mult_f32_aes3(const float *A, const float *B, float *C, int m, int n, int k)
+{
+    return dspm_mult_f32_ansi(A, B, C, m, n, k);
+}
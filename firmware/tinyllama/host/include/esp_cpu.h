@@ -0,0 +1,9 @@
+#ifndef HOST_ESP_CPU_H
+#define HOST_ESP_CPU_H
+
+#include <stdint.h>
+
+// nanoseconds on the host, standing in for the 240 MHz cycle counter
+uint32_t esp_cpu_get_cycle_count(void);
+
+#endif // HOST_ESP_CPU_H
@@ -0,0 +1,10 @@
+#ifndef HOST_SDKCONFIG_H
+#define HOST_SDKCONFIG_H
+
+// the host build runs with every menuconfig option at its default, except esp-dsp's
+// CONFIG_DSP_OPTIMIZED: the firmware builds with it, which picks the _dsp kernels, and
+// llm_host_dsp defines it to run those on the portable esp-dsp routines. Options that
+// default to on are defined here so the headers read the same values menuconfig gives
+#define CONFIG_LLM_KV_SNAPSHOT 1
+
+#endif // HOST_SDKCONFIG_H
@@ -0,0 +1,13 @@
+# ctest helper: runs REFERENCE and VARIANT (two bench_llm builds) and fails unless their
+# "tokens hash" lines match, i.e. the variant generates exactly the same tokens
+foreach(bench REFERENCE VARIANT)
+    execute_process(COMMAND ${${bench}} OUTPUT_VARIABLE out RESULT_VARIABLE result)
+    if(NOT result EQUAL 0)
+        message(FATAL_ERROR "${${bench}} failed (${result})")
+    endif()
+    string(REGEX MATCH "tokens hash +0x[0-9a-f]+" ${bench}_HASH "${out}")
+    message(STATUS "${${bench}}: ${${bench}_HASH}")
+endforeach()
+if(NOT REFERENCE_HASH OR NOT REFERENCE_HASH STREQUAL VARIANT_HASH)
+    message(FATAL_ERROR "tokens hash differs from the reference build")
+endif()
@@ -0,0 +1,100 @@
+/**
+ * Tokenizer check: encode() on fixed strings against the token ids of the
+ * original llama2.c encoder (greedy best-score merges, rescanning every pair
+ * each round) on tok512.bin.
+ *
+ * The strings cover plain text, punctuation, whitespace runs, codepoints the
+ * vocabulary has (ï, é) and ones it does not, which fall back to one token
+ * per UTF-8 byte (日本, 🙂), and the empty string, which gets no dummy prefix.
+ * Any difference in the ids is a failure.
+ *
+ * usage: test_encode <checkpoint> <tokenizer>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "llm.h"
+
+#define ENCODE_MAX_TOKENS 32
+
+typedef struct
+{
+    const char *text;
+    int8_t eos;
+    int n;
+    int ids[ENCODE_MAX_TOKENS];
+} EncodeCase;
+
+static const EncodeCase cases[] = {
+    {"Once upon a time", 0, 5, {1, 403, 407, 261, 378}},
+    {"Hello, world! 123", 0, 13, {1, 346, 306, 414, 432, 263, 304, 341, 443, 410, 475, 479, 472}},
+    {"Lily said, \"Don't go!\"", 0, 13, {1, 317, 336, 432, 313, 455, 289, 439, 413, 298, 414, 443, 436}},
+    {"naïve café", 0, 10, {1, 297, 412, 198, 178, 360, 280, 412, 431, 485}},
+    {"日本", 0, 8, {1, 410, 233, 154, 168, 233, 159, 175}},
+    {"emoji 🙂", 0, 11, {1, 344, 423, 414, 449, 417, 410, 243, 162, 156, 133}},
+    {"a\tb\nc", 0, 6, {1, 261, 12, 430, 13, 429}},
+    {"  two  spaces", 0, 12, {1, 410, 410, 259, 424, 414, 410, 262, 427, 412, 331, 419}},
+    {"The quick brown fox jumps over the lazy dog.", 1, 31,
+     {1, 291, 410, 456, 425, 417, 340, 268, 420, 327, 416, 272, 414, 444, 410, 449,
+      425, 423, 427, 419, 334, 330, 265, 278, 412, 451, 422, 400, 428, 426, 2}},
+    {"", 0, 1, {1}},
+};
+
+int main(int argc, char **argv)
+{
+    if (argc < 3)
+    {
+        fprintf(stderr, "usage: %s <checkpoint> <tokenizer>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // the tokenizer's tables come from the arena, which lives as long as a transformer
+    Transformer t;
+    Tokenizer tokenizer;
+    build_transformer(&t, argv[1]);
+    build_tokenizer(&tokenizer, argv[2], t.config.vocab_size);
+
+    int failures = 0;
+    for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++)
+    {
+        const EncodeCase *e = &cases[c];
+        int *tokens = malloc((strlen(e->text) + 3) * sizeof(int));
+        int n = 0;
+        if (!tokens)
+        {
+            fprintf(stderr, "malloc failed!\n");
+            return EXIT_FAILURE;
+        }
+        encode(&tokenizer, (char *)e->text, 1, e->eos, tokens, &n);
+        int ok = n == e->n && memcmp(tokens, e->ids, n * sizeof(int)) == 0;
+        // the text itself may hold tabs and newlines, so cases go by number
+        printf("case %-2zu %2zu bytes %2d tokens %s\n", c, strlen(e->text), n, ok ? "ok" : "FAIL");
+        if (!ok)
+        {
+            printf("  got     ");
+            for (int i = 0; i < n; i++)
+            {
+                printf(" %d", tokens[i]);
+            }
+            printf("\n  expected");
+            for (int i = 0; i < e->n; i++)
+            {
+                printf(" %d", e->ids[i]);
+            }
+            printf("\n");
+            failures++;
+        }
+        free(tokens);
+    }
+
+    free_tokenizer(&tokenizer);
+    free_transformer(&t);
+    if (failures)
+    {
+        printf("FAIL\n");
+        return EXIT_FAILURE;
+    }
+    printf("PASS\n");
+    return 0;
+}
@@ -0,0 +1,68 @@
+/**
+ * Long generation check: generate() in endless mode (steps < 0) well past
+ * seq_len, through the kv cache shifts that keep the attention sinks and
+ * re-rotate the moved keys, against a committed hash of its output.
+ *
+ * Sampling is greedy, so the text only changes when what forward() computes
+ * or how the cache is shifted does. The hash covers every piece handed to
+ * the token callback, prompt included. Endless generation never returns, so
+ * the callback checks the hash and exits once GENERATE_PIECES have come out.
+ * Each KV cache mode has its own hash; drafting (LLM_SPEC_DRAFT) must not
+ * change the one of the mode it runs with.
+ *
+ * usage: test_generate <checkpoint> <tokenizer> <expected hash, 0x........>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "llm.h"
+
+#define GENERATE_PROMPT "Once upon a time"
+#define GENERATE_PIECES 1200 // over twice stories260K's seq_len of 512
+
+static unsigned int expected_hash;
+static unsigned int hash = 2166136261u;
+static int pieces;
+
+static void on_done(float tokens_ps)
+{
+    (void)tokens_ps;
+}
+
+static void on_token(const char *piece)
+{
+    for (const char *c = piece; *c; c++)
+    {
+        hash = (hash ^ (unsigned char)*c) * 16777619u;
+    }
+    if (++pieces < GENERATE_PIECES)
+    {
+        return;
+    }
+    fflush(stdout);
+    fprintf(stderr, "\n%d pieces, hash 0x%08x (expected 0x%08x)\n", pieces, hash, expected_hash);
+    fprintf(stderr, "%s\n", hash == expected_hash ? "PASS" : "FAIL");
+    exit(hash == expected_hash ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 4)
+    {
+        fprintf(stderr, "usage: %s <checkpoint> <tokenizer> <expected hash>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    expected_hash = (unsigned int)strtoul(argv[3], NULL, 16);
+
+    Transformer t;
+    Tokenizer tokenizer;
+    Sampler sampler;
+    build_transformer(&t, argv[1]);
+    build_tokenizer(&tokenizer, argv[2], t.config.vocab_size);
+    build_sampler(&sampler, t.config.vocab_size, 0.0f, 0.9f, 42);
+    generate(&t, &tokenizer, &sampler, GENERATE_PROMPT, -1, on_done, on_token);
+
+    // only reached if generation stopped by itself
+    fprintf(stderr, "generate() returned after %d pieces\nFAIL\n", pieces);
+    return EXIT_FAILURE;
+}
@@ -0,0 +1,153 @@
+/**
+ * Q8 parity check: forward() on an int8 export against forward() on the fp32
+ * checkpoint it came from.
+ *
+ * Both models are fed the same reference text, teacher-forced, and their
+ * logits are compared position by position. The check fails when any logit
+ * differs by more than PARITY_MAX_ABS, when the mean absolute difference over
+ * all of them exceeds PARITY_MEAN_ABS, or when the argmax differs at a
+ * position where the fp32 model's top two logits are further apart than the
+ * two models can disagree (2 * PARITY_MAX_ABS). Closer calls than that may
+ * legitimately flip under int8 rounding and are only counted.
+ *
+ * usage: test_q8_parity <fp32 checkpoint> <q8 checkpoint> <tokenizer>
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "llm.h"
+
+#define PARITY_TEXT                                                                                            \
+    "Once upon a time, there was a little girl named Lily. She loved to play outside in the park. One day, " \
+    "she saw a big red ball under a tree. She ran to get it, but a dog took the ball and ran away. Lily was " \
+    "sad, so her mom gave her a hug and they went home to bake cookies together."
+
+// stories260K at group size 4 measures 0.24 and 0.038, against logits that span about 20;
+// a wrong scale or a misread tensor moves them by whole units
+#define PARITY_MAX_ABS 0.5f
+#define PARITY_MEAN_ABS 0.06f
+
+// teacher-forced logits of every position, n rows of vocab_size
+static float *run_logits(char *checkpoint, const int *tokens, int n, int *vocab_size)
+{
+    Transformer t;
+    build_transformer(&t, checkpoint);
+    int vocab = t.config.vocab_size;
+    float *out = malloc((size_t)n * vocab * sizeof(float));
+    if (!out)
+    {
+        fprintf(stderr, "malloc failed!\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int pos = 0; pos < n; pos++)
+    {
+        memcpy(out + (size_t)pos * vocab, forward(&t, tokens[pos], pos), vocab * sizeof(float));
+    }
+    free_transformer(&t);
+    *vocab_size = vocab;
+    return out;
+}
+
+static int argmax(const float *x, int n, float *gap)
+{
+    int best = 0, second = -1;
+    for (int i = 1; i < n; i++)
+    {
+        if (x[i] > x[best])
+        {
+            second = best;
+            best = i;
+        }
+        else if (second < 0 || x[i] > x[second])
+        {
+            second = i;
+        }
+    }
+    *gap = x[best] - x[second];
+    return best;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 4)
+    {
+        fprintf(stderr, "usage: %s <fp32 checkpoint> <q8 checkpoint> <tokenizer>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // the tokenizer's tables come from the arena, which lives as long as a transformer
+    Transformer t;
+    Tokenizer tokenizer;
+    build_transformer(&t, argv[1]);
+    build_tokenizer(&tokenizer, argv[3], t.config.vocab_size);
+    int *tokens = malloc((strlen(PARITY_TEXT) + 3) * sizeof(int));
+    int n = 0;
+    if (!tokens)
+    {
+        fprintf(stderr, "malloc failed!\n");
+        return EXIT_FAILURE;
+    }
+    encode(&tokenizer, PARITY_TEXT, 1, 0, tokens, &n);
+    n = n < t.config.seq_len ? n : t.config.seq_len;
+    free_tokenizer(&tokenizer);
+    free_transformer(&t);
+
+    int vocab, vocab_q8;
+    float *ref = run_logits(argv[1], tokens, n, &vocab);
+    float *q8 = run_logits(argv[2], tokens, n, &vocab_q8);
+    if (vocab != vocab_q8)
+    {
+        fprintf(stderr, "FAIL: vocab sizes differ (%d vs %d)\n", vocab, vocab_q8);
+        return EXIT_FAILURE;
+    }
+
+    double sum_abs = 0.0;
+    float max_abs = 0.0f;
+    int worst_pos = 0, flips = 0, close_flips = 0;
+    for (int pos = 0; pos < n; pos++)
+    {
+        const float *a = ref + (size_t)pos * vocab;
+        const float *b = q8 + (size_t)pos * vocab;
+        for (int i = 0; i < vocab; i++)
+        {
+            float d = fabsf(a[i] - b[i]);
+            sum_abs += d;
+            if (d > max_abs)
+            {
+                max_abs = d;
+                worst_pos = pos;
+            }
+        }
+        float gap, gap_q8;
+        if (argmax(a, vocab, &gap) != argmax(b, vocab, &gap_q8))
+        {
+            if (gap > 2.0f * PARITY_MAX_ABS)
+            {
+                flips++;
+            }
+            else
+            {
+                close_flips++;
+            }
+        }
+    }
+    double mean_abs = sum_abs / ((double)n * vocab);
+
+    printf("positions        %d\n", n);
+    printf("max |diff|       %.6f at position %d (limit %.2f)\n", max_abs, worst_pos, PARITY_MAX_ABS);
+    printf("mean |diff|      %.6f (limit %.2f)\n", mean_abs, PARITY_MEAN_ABS);
+    printf("argmax flips     %d, plus %d within 2 * limit of a tie\n", flips, close_flips);
+
+    free(ref);
+    free(q8);
+    free(tokens);
+    if (max_abs > PARITY_MAX_ABS || mean_abs > PARITY_MEAN_ABS || flips > 0)
+    {
+        printf("FAIL\n");
+        return EXIT_FAILURE;
+    }
+    printf("PASS\n");
+    return 0;
+}
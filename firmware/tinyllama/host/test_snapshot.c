@@ -0,0 +1,151 @@
+/**
+ * Prompt snapshot check: save after a prefill, rebuild the transformer,
+ * restore, and compare against what the prefill left.
+ *
+ * The kvsnap partition is a file here (host_partition_file()), starting out
+ * erased. The restored logits and the kv cache positions of the prompt have to
+ * match the fresh prefill byte for byte. A snapshot must not be restored for
+ * another prompt, for another model (a different checkpoint CRC), or once a
+ * byte of it has been corrupted. The prefill and restore times are printed as
+ * the time to first token each path gives.
+ *
+ * usage: test_snapshot <checkpoint> <tokenizer> <partition file>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "llm.h"
+#include "llm_snapshot.h"
+#include "esp_partition.h"
+#include "esp_timer.h"
+
+#define SNAPSHOT_PROMPT \
+    "Once upon a time there was a little girl named Lily who loved to play in the park with her big red ball and her dog"
+#define PARTITION_SIZE (512 * 1024)
+
+static int failures;
+
+static void check(int ok, const char *what)
+{
+    printf("%-44s %s\n", what, ok ? "ok" : "FAIL");
+    failures += !ok;
+}
+
+// the kv cache positions [0, n) of every layer, with their scales, as snapshots hold them;
+// returns the size, and copies them to out unless it is NULL
+static size_t kv_bytes(Transformer *t, int n, uint8_t *out)
+{
+    Config *p = &t->config;
+    RunState *s = &t->state;
+    int kv_dim = p->dim * p->n_kv_heads / p->n_heads;
+    size_t total = 0;
+    for (int l = 0; l < p->n_layers; l++)
+    {
+        size_t vec0 = (size_t)l * p->seq_len * p->n_kv_heads;
+        const void *parts[4] = {s->key_cache + vec0 * (kv_dim / p->n_kv_heads),
+                                s->value_cache + vec0 * (kv_dim / p->n_kv_heads), s->key_scale + vec0,
+                                s->value_scale + vec0};
+        size_t sizes[4] = {n * kv_dim * sizeof(kv_t), n * kv_dim * sizeof(kv_t),
+                           s->key_scale ? n * p->n_kv_heads * sizeof(float) : 0,
+                           s->value_scale ? n * p->n_kv_heads * sizeof(float) : 0};
+        for (int i = 0; i < 4; i++)
+        {
+            if (out)
+            {
+                memcpy(out + total, parts[i], sizes[i]);
+            }
+            total += sizes[i];
+        }
+    }
+    return total;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 4)
+    {
+        fprintf(stderr, "usage: %s <checkpoint> <tokenizer> <partition file>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    remove(argv[3]);
+    host_partition_file(LLM_SNAPSHOT_PARTITION, argv[3], PARTITION_SIZE);
+
+    Transformer t;
+    Tokenizer tokenizer;
+    build_transformer(&t, argv[1]);
+    build_tokenizer(&tokenizer, argv[2], t.config.vocab_size);
+    int vocab = t.config.vocab_size;
+    int *tokens = malloc((strlen(SNAPSHOT_PROMPT) + 3) * sizeof(int));
+    int n = 0;
+    if (!tokens)
+    {
+        fprintf(stderr, "malloc failed!\n");
+        return EXIT_FAILURE;
+    }
+    encode(&tokenizer, SNAPSHOT_PROMPT, 1, 0, tokens, &n);
+    free_tokenizer(&tokenizer);
+    check(snapshot_restore(&t, tokens, n) == NULL, "erased partition is a miss");
+
+    // the reference: a fresh prefill, saved as the snapshot
+    int64_t start = esp_timer_get_time();
+    float *logits = forward_prefill(&t, tokens, n, 0);
+    int64_t prefill_us = esp_timer_get_time() - start;
+    size_t kv_size = kv_bytes(&t, n, NULL);
+    float *ref_logits = malloc(vocab * sizeof(float));
+    uint8_t *ref_kv = malloc(kv_size);
+    uint8_t *kv = malloc(kv_size);
+    if (!ref_logits || !ref_kv || !kv)
+    {
+        fprintf(stderr, "malloc failed!\n");
+        return EXIT_FAILURE;
+    }
+    memcpy(ref_logits, logits, vocab * sizeof(float));
+    kv_bytes(&t, n, ref_kv);
+    snapshot_save(&t, tokens, n);
+    free_transformer(&t);
+
+    // a new transformer starts with a zeroed cache, so everything compared comes from flash
+    build_transformer(&t, argv[1]);
+    start = esp_timer_get_time();
+    logits = snapshot_restore(&t, tokens, n);
+    int64_t restore_us = esp_timer_get_time() - start;
+    check(logits != NULL, "same prompt and model is a hit");
+    check(logits && memcmp(logits, ref_logits, vocab * sizeof(float)) == 0, "restored logits match the prefill");
+    kv_bytes(&t, n, kv);
+    check(logits && memcmp(kv, ref_kv, kv_size) == 0, "restored kv cache matches the prefill");
+
+    tokens[n - 1] ^= 1;
+    check(snapshot_restore(&t, tokens, n) == NULL, "another prompt is a miss");
+    tokens[n - 1] ^= 1;
+    check(snapshot_restore(&t, tokens, n - 1) == NULL, "a prefix of the prompt is a miss");
+    t.model_crc ^= 1;
+    check(snapshot_restore(&t, tokens, n) == NULL, "another checkpoint CRC is a miss");
+    t.model_crc ^= 1;
+
+    // clear the bits of one byte in the middle of the kv data, like a bad write would
+    const esp_partition_t *partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY,
+                                                                LLM_SNAPSHOT_PARTITION);
+    size_t offset = sizeof(SnapshotHeader) + vocab * sizeof(float) + kv_size / 2;
+    uint8_t byte, zero = 0;
+    esp_partition_read(partition, offset, &byte, 1);
+    esp_partition_write(partition, offset, &zero, 1);
+    check(byte != 0 && snapshot_restore(&t, tokens, n) == NULL, "a corrupted snapshot is a miss");
+
+    printf("prompt           %d tokens, %zu bytes of kv cache\n", n, kv_size);
+    printf("first token      prefill %.2f ms, restore %.2f ms\n", prefill_us / 1000.0, restore_us / 1000.0);
+
+    free(ref_logits);
+    free(ref_kv);
+    free(kv);
+    free(tokens);
+    free_transformer(&t);
+    remove(argv[3]);
+    if (failures)
+    {
+        printf("FAIL\n");
+        return EXIT_FAILURE;
+    }
+    printf("PASS\n");
+    return 0;
+}
@@ -110,7 +110,7 @@ esp_err_t led_set_led(int index, uint32_t color)
 int char_to_led_index(char c)
 {
     // Convert to uppercase for case-insensitive mapping
-    c = toupper(c);
+    c = toupper((unsigned char)c);
     
     if (c >= 'A' && c <= 'Z') {
         return c - 'A'; // A=0 … Z=25
@@ -0,0 +1,114 @@
+#include "led_queue.h"
+#include "led.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+
+static const char *TAG = "LED_QUEUE";
+static QueueHandle_t led_queue = NULL;
+static led_queue_policy_t queue_policy = LED_QUEUE_DROP;
+
+// only touched by the generating task
+static uint32_t chars_dropped = 0;
+static uint32_t chars_coalesced = 0;
+static int64_t paused_us = 0;
+// only touched by the render task
+static uint32_t chars_shown = 0;
+
+static void led_render_task(void *params)
+{
+    char c;
+    for (;;) {
+        xQueueReceive(led_queue, &c, portMAX_DELAY);
+        led_show_character(c);
+        chars_shown++;
+
+        // leave the strip dark while the model has nothing new to show
+        if (uxQueueMessagesWaiting(led_queue) == 0) {
+            led_clear_all();
+        }
+    }
+}
+
+esp_err_t led_queue_init(led_queue_policy_t policy)
+{
+    if (led_queue) {
+        return ESP_OK;
+    }
+
+    led_queue = xQueueCreate(LED_QUEUE_LENGTH, sizeof(char));
+    if (!led_queue) {
+        ESP_LOGE(TAG, "Failed to create LED queue");
+        return ESP_ERR_NO_MEM;
+    }
+    queue_policy = policy;
+
+    if (xTaskCreatePinnedToCore(led_render_task, "LedRender", LED_QUEUE_TASK_STACK, NULL,
+                                LED_QUEUE_TASK_PRIORITY, NULL, 0) != pdPASS) { // Run on Core 0
+        ESP_LOGE(TAG, "Failed to create LED render task");
+        vQueueDelete(led_queue);
+        led_queue = NULL;
+        return ESP_ERR_NO_MEM;
+    }
+
+    ESP_LOGI(TAG, "Created LED render task, %d slots, policy %d", LED_QUEUE_LENGTH, policy);
+    return ESP_OK;
+}
+
+static void led_queue_send(char c)
+{
+    if (xQueueSend(led_queue, &c, 0) == pdTRUE) {
+        return;
+    }
+
+    // the render task is LED_QUEUE_LENGTH characters behind
+    switch (queue_policy) {
+    case LED_QUEUE_DROP:
+        chars_dropped++;
+        break;
+    case LED_QUEUE_COALESCE: {
+        char oldest;
+        if (xQueueReceive(led_queue, &oldest, 0) == pdTRUE) {
+            chars_coalesced++;
+        }
+        if (xQueueSend(led_queue, &c, 0) != pdTRUE) {
+            chars_dropped++;
+        }
+        break;
+    }
+    case LED_QUEUE_PAUSE: {
+        int64_t start = esp_timer_get_time();
+        xQueueSend(led_queue, &c, portMAX_DELAY);
+        paused_us += esp_timer_get_time() - start;
+        break;
+    }
+    }
+}
+
+void led_queue_push(const char *text)
+{
+    if (!led_queue || !text) {
+        return;
+    }
+
+    // same filtering as led_show_text_sequence(): only characters with an LED get queued.
+    // pieces are model output, so UTF-8 and byte-fallback bytes (>= 0x80) are skipped before
+    // they reach toupper(), for which a negative char is undefined
+    for (int i = 0; text[i]; i++) {
+        if ((unsigned char)text[i] < 0x80 && char_to_led_index(text[i]) != -1) {
+            led_queue_send(text[i]);
+        }
+    }
+}
+
+void led_queue_log_stats(void)
+{
+    if (!led_queue) {
+        return;
+    }
+    ESP_LOGI(TAG, "LED queue: %lu shown, %lu pending, %lu dropped, %lu coalesced, paused %lld ms",
+             (unsigned long)chars_shown, (unsigned long)uxQueueMessagesWaiting(led_queue),
+             (unsigned long)chars_dropped, (unsigned long)chars_coalesced, paused_us / 1000);
+}
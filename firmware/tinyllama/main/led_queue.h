@@ -0,0 +1,36 @@
+#ifndef LED_QUEUE_H
+#define LED_QUEUE_H
+
+#include "esp_err.h"
+
+/**
+ * Decouples token generation from the LED animations.
+ *
+ * generate() hands every token to led_queue_push(), which only copies the
+ * displayable characters into a bounded FreeRTOS queue. A render task pinned
+ * to core 0 drains the queue and plays the fade animation for each one, so
+ * the seconds spent animating a character no longer stall the model.
+ */
+
+// Characters that can be waiting for the render task (the high-water mark)
+#define LED_QUEUE_LENGTH 32
+#define LED_QUEUE_TASK_STACK 4096
+#define LED_QUEUE_TASK_PRIORITY 5
+
+// What led_queue_push() does once LED_QUEUE_LENGTH characters are pending
+typedef enum {
+    LED_QUEUE_DROP,     // discard the new characters, the display lags but never skips ahead
+    LED_QUEUE_COALESCE, // discard the oldest pending characters, the display jumps to the newest text
+    LED_QUEUE_PAUSE,    // block the generator until the render task frees a slot
+} led_queue_policy_t;
+
+// Create the queue and the render task. Requires led_init() to have succeeded
+esp_err_t led_queue_init(led_queue_policy_t policy);
+
+// Queue the displayable characters of a token. Never blocks unless the policy is LED_QUEUE_PAUSE
+void led_queue_push(const char *text);
+
+// Log how many characters were shown, dropped or coalesced and how long generation was paused
+void led_queue_log_stats(void);
+
+#endif // LED_QUEUE_H
@@ -12,6 +12,7 @@
 #include <ctype.h>
 #include <time.h>
 #include <math.h>
+#include <float.h>
 #include <string.h>
 #include <fcntl.h>
 #include "esp_log.h"
@@ -19,66 +20,116 @@
 #include "esp_dsp.h"
 #include "esp_attr.h"
 #include "esp_heap_caps.h"
+#include "esp_partition.h"
+#include "llm_arena.h"
+#include "llm_pool.h"
+#include "llm_profile.h"
+#include "llm_container.h"
+#include "llm_kernels.h"
+#include "llm_math.h"
+#include "llm_snapshot.h"
 
 #define MAP_FAILED NULL
 #define munmap(ptr, length) custom_munmap(ptr)
 #define close(fd) custom_close(fd)
 
-#define TASK_0_BIT (1 << 0)
-#define TASK_1_BIT (1 << 1)
-#define FORWARD_TASK_1 (1 << 2)
-#define FORWARD_TASK_2 (1 << 3)
-#define READY_BIT (1 << 3)
-#define ALL_SYNC_BITS (TASK_0_BIT | TASK_1_BIT)
-#define ALL_FORWARD_TASKS (FORWARD_TASK_1 | FORWARD_TASK_2)
+// Q8 checkpoints use the llama2.c "version 2" layout written by tools/export_q8.py
+#define CHECKPOINT_MAGIC 0x616b3432 // "ak42" in ASCII, starts Q8 (version 2) and container (version 3) files
+#define Q8_VERSION 2
+#define Q8_HEADER_SIZE 256
+// layout byte following the group size in the header (zero padding in plain llama2.c files)
+#define Q8_LAYOUT_FUSED 1 // per layer [wq;wk;wv], wo, [w1;w3], w2 stored back to back
 
 typedef struct
 {
     v4sf *xout;
     v4sf *x;
     v4sf *w;
-    int start;
-    int end;
+    QuantizedTensor *xq; // set instead of x and w for int8 matmuls
+    QuantizedTensor *wq;
+    int group_size;
     int n;
     int d;
-    int task_num;
 } MatMulTaskParams;
 
+typedef struct
+{
+    int count; // number of matrices sharing the same input
+    MatMulTaskParams part[3];
+} StackedMatMulParams;
+
+typedef struct
+{
+    MatMulTaskParams m; // xout gets one entry per listed row
+    const int *rows;    // rows of m's weights to compute
+} SubsetMatMulParams;
+
+typedef struct
+{
+    v4sf *out;           // (T, d) result, one row per token
+    v4sf *xt;            // (n, T) input with one column per token, fp32 weights only
+    QuantizedTensor *xq; // T quantized input rows, Q8 weights only
+    v4sf *w;             // (d, n) fp32 weights
+    QuantizedTensor *wq; // (d, n) int8 weights
+    v4sf *ct;            // (d, T) GEMM result before it is transposed into out
+    int group_size;
+    int n;
+    int d;
+    int T;
+} BatchMatMulParams;
+
+// prompt tokens are pushed through forward_prefill() this many at a time,
+// which bounds the activation buffers it needs
+#define PREFILL_CHUNK 32
+
+typedef struct
+{
+    v4sf *x;   // (T, dim) activations, one row per prompt token
+    v4sf *xb;  // (T, dim)
+    v4sf *xb2; // (T, dim)
+    v4sf *q;   // (T, dim)
+    v4sf *k;   // (T, kv_dim)
+    v4sf *v;   // (T, kv_dim)
+    v4sf *hb;  // (T, hidden_dim)
+    v4sf *hb2; // (T, hidden_dim)
+    v4sf *xt;  // (max(dim, hidden_dim), T) transposed GEMM input
+    v4sf *ct;  // (max(dim, hidden_dim), T) GEMM output before transposing back
+    v4sf *rope_cos; // (T, head_size / 2) rotation of each position in the chunk
+    v4sf *rope_sin; // (T, head_size / 2)
+    QuantizedTensor *xq; // T quantized rows of up to hidden_dim values, Q8 only
+} PrefillState;
+
 typedef struct
 {
     RunState *s;
     TransformerWeights *w;
     Config *p;
+    v4sf *q;  // queries of the position being processed (dim,)
+    v4sf *xb; // attention output of that position (dim,)
     int pos;
-    int start;
     int loff;
-    int end;
     int dim;
     int kv_dim;
     int kv_mul;
     int hidden_dim;
     int head_size;
-    int task_num;
 } ForwardTaskParams;
 
-EventGroupHandle_t xEventGroup;
-EventGroupHandle_t ForwardEventGroup;
-
 static const char *TAG = "LLM";
-TaskHandle_t handle_forward_task = NULL;
-TaskHandle_t matmul_task_2 = NULL;
 
-ForwardTaskParams *forward_params = NULL;
-MatMulTaskParams *matmul_params = NULL;
-
-SemaphoreHandle_t semaDataReady;
-SemaphoreHandle_t semaForwardDataReady;
-
-void matmul_task(void *params);
-void forward_task(void *params);
+// checkpoints mapped from a flash partition are released with esp_partition_munmap,
+// the ones read from SPIFFS are plain heap buffers
+esp_partition_mmap_handle_t model_mmap_handle;
+const void *model_mmap_ptr = NULL;
 
 void custom_munmap(void *ptr)
 {
+    if (ptr != NULL && ptr == model_mmap_ptr)
+    {
+        esp_partition_munmap(model_mmap_handle);
+        model_mmap_ptr = NULL;
+        return;
+    }
     free(ptr);
 }
 
@@ -91,44 +142,226 @@ int custom_close(int fd)
 void chat(Transformer *transformer, Tokenizer *tokenizer, Sampler *sampler,
           char *cli_user_prompt, char *cli_system_prompt, int steps);
 
-void malloc_run_state(RunState *s, Config *p)
+// sizes of tokenizer buffers, defined next to the code that uses them
+unsigned int vocab_hash_size(int vocab_size);
+size_t encode_scratch_size(int n_tokens);
+
+// the RunState, prefill, tokenizer and sampler buffers, planned once in init_transformer()
+Arena llm_arena;
+
+// how often a buffer is read, which decides who gets internal RAM first
+#define HEAT_EVERY_OP 4    // touched by most ops of every token
+#define HEAT_EVERY_TOKEN 3 // read once or twice per token
+#define HEAT_KV_CACHE 2    // streamed by attention every token, but large
+#define HEAT_PROMPT 1      // encode and prefill, once per prompt
+#define HEAT_COLD 0        // tokenizer tables only encode() looks at
+
+void plan_buffers(Arena *a, Config *p, int group_size)
 {
-    // we calloc instead of malloc to keep valgrind happy
+    // everything sized from Config, so the plan is fixed before anything is allocated
+    size_t f = sizeof(v4sf);
     int kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
-    s->x = calloc(p->dim, sizeof(v4sf));
-    s->xb = calloc(p->dim, sizeof(v4sf));
-    s->xb2 = calloc(p->dim, sizeof(v4sf));
-    s->hb = calloc(p->hidden_dim, sizeof(v4sf));
-    s->hb2 = calloc(p->hidden_dim, sizeof(v4sf));
-    s->q = calloc(p->dim, sizeof(v4sf));
-    s->key_cache = calloc(p->n_layers * p->seq_len * kv_dim, sizeof(v4sf));
-    s->value_cache = calloc(p->n_layers * p->seq_len * kv_dim, sizeof(v4sf));
-    s->att = calloc(p->n_heads * p->seq_len, sizeof(v4sf));
-    s->logits = heap_caps_calloc(p->vocab_size, sizeof(v4sf), MALLOC_CAP_INTERNAL);
-    // ensure all mallocs went fine
-    if (!s->x || !s->xb || !s->xb2 || !s->hb || !s->hb2 || !s->q || !s->key_cache || !s->value_cache || !s->att || !s->logits)
-    {
-        fprintf(stderr, "malloc failed!\n");
+    int head_size = p->dim / p->n_heads;
+    int widest = p->hidden_dim > p->dim ? p->hidden_dim : p->dim;
+    int T = p->seq_len < PREFILL_CHUNK ? p->seq_len : PREFILL_CHUNK;
+    size_t kv_vectors = (size_t)p->n_layers * p->seq_len * p->n_kv_heads;
+
+    arena_reserve(a, "x", p->dim * f, HEAT_EVERY_OP);
+    arena_reserve(a, "xb", p->dim * f, HEAT_EVERY_OP);
+    arena_reserve(a, "q", p->dim * f, HEAT_EVERY_OP);
+    arena_reserve(a, "att", (size_t)p->n_heads * LLM_ATTENTION_TILE * f, HEAT_EVERY_OP);
+    arena_reserve(a, "logits", p->vocab_size * f, HEAT_EVERY_OP);
+
+    arena_reserve(a, "xb2", p->dim * f, HEAT_EVERY_TOKEN);
+    arena_reserve(a, "hb", p->hidden_dim * f, HEAT_EVERY_TOKEN);
+    arena_reserve(a, "k", kv_dim * f, HEAT_EVERY_TOKEN);
+    arena_reserve(a, "v", kv_dim * f, HEAT_EVERY_TOKEN);
+    arena_reserve(a, "rope_cos", head_size / 2 * f, HEAT_EVERY_TOKEN);
+    arena_reserve(a, "rope_sin", head_size / 2 * f, HEAT_EVERY_TOKEN);
+    arena_reserve(a, "rope_freq", rope_freq_size(head_size), HEAT_EVERY_TOKEN);
+    if (rope_table_size(head_size, p->seq_len))
+    {
+        // one row per token, but seq_len rows of them
+        arena_reserve(a, "rope_table", rope_table_size(head_size, p->seq_len), HEAT_KV_CACHE);
+    }
+    if (group_size)
+    {
+        arena_reserve(a, "xq", p->dim, HEAT_EVERY_TOKEN);
+        arena_reserve(a, "xq_scales", p->dim / group_size * f, HEAT_EVERY_TOKEN);
+        arena_reserve(a, "hq", p->hidden_dim, HEAT_EVERY_TOKEN);
+        arena_reserve(a, "hq_scales", p->hidden_dim / group_size * f, HEAT_EVERY_TOKEN);
+    }
+    arena_reserve(a, "probindex", p->vocab_size * sizeof(ProbIndex), HEAT_EVERY_TOKEN);
+    arena_reserve(a, "decode_table", p->vocab_size * sizeof(TokenPiece), HEAT_EVERY_TOKEN);
+    arena_reserve(a, "vocab", p->vocab_size * sizeof(char *), HEAT_EVERY_TOKEN);
+    arena_reserve(a, "led_tokens", p->vocab_size * sizeof(int), HEAT_EVERY_TOKEN);
+    if (LLM_SPEC_DRAFT)
+    {
+        arena_reserve(a, "spec_logits", (size_t)(LLM_SPEC_DRAFT + 1) * p->vocab_size * f, HEAT_EVERY_TOKEN);
+        arena_reserve(a, "spec_history", p->seq_len * sizeof(int), HEAT_EVERY_TOKEN);
+    }
+    if (LLM_SPARSE_CLASSIFIER)
+    {
+        arena_reserve(a, "cls_rows", p->vocab_size * sizeof(int), HEAT_EVERY_TOKEN);
+        if (!group_size)
+        {
+            arena_reserve(a, "cls_prescore", (size_t)p->vocab_size * p->dim, HEAT_EVERY_TOKEN);
+            arena_reserve(a, "cls_prescore_scales", p->vocab_size * f, HEAT_EVERY_TOKEN);
+        }
+    }
+
+    arena_reserve(a, "key_cache", kv_vectors * head_size * sizeof(kv_t), HEAT_KV_CACHE);
+    arena_reserve(a, "value_cache", kv_vectors * head_size * sizeof(kv_t), HEAT_KV_CACHE);
+    if (LLM_KV_CACHE == LLM_KV_CACHE_INT8)
+    {
+        arena_reserve(a, "key_scale", kv_vectors * f, HEAT_KV_CACHE);
+        arena_reserve(a, "value_scale", kv_vectors * f, HEAT_KV_CACHE);
+    }
+
+    arena_reserve(a, "prompt_tokens", (LLM_MAX_PROMPT_BYTES + 3) * sizeof(int), HEAT_PROMPT);
+    arena_reserve(a, "encode_scratch", encode_scratch_size(LLM_MAX_PROMPT_BYTES + 2), HEAT_PROMPT);
+    arena_reserve(a, "prefill_x", (size_t)T * p->dim * f, HEAT_PROMPT);
+    arena_reserve(a, "prefill_xb", (size_t)T * p->dim * f, HEAT_PROMPT);
+    arena_reserve(a, "prefill_xb2", (size_t)T * p->dim * f, HEAT_PROMPT);
+    arena_reserve(a, "prefill_q", (size_t)T * p->dim * f, HEAT_PROMPT);
+    arena_reserve(a, "prefill_k", (size_t)T * kv_dim * f, HEAT_PROMPT);
+    arena_reserve(a, "prefill_v", (size_t)T * kv_dim * f, HEAT_PROMPT);
+    arena_reserve(a, "prefill_hb", (size_t)T * p->hidden_dim * f, HEAT_PROMPT);
+    arena_reserve(a, "prefill_hb2", (size_t)T * p->hidden_dim * f, HEAT_PROMPT);
+    arena_reserve(a, "prefill_xt", (size_t)T * widest * f, HEAT_PROMPT);
+    arena_reserve(a, "prefill_ct", (size_t)T * widest * f, HEAT_PROMPT);
+    arena_reserve(a, "prefill_rope_cos", (size_t)T * head_size / 2 * f, HEAT_PROMPT);
+    arena_reserve(a, "prefill_rope_sin", (size_t)T * head_size / 2 * f, HEAT_PROMPT);
+    if (group_size)
+    {
+        arena_reserve(a, "prefill_xq", T * sizeof(QuantizedTensor), HEAT_PROMPT);
+        arena_reserve(a, "prefill_xq_values", (size_t)T * widest, HEAT_PROMPT);
+        arena_reserve(a, "prefill_xq_scales", (size_t)T * widest / group_size * f, HEAT_PROMPT);
+    }
+
+    arena_reserve(a, "vocab_scores", p->vocab_size * f, HEAT_COLD);
+    arena_reserve(a, "vocab_len", p->vocab_size * sizeof(int), HEAT_COLD);
+    arena_reserve(a, "vocab_hash", vocab_hash_size(p->vocab_size) * sizeof(int), HEAT_COLD);
+}
+
+void *llm_buffer(const char *name, size_t size, uint32_t caps)
+{
+    // the zeroed arena buffer planned as name, or a heap block when the plan has none that
+    // fits: a tokenizer or sampler built on its own, or a prompt beyond LLM_MAX_PROMPT_BYTES
+    void *ptr = arena_take(&llm_arena, name, size);
+    ptr = ptr ? ptr : heap_caps_calloc(1, size, caps);
+    if (!ptr)
+    {
+        ESP_LOGE(TAG, "Failed to allocate %zu bytes for %s", size, name);
         exit(EXIT_FAILURE);
     }
+    return ptr;
+}
+
+void llm_buffer_free(void *ptr)
+{
+    if (ptr && !arena_release(&llm_arena, ptr))
+    {
+        free(ptr);
+    }
+}
+
+void malloc_kv_cache(RunState *s, Config *p)
+{
+    int head_size = p->dim / p->n_heads;
+    size_t vectors = (size_t)p->n_layers * p->seq_len * p->n_kv_heads;
+    size_t cache_size = vectors * head_size * sizeof(kv_t);
+    size_t scale_size = LLM_KV_CACHE == LLM_KV_CACHE_INT8 ? vectors * sizeof(v4sf) : 0;
+    s->key_cache = llm_buffer("key_cache", cache_size, MALLOC_CAP_DEFAULT);
+    s->value_cache = llm_buffer("value_cache", cache_size, MALLOC_CAP_DEFAULT);
+    s->key_scale = scale_size ? llm_buffer("key_scale", scale_size, MALLOC_CAP_DEFAULT) : NULL;
+    s->value_scale = scale_size ? llm_buffer("value_scale", scale_size, MALLOC_CAP_DEFAULT) : NULL;
+    ESP_LOGI(TAG, "KV cache: %zu bytes, %d bits per value, %s RAM", 2 * (cache_size + scale_size),
+             (int)(8 * sizeof(kv_t)), arena_region(&llm_arena, "key_cache") == ARENA_INTERNAL ? "internal" : "external");
+}
+
+void malloc_run_state(RunState *s, Config *p, int group_size)
+{
+    // zeroed buffers from the arena, where plan_buffers() decided which RAM each goes to
+    int kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
+    int head_size = p->dim / p->n_heads;
+    s->x = llm_buffer("x", p->dim * sizeof(v4sf), MALLOC_CAP_INTERNAL);
+    s->xb = llm_buffer("xb", p->dim * sizeof(v4sf), MALLOC_CAP_INTERNAL);
+    s->xb2 = llm_buffer("xb2", p->dim * sizeof(v4sf), MALLOC_CAP_INTERNAL);
+    s->hb = llm_buffer("hb", p->hidden_dim * sizeof(v4sf), MALLOC_CAP_INTERNAL);
+    s->q = llm_buffer("q", p->dim * sizeof(v4sf), MALLOC_CAP_INTERNAL);
+    s->k = llm_buffer("k", kv_dim * sizeof(v4sf), MALLOC_CAP_INTERNAL);
+    s->v = llm_buffer("v", kv_dim * sizeof(v4sf), MALLOC_CAP_INTERNAL);
+    malloc_kv_cache(s, p);
+    s->att = llm_buffer("att", (size_t)p->n_heads * LLM_ATTENTION_TILE * sizeof(v4sf), MALLOC_CAP_DEFAULT);
+    s->logits = llm_buffer("logits", p->vocab_size * sizeof(v4sf), MALLOC_CAP_INTERNAL);
+    s->spec_logits = NULL;
+    if (LLM_SPEC_DRAFT)
+    {
+        s->spec_logits = llm_buffer("spec_logits", (size_t)(LLM_SPEC_DRAFT + 1) * p->vocab_size * sizeof(v4sf), MALLOC_CAP_DEFAULT);
+    }
+    s->rope_cos = llm_buffer("rope_cos", head_size / 2 * sizeof(v4sf), MALLOC_CAP_INTERNAL);
+    s->rope_sin = llm_buffer("rope_sin", head_size / 2 * sizeof(v4sf), MALLOC_CAP_INTERNAL);
+    size_t rope_table = rope_table_size(head_size, p->seq_len);
+    float *rope_freq = llm_buffer("rope_freq", rope_freq_size(head_size), MALLOC_CAP_INTERNAL);
+    rope_init(&s->rope, head_size, p->seq_len, rope_freq,
+              rope_table ? llm_buffer("rope_table", rope_table, MALLOC_CAP_DEFAULT) : NULL);
+    s->xq = (QuantizedTensor){0};
+    s->hq = (QuantizedTensor){0};
+    if (group_size)
+    {
+        // activations are quantized right before each int8 matmul
+        s->xq.q = llm_buffer("xq", p->dim, MALLOC_CAP_INTERNAL);
+        s->xq.s = llm_buffer("xq_scales", p->dim / group_size * sizeof(v4sf), MALLOC_CAP_INTERNAL);
+        s->hq.q = llm_buffer("hq", p->hidden_dim, MALLOC_CAP_INTERNAL);
+        s->hq.s = llm_buffer("hq_scales", p->hidden_dim / group_size * sizeof(v4sf), MALLOC_CAP_INTERNAL);
+    }
+    s->cls_prescore = (QuantizedTensor){0};
+    s->cls_rows = NULL;
+    if (LLM_SPARSE_CLASSIFIER)
+    {
+        s->cls_rows = llm_buffer("cls_rows", p->vocab_size * sizeof(int), MALLOC_CAP_INTERNAL);
+        if (!group_size)
+        {
+            // filled from wcls by init_transformer()
+            s->cls_prescore.q = llm_buffer("cls_prescore", (size_t)p->vocab_size * p->dim, MALLOC_CAP_INTERNAL);
+            s->cls_prescore.s = llm_buffer("cls_prescore_scales", p->vocab_size * sizeof(v4sf), MALLOC_CAP_INTERNAL);
+        }
+    }
 }
 
 void free_run_state(RunState *s)
 {
-    free(s->x);
-    free(s->xb);
-    free(s->xb2);
-    free(s->hb);
-    free(s->hb2);
-    free(s->q);
-    free(s->att);
-    free(s->logits);
-    free(s->key_cache);
-    free(s->value_cache);
+    llm_buffer_free(s->x);
+    llm_buffer_free(s->xb);
+    llm_buffer_free(s->xb2);
+    llm_buffer_free(s->hb);
+    llm_buffer_free(s->q);
+    llm_buffer_free(s->k);
+    llm_buffer_free(s->v);
+    llm_buffer_free(s->att);
+    llm_buffer_free(s->logits);
+    llm_buffer_free(s->spec_logits);
+    llm_buffer_free(s->key_cache);
+    llm_buffer_free(s->rope_cos);
+    llm_buffer_free(s->rope_sin);
+    llm_buffer_free(s->rope.freq);
+    llm_buffer_free(s->rope.table_cos ? (void *)s->rope.table_cos : (void *)s->rope.table_q15);
+    llm_buffer_free(s->value_cache);
+    llm_buffer_free(s->key_scale);
+    llm_buffer_free(s->value_scale);
+    llm_buffer_free(s->xq.q);
+    llm_buffer_free(s->xq.s);
+    llm_buffer_free(s->hq.q);
+    llm_buffer_free(s->hq.s);
+    llm_buffer_free(s->cls_prescore.q);
+    llm_buffer_free(s->cls_prescore.s);
+    llm_buffer_free(s->cls_rows);
 }
 
-void memory_map_weights(TransformerWeights *w, Config *p, v4sf *ptr, int shared_weights)
+v4sf *memory_map_weights(TransformerWeights *w, Config *p, v4sf *ptr, int shared_weights)
 {
+    // returns the end of the last tensor
     int head_size = p->dim / p->n_heads;
     // make sure the multiplications below are done in 64bit to fit the parameter counts of 13B+ models
     unsigned long long n_layers = p->n_layers;
@@ -157,6 +390,243 @@ void memory_map_weights(TransformerWeights *w, Config *p, v4sf *ptr, int shared_
     ptr += p->seq_len * head_size / 2; // skip what used to be freq_cis_real (for RoPE)
     ptr += p->seq_len * head_size / 2; // skip what used to be freq_cis_imag (for RoPE)
     w->wcls = shared_weights ? w->token_embedding_table : ptr;
+    return shared_weights ? ptr : ptr + p->vocab_size * p->dim;
+}
+
+QuantizedTensor take_quantized_tensor(void **ptr, int size, int group_size)
+{
+    // a tensor is stored as size int8 values followed by its size / group_size scales
+    QuantizedTensor t;
+    t.q = (int8_t *)*ptr;
+    *ptr = (int8_t *)*ptr + size;
+    if ((uintptr_t)*ptr % sizeof(v4sf) != 0)
+    {
+        ESP_LOGE(TAG, "Misaligned Q8 scales, tensor size %d", size);
+        exit(EXIT_FAILURE);
+    }
+    t.s = (v4sf *)*ptr;
+    *ptr = (v4sf *)*ptr + size / group_size;
+    return t;
+}
+
+QuantizedTensor *alloc_quantized_tensors(int n)
+{
+    QuantizedTensor *res = malloc(n * sizeof(QuantizedTensor));
+    if (!res)
+    {
+        ESP_LOGE(TAG, "Malloc operation failed");
+        exit(EXIT_FAILURE);
+    }
+    return res;
+}
+
+QuantizedTensor *init_quantized_tensors(void **ptr, int n, int size_each, int group_size)
+{
+    QuantizedTensor *res = alloc_quantized_tensors(n);
+    for (int i = 0; i < n; i++)
+    {
+        res[i] = take_quantized_tensor(ptr, size_each, group_size);
+    }
+    return res;
+}
+
+QuantizedTensor slice_quantized_tensor(QuantizedTensor t, int offset, int group_size)
+{
+    // rows further down a row-wise concatenated tensor; offset is in values and group aligned
+    return (QuantizedTensor){t.q + offset, t.s + offset / group_size};
+}
+
+void *memory_map_weights_q8(TransformerWeights *w, Config *p, void *ptr, uint8_t shared_classifier, uint8_t layout)
+{
+    // returns the end of the last tensor
+    int head_size = p->dim / p->n_heads;
+    int kv_dim = p->n_kv_heads * head_size;
+    int gs = w->group_size;
+    // first are the parameters that are kept in fp32 (the rmsnorm (1D) weights)
+    v4sf *fptr = (v4sf *)ptr;
+    w->rms_att_weight = fptr;
+    fptr += p->n_layers * p->dim;
+    w->rms_ffn_weight = fptr;
+    fptr += p->n_layers * p->dim;
+    w->rms_final_weight = fptr;
+    fptr += p->dim;
+
+    // now read all the quantized weights
+    ptr = (void *)fptr;
+    w->q_tokens = init_quantized_tensors(&ptr, 1, p->vocab_size * p->dim, gs);
+    if (layout & Q8_LAYOUT_FUSED)
+    {
+        // each layer is laid out in the order forward() streams it
+        w->q_wq = alloc_quantized_tensors(p->n_layers);
+        w->q_wk = alloc_quantized_tensors(p->n_layers);
+        w->q_wv = alloc_quantized_tensors(p->n_layers);
+        w->q_wo = alloc_quantized_tensors(p->n_layers);
+        w->q_w1 = alloc_quantized_tensors(p->n_layers);
+        w->q_w2 = alloc_quantized_tensors(p->n_layers);
+        w->q_w3 = alloc_quantized_tensors(p->n_layers);
+        for (int l = 0; l < p->n_layers; l++)
+        {
+            QuantizedTensor qkv = take_quantized_tensor(&ptr, (p->dim + 2 * kv_dim) * p->dim, gs);
+            w->q_wq[l] = qkv;
+            w->q_wk[l] = slice_quantized_tensor(qkv, p->dim * p->dim, gs);
+            w->q_wv[l] = slice_quantized_tensor(qkv, (p->dim + kv_dim) * p->dim, gs);
+            w->q_wo[l] = take_quantized_tensor(&ptr, p->dim * p->dim, gs);
+            QuantizedTensor w13 = take_quantized_tensor(&ptr, 2 * p->hidden_dim * p->dim, gs);
+            w->q_w1[l] = w13;
+            w->q_w3[l] = slice_quantized_tensor(w13, p->hidden_dim * p->dim, gs);
+            w->q_w2[l] = take_quantized_tensor(&ptr, p->dim * p->hidden_dim, gs);
+        }
+    }
+    else
+    {
+        w->q_wq = init_quantized_tensors(&ptr, p->n_layers, p->dim * (p->n_heads * head_size), gs);
+        w->q_wk = init_quantized_tensors(&ptr, p->n_layers, p->dim * kv_dim, gs);
+        w->q_wv = init_quantized_tensors(&ptr, p->n_layers, p->dim * kv_dim, gs);
+        w->q_wo = init_quantized_tensors(&ptr, p->n_layers, (p->n_heads * head_size) * p->dim, gs);
+        w->q_w1 = init_quantized_tensors(&ptr, p->n_layers, p->dim * p->hidden_dim, gs);
+        w->q_w2 = init_quantized_tensors(&ptr, p->n_layers, p->hidden_dim * p->dim, gs);
+        w->q_w3 = init_quantized_tensors(&ptr, p->n_layers, p->dim * p->hidden_dim, gs);
+    }
+    w->q_wcls = shared_classifier ? w->q_tokens : init_quantized_tensors(&ptr, 1, p->dim * p->vocab_size, gs);
+    return ptr;
+}
+
+v4sf *container_f32(void *data, ContainerHeader *header, const char *name, size_t numel)
+{
+    const ContainerTensor *t = container_find(data, header, name, CONTAINER_DTYPE_F32, numel);
+    if (!t)
+    {
+        ESP_LOGE(TAG, "Checkpoint has no tensor %s", name);
+        exit(EXIT_FAILURE);
+    }
+    return (v4sf *)((char *)data + t->offset);
+}
+
+QuantizedTensor *container_q8(void *data, ContainerHeader *header, const char *name, int n, size_t size_each)
+{
+    // one QuantizedTensor per layer, viewing consecutive slices of the stored values and scales
+    const ContainerTensor *t = container_find(data, header, name, CONTAINER_DTYPE_Q8, n * size_each);
+    if (!t)
+    {
+        ESP_LOGE(TAG, "Checkpoint has no tensor %s", name);
+        exit(EXIT_FAILURE);
+    }
+    QuantizedTensor all = {(int8_t *)((char *)data + t->offset), (v4sf *)((char *)data + t->scale_offset)};
+    QuantizedTensor *res = alloc_quantized_tensors(n);
+    for (int i = 0; i < n; i++)
+    {
+        res[i] = slice_quantized_tensor(all, i * size_each, header->group_size);
+    }
+    return res;
+}
+
+void memory_map_weights_container(TransformerWeights *w, Config *p, void *data, ContainerHeader *header)
+{
+    size_t dim = p->dim;
+    size_t hidden_dim = p->hidden_dim;
+    size_t kv_dim = p->n_kv_heads * (dim / p->n_heads);
+    int n_layers = p->n_layers;
+    int shared_classifier = header->flags & CONTAINER_SHARED_CLASSIFIER;
+
+    // rmsnorm weights stay fp32 in either kind of checkpoint
+    w->rms_att_weight = container_f32(data, header, "rms_att", n_layers * dim);
+    w->rms_ffn_weight = container_f32(data, header, "rms_ffn", n_layers * dim);
+    w->rms_final_weight = container_f32(data, header, "rms_final", dim);
+
+    if (w->group_size)
+    {
+        if (w->group_size < 0 || dim % w->group_size != 0 || hidden_dim % w->group_size != 0)
+        {
+            ESP_LOGE(TAG, "Invalid Q8 group size %d", w->group_size);
+            exit(EXIT_FAILURE);
+        }
+        ESP_LOGI(TAG, "Q8 container, group size %d", w->group_size);
+        w->q_tokens = container_q8(data, header, "tok_embeddings", 1, p->vocab_size * dim);
+        w->q_wq = container_q8(data, header, "wq", n_layers, dim * dim);
+        w->q_wk = container_q8(data, header, "wk", n_layers, dim * kv_dim);
+        w->q_wv = container_q8(data, header, "wv", n_layers, dim * kv_dim);
+        w->q_wo = container_q8(data, header, "wo", n_layers, dim * dim);
+        w->q_w1 = container_q8(data, header, "w1", n_layers, dim * hidden_dim);
+        w->q_w2 = container_q8(data, header, "w2", n_layers, hidden_dim * dim);
+        w->q_w3 = container_q8(data, header, "w3", n_layers, dim * hidden_dim);
+        w->q_wcls = shared_classifier ? w->q_tokens : container_q8(data, header, "wcls", 1, p->vocab_size * dim);
+        return;
+    }
+
+    w->token_embedding_table = container_f32(data, header, "tok_embeddings", p->vocab_size * dim);
+    w->wq = container_f32(data, header, "wq", n_layers * dim * dim);
+    w->wk = container_f32(data, header, "wk", n_layers * dim * kv_dim);
+    w->wv = container_f32(data, header, "wv", n_layers * dim * kv_dim);
+    w->wo = container_f32(data, header, "wo", n_layers * dim * dim);
+    w->w1 = container_f32(data, header, "w1", n_layers * dim * hidden_dim);
+    w->w2 = container_f32(data, header, "w2", n_layers * hidden_dim * dim);
+    w->w3 = container_f32(data, header, "w3", n_layers * dim * hidden_dim);
+    w->wcls = shared_classifier ? w->token_embedding_table : container_f32(data, header, "wcls", p->vocab_size * dim);
+}
+
+size_t map_checkpoint(void *data, size_t file_size, Config *config, TransformerWeights *weights)
+{
+    // Q8 checkpoints and containers start with a magic number, legacy fp32 ones directly with the Config.
+    // returns the size of the checkpoint, which can be less than the file_size bytes available to it
+    // (a checkpoint flashed into a larger partition)
+    void *end;
+    uint32_t magic;
+    memcpy(&magic, data, sizeof(uint32_t));
+    int version = 0;
+    memcpy(&version, (char *)data + 4, sizeof(int));
+    if (magic == CHECKPOINT_MAGIC && version == CONTAINER_VERSION)
+    {
+        ContainerHeader header;
+        container_open(data, file_size, &header);
+        *config = header.config;
+        weights->group_size = header.group_size;
+        ESP_LOGI(TAG, "Vocab size if %d", config->vocab_size);
+        memory_map_weights_container(weights, config, data, &header);
+        end = (char *)data + header.total_size;
+    }
+    else if (magic == CHECKPOINT_MAGIC)
+    {
+        // header: magic, version, Config, shared classifier byte, group size, layout byte (packed)
+        char *header = (char *)data;
+        uint8_t shared_classifier;
+        uint8_t layout;
+        if (version != Q8_VERSION)
+        {
+            ESP_LOGE(TAG, "Unsupported Q8 checkpoint version %d", version);
+            exit(EXIT_FAILURE);
+        }
+        memcpy(config, header + 8, sizeof(Config));
+        memcpy(&shared_classifier, header + 8 + sizeof(Config), sizeof(uint8_t));
+        memcpy(&weights->group_size, header + 9 + sizeof(Config), sizeof(int));
+        memcpy(&layout, header + 13 + sizeof(Config), sizeof(uint8_t));
+        if (weights->group_size <= 0 || config->dim % weights->group_size != 0 ||
+            config->hidden_dim % weights->group_size != 0)
+        {
+            ESP_LOGE(TAG, "Invalid Q8 group size %d", weights->group_size);
+            exit(EXIT_FAILURE);
+        }
+        ESP_LOGI(TAG, "Q8 checkpoint, group size %d%s", weights->group_size, (layout & Q8_LAYOUT_FUSED) ? ", fused layout" : "");
+        ESP_LOGI(TAG, "Vocab size if %d", config->vocab_size);
+        end = memory_map_weights_q8(weights, config, header + Q8_HEADER_SIZE, shared_classifier, layout);
+    }
+    else
+    {
+        memcpy(config, data, sizeof(Config));
+        // negative vocab size is hacky way of signaling unshared weights. bit yikes.
+        int shared_weights = config->vocab_size > 0 ? 1 : 0;
+        config->vocab_size = abs(config->vocab_size);
+        weights->group_size = 0;
+        ESP_LOGI(TAG, "Vocab size if %d", config->vocab_size);
+        v4sf *weights_ptr = (v4sf *)data + sizeof(Config) / sizeof(v4sf);
+        end = memory_map_weights(weights, config, weights_ptr, shared_weights);
+    }
+    size_t size = (char *)end - (char *)data;
+    if (size > file_size)
+    {
+        ESP_LOGE(TAG, "Checkpoint needs %zu bytes, only %zu available", size, file_size);
+        exit(EXIT_FAILURE);
+    }
+    return size;
 }
 
 void read_checkpoint(char *checkpoint, Config *config, TransformerWeights *weights,
@@ -168,22 +638,14 @@ void read_checkpoint(char *checkpoint, Config *config, TransformerWeights *weigh
         ESP_LOGE(TAG, "Couldn't open file %s", checkpoint);
         exit(EXIT_FAILURE);
     }
-    // read in the config header
-    if (fread(config, sizeof(Config), 1, file) != 1)
-    {
-        exit(EXIT_FAILURE);
-    }
-    // negative vocab size is hacky way of signaling unshared weights. bit yikes.
-    int shared_weights = config->vocab_size > 0 ? 1 : 0;
-    config->vocab_size = abs(config->vocab_size);
-    ESP_LOGI(TAG, "Vocab size if %d", config->vocab_size);
     // figure out the file size
     fseek(file, 0, SEEK_END); // move file pointer to end of file
     *file_size = ftell(file); // get the file size, in bytes
     fseek(file, 0, SEEK_SET); // move back to beginning for reading
     ESP_LOGI(TAG, "File size: %zu bytes", *file_size);
     ESP_LOGI(TAG, "Free ram available: %lu", esp_get_free_heap_size());
-    *data = malloc(*file_size);
+    // aligned like the flash mapping, so container tensors can be used where they are
+    *data = heap_caps_aligned_alloc(64, *file_size, MALLOC_CAP_DEFAULT);
     if (*data == NULL)
     {
         ESP_LOGE(TAG, "Malloc operation failed");
@@ -198,37 +660,84 @@ void read_checkpoint(char *checkpoint, Config *config, TransformerWeights *weigh
         exit(EXIT_FAILURE);
     }
     fclose(file);
+    *fd = -1;
 
     ESP_LOGI(TAG, "Successfully read LLM into memory");
     ESP_LOGI(TAG, "Free ram available: %lu", esp_get_free_heap_size());
-    v4sf *weights_ptr = *data + sizeof(Config) / sizeof(v4sf);
-    memory_map_weights(weights, config, weights_ptr, shared_weights);
+    *file_size = map_checkpoint(*data, *file_size, config, weights);
     ESP_LOGI(TAG, "Successfully read checkpoint");
 }
 
+void mmap_checkpoint(const char *partition_label, Config *config, TransformerWeights *weights,
+                     int *fd, v4sf **data, size_t *file_size)
+{
+    const esp_partition_t *partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, partition_label);
+    if (!partition)
+    {
+        ESP_LOGE(TAG, "Couldn't find partition %s", partition_label);
+        exit(EXIT_FAILURE);
+    }
+    // the weights are used straight from the flash cache, nothing is copied into PSRAM
+    const void *ptr;
+    esp_err_t ret = esp_partition_mmap(partition, 0, partition->size, ESP_PARTITION_MMAP_DATA, &ptr, &model_mmap_handle);
+    if (ret != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to mmap partition %s (%s)", partition_label, esp_err_to_name(ret));
+        exit(EXIT_FAILURE);
+    }
+    model_mmap_ptr = ptr;
+    *data = (v4sf *)ptr;
+    *fd = -1;
+    ESP_LOGI(TAG, "Mapped partition %s: %lu bytes", partition_label, (unsigned long)partition->size);
+    // the rest of the partition is erased padding, which nothing reads
+    *file_size = map_checkpoint(*data, partition->size, config, weights);
+    ESP_LOGI(TAG, "Successfully mapped checkpoint, %zu bytes", *file_size);
+}
+
+void quantize(QuantizedTensor *qx, v4sf *x, int n, int group_size); // with the Q8 helpers below
+
+void init_transformer(Transformer *t)
+{
+    // plan every buffer inference needs and allocate the two arena regions, then
+    // carve the RunState buffers out of them
+    size_t largest = heap_caps_get_largest_free_block(MALLOC_CAP_INTERNAL);
+    plan_buffers(&llm_arena, &t->config, t->weights.group_size);
+    arena_plan(&llm_arena, largest > LLM_ARENA_INTERNAL_RESERVE ? largest - LLM_ARENA_INTERNAL_RESERVE : 0);
+    malloc_run_state(&t->state, &t->config, t->weights.group_size);
+    snapshot_init(t);
+    if (t->state.cls_prescore.q)
+    {
+        // the sparse classifier's pre-score weights: each row of wcls in int8 with its own scale
+        int dim = t->config.dim;
+        for (int r = 0; r < t->config.vocab_size; r++)
+        {
+            QuantizedTensor row = {t->state.cls_prescore.q + (size_t)r * dim, t->state.cls_prescore.s + r};
+            quantize(&row, t->weights.wcls + (size_t)r * dim, dim, dim);
+        }
+    }
+    arena_report(&llm_arena);
+    ESP_LOGI(TAG, "Transformer successfully built");
+
+    // worker on core 1 that takes half of every matmul and of the attention heads
+    llm_pool_init();
+    ESP_LOGI(TAG, "Free PSRAM: %zu bytes, free internal: %zu bytes",
+             heap_caps_get_free_size(MALLOC_CAP_SPIRAM), heap_caps_get_free_size(MALLOC_CAP_INTERNAL));
+}
+
 void build_transformer(Transformer *t, char *checkpoint_path)
 {
     // read in the Config and the Weights from the checkpoint
+    memset(&t->weights, 0, sizeof(TransformerWeights));
     read_checkpoint(checkpoint_path, &t->config, &t->weights, &t->fd, &t->data, &t->file_size);
-    // allocate the RunState buffers
-    malloc_run_state(&t->state, &t->config);
-    ESP_LOGI(TAG, "Transformer successfully built");
-
-    // FreeRTos Tasks
-    xEventGroup = xEventGroupCreate();
-    ForwardEventGroup = xEventGroupCreate();
-    semaDataReady = xSemaphoreCreateBinary();
-    semaForwardDataReady = xSemaphoreCreateBinary();
-    xSemaphoreGive(semaDataReady);
-    xSemaphoreTake(semaDataReady, portMAX_DELAY);
-    xSemaphoreGive(semaForwardDataReady);
-    xSemaphoreTake(semaForwardDataReady, portMAX_DELAY);
+    init_transformer(t);
+}
 
-    matmul_params = malloc(sizeof(MatMulTaskParams));
-    forward_params = malloc(sizeof(ForwardTaskParams));
-    xTaskCreatePinnedToCore(matmul_task, "MatMul2", 2048, matmul_params, 19, &matmul_task_2, 1);             // Run on Core 1
-    xTaskCreatePinnedToCore(forward_task, "ForwardTask", 2048, forward_params, 19, &handle_forward_task, 1); // Run on Core 1
-    ESP_LOGI(TAG, "Created FreeRTOS Tasks");
+void build_transformer_from_partition(Transformer *t, const char *partition_label)
+{
+    // map the Config and the Weights from a raw flash partition
+    memset(&t->weights, 0, sizeof(TransformerWeights));
+    mmap_checkpoint(partition_label, &t->config, &t->weights, &t->fd, &t->data, &t->file_size);
+    init_transformer(t);
 }
 
 void free_transformer(Transformer *t)
@@ -242,173 +751,536 @@ void free_transformer(Transformer *t)
     {
         close(t->fd);
     }
-    // free the RunState buffers
+    // free the QuantizedTensor headers, the data they point to lives in the checkpoint
+    TransformerWeights *w = &t->weights;
+    if (w->q_wcls != w->q_tokens)
+    {
+        free(w->q_wcls);
+    }
+    free(w->q_tokens);
+    free(w->q_wq);
+    free(w->q_wk);
+    free(w->q_wv);
+    free(w->q_wo);
+    free(w->q_w1);
+    free(w->q_w2);
+    free(w->q_w3);
+    // free the RunState buffers, then the arena they live in
     free_run_state(&t->state);
+    arena_free(&llm_arena);
 }
 
 // ----------------------------------------------------------------------------
-// neural net blocks; the dynamics of the Transformer
+// neural net blocks; the dynamics of the Transformer. rmsnorm, softmax, the
+// residual add and the SwiGLU gate are in llm_kernels.c
 
-void rmsnorm(v4sf *o, v4sf *x, v4sf *weight, int size)
+// ----------------------------------------------------------------------------
+// Q8 (int8, symmetric, per-group scale) helpers
+
+void dequantize_row(v4sf *x, QuantizedTensor *qx, int row, int n, int group_size)
 {
-    // calculate sum of squares
-    v4sf ss = 0.0f;
-    for (int j = 0; j < size; j++)
+    int offset = row * n;
+    for (int i = 0; i < n; i++)
     {
-        ss += x[j] * x[j];
+        x[i] = qx->q[offset + i] * qx->s[(offset + i) / group_size];
     }
-    ss /= size;
-    ss += 1e-5f;
-    ss = 1.0f / sqrtf(ss);
-    // normalize and scale
-    for (int j = 0; j < size; j++)
+}
+
+void quantize(QuantizedTensor *qx, v4sf *x, int n, int group_size)
+{
+    int num_groups = n / group_size;
+    const v4sf Q_MAX = 127.0f;
+    for (int group = 0; group < num_groups; group++)
     {
-        o[j] = weight[j] * (ss * x[j]);
+        // find the max absolute value in the current group
+        v4sf wmax = 0.0f;
+        for (int i = 0; i < group_size; i++)
+        {
+            v4sf val = fabsf(x[group * group_size + i]);
+            if (val > wmax)
+            {
+                wmax = val;
+            }
+        }
+        // calculate and write the scaling factor
+        v4sf scale = wmax / Q_MAX;
+        qx->s[group] = scale;
+        // calculate and write the quantized values
+        for (int i = 0; i < group_size; i++)
+        {
+            v4sf quant_value = scale > 0.0f ? x[group * group_size + i] / scale : 0.0f;
+            qx->q[group * group_size + i] = (int8_t)roundf(quant_value);
+        }
+    }
+}
+
+v4sf matmul_row(MatMulTaskParams *p, int i)
+{
+    // dot product of row i of W (d,n) with x (n,)
+    v4sf val = 0.0f;
+    if (p->wq == NULL)
+    {
+        v4sf *row = &p->w[i * p->n]; // Pointer to the start of the current row in matrix w
+        dsps_dotprod_f32_aes3(row, p->x, &val, p->n);
+        return val;
+    }
+    // int8 path: integer dot products inside each group, scaled back to float per group.
+    // esp-dsp's s8/s16 dot products shift and saturate their result down to 8/16 bits,
+    // which loses the accumulator we need here, so the inner loop stays in plain C.
+    int gs = p->group_size;
+    int8_t *xq = p->xq->q;
+    v4sf *xs = p->xq->s;
+    int8_t *row = p->wq->q + i * p->n;
+    v4sf *ws = p->wq->s + i * p->n / gs;
+    for (int j = 0, g = 0; j < p->n; j += gs, g++)
+    {
+        int32_t ival = 0;
+        for (int k = 0; k < gs; k++)
+        {
+            ival += (int32_t)xq[j + k] * (int32_t)row[j + k];
+        }
+        val += ((v4sf)ival) * ws[g] * xs[g];
+    }
+    return val;
+}
+
+void matmul_rows(void *arg, int start, int end)
+{
+    // computes rows [start, end) of xout = W (d,n) @ x (n,)
+    MatMulTaskParams *p = (MatMulTaskParams *)arg;
+    for (int i = start; i < end; i++)
+    {
+        p->xout[i] = matmul_row(p, i);
     }
 }
 
-void softmax(v4sf *x, int size)
+void stacked_matmul_rows(void *arg, int start, int end)
 {
-    // find max value (for numerical stability)
-    v4sf max_val = x[0];
-    for (int i = 1; i < size; i++)
+    // rows [start, end) of the matrices stacked on top of each other, e.g. [wq;wk;wv]
+    StackedMatMulParams *f = (StackedMatMulParams *)arg;
+    int offset = 0;
+    for (int m = 0; m < f->count; m++)
     {
-        if (x[i] > max_val)
+        int d = f->part[m].d;
+        int lo = start > offset ? start - offset : 0;
+        int hi = end - offset < d ? end - offset : d;
+        if (lo < hi)
         {
-            max_val = x[i];
+            matmul_rows(&f->part[m], lo, hi);
         }
+        offset += d;
+    }
+}
+
+void swiglu_rows(void *arg, int start, int end)
+{
+    // rows [start, end) of w1 and w3 together, with the SwiGLU applied before anything is stored:
+    // hb = silu(w1(x)) * w3(x)
+    StackedMatMulParams *f = (StackedMatMulParams *)arg;
+    v4sf *hb = f->part[0].xout;
+    for (int i = start; i < end; i++)
+    {
+        v4sf val = matmul_row(&f->part[0], i);
+        // silu(x)=x*σ(x), where σ(x) is the logistic sigmoid
+        val *= llm_sigmoid(val);
+        // elementwise multiply with w3(x)
+        val *= matmul_row(&f->part[1], i);
+        hb[i] = val;
+    }
+}
+
+void batch_matmul_rows(void *arg, int start, int end)
+{
+    // rows [start, end) of W for all T tokens at once, so each weight row is fetched once per chunk
+    BatchMatMulParams *p = (BatchMatMulParams *)arg;
+    if (p->wq == NULL)
+    {
+        // (end - start, n) @ (n, T): the weight rows are the left operand of the GEMM
+        dspm_mult_f32_aes3(p->w + start * p->n, p->xt, p->ct + start * p->T, end - start, p->n, p->T);
+        for (int i = start; i < end; i++)
+        {
+            for (int t = 0; t < p->T; t++)
+            {
+                p->out[t * p->d + i] = p->ct[i * p->T + t];
+            }
+        }
+        return;
+    }
+    // int8 weights: same group dot products as matmul_row(), with the row staying in cache across tokens
+    MatMulTaskParams row = {.wq = p->wq, .group_size = p->group_size, .n = p->n};
+    for (int i = start; i < end; i++)
+    {
+        for (int t = 0; t < p->T; t++)
+        {
+            row.xq = &p->xq[t];
+            p->out[t * p->d + i] = matmul_row(&row, i);
+        }
+    }
+}
+
+#if LLM_KV_CACHE == LLM_KV_CACHE_F16
+static inline uint16_t f32_to_f16(float f)
+{
+    // round to nearest even; overflow saturates to infinity, tiny values flush to zero
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+    uint32_t sign = (x >> 16) & 0x8000;
+    int32_t exp = ((x >> 23) & 0xff) - 127 + 15;
+    uint32_t mant = x & 0x7fffff;
+    if (exp >= 31)
+    {
+        return sign | 0x7c00;
+    }
+    if (exp <= 0)
+    {
+        return sign;
+    }
+    uint32_t h = sign | (exp << 10) | (mant >> 13);
+    uint32_t rest = mant & 0x1fff;
+    if (rest > 0x1000 || (rest == 0x1000 && (h & 1)))
+    {
+        h++;
+    }
+    return h;
+}
+
+static inline float f16_to_f32(uint16_t h)
+{
+    // only ever sees values written by f32_to_f16, so there are no subnormals
+    uint32_t x = (uint32_t)(h & 0x8000) << 16;
+    if (h & 0x7fff)
+    {
+        x |= ((uint32_t)(h & 0x7fff) << 13) + ((127 - 15) << 23);
+    }
+    float f;
+    memcpy(&f, &x, sizeof(f));
+    return f;
+}
+#endif
+
+void kv_store(kv_t *cache, v4sf *scales, int vec, v4sf *x, int head_size)
+{
+    // writes the head vector x into slot vec of the cache
+    kv_t *dst = cache + vec * head_size;
+#if LLM_KV_CACHE == LLM_KV_CACHE_F16
+    for (int i = 0; i < head_size; i++)
+    {
+        dst[i] = f32_to_f16(x[i]);
+    }
+#elif LLM_KV_CACHE == LLM_KV_CACHE_INT8
+    v4sf wmax = 0.0f;
+    for (int i = 0; i < head_size; i++)
+    {
+        wmax = fmaxf(wmax, fabsf(x[i]));
+    }
+    v4sf scale = wmax / 127.0f;
+    scales[vec] = scale;
+    for (int i = 0; i < head_size; i++)
+    {
+        dst[i] = (int8_t)roundf(scale > 0.0f ? x[i] / scale : 0.0f);
+    }
+#else
+    memcpy(dst, x, head_size * sizeof(v4sf));
+#endif
+}
+
+void kv_store_position(RunState *s, Config *p, int l, int pos, v4sf *k, v4sf *v)
+{
+    // moves the (already rotated) key and value of one position into the cache
+    int head_size = p->dim / p->n_heads;
+    int vec = (l * p->seq_len + pos) * p->n_kv_heads;
+    for (int h = 0; h < p->n_kv_heads; h++)
+    {
+        kv_store(s->key_cache, s->key_scale, vec + h, k + h * head_size, head_size);
+        kv_store(s->value_cache, s->value_scale, vec + h, v + h * head_size, head_size);
     }
-    // exp and sum
-    v4sf sum = 0.0f;
-    for (int i = 0; i < size; i++)
+}
+
+void kv_load(const kv_t *cache, const v4sf *scales, int vec, v4sf *x, int head_size)
+{
+    // reads the head vector in slot vec of the cache back as floats
+    const kv_t *src = cache + vec * head_size;
+#if LLM_KV_CACHE == LLM_KV_CACHE_F16
+    for (int i = 0; i < head_size; i++)
     {
-        x[i] = expf(x[i] - max_val);
-        sum += x[i];
+        x[i] = f16_to_f32(src[i]);
     }
-    // normalize
-    for (int i = 0; i < size; i++)
+#elif LLM_KV_CACHE == LLM_KV_CACHE_INT8
+    for (int i = 0; i < head_size; i++)
     {
-        x[i] /= sum;
+        x[i] = src[i] * scales[vec];
     }
+#else
+    memcpy(x, src, head_size * sizeof(v4sf));
+#endif
 }
 
-void matmul_task(void *params)
+void kv_shift(Transformer *t, int n_keep, int n_discard, int n_past)
 {
-    const TickType_t xDelay = 1 / portTICK_PERIOD_MS;
-    MatMulTaskParams *p = (MatMulTaskParams *)params;
-    TaskHandle_t current_task = xTaskGetCurrentTaskHandle();
-    char *tName = pcTaskGetName(current_task);
-    // ESP_LOGI(TAG, "Created Task %s", tName);
-    for (;;)
+    // keys are stored rotated to their position. RoPE scores only depend on how far apart
+    // q and k are, so rotating each moved key back by n_discard keeps the history reading
+    // the same to every later query. values carry no position and are moved as they are
+    Config *p = &t->config;
+    RunState *s = &t->state;
+    int head_size = p->dim / p->n_heads;
+    int kv_dim = p->n_kv_heads * head_size;
+    rope_row(&s->rope, n_discard, s->rope_cos, s->rope_sin);
+    for (int j = 0; j < head_size / 2; j++)
+    {
+        s->rope_sin[j] = -s->rope_sin[j];
+    }
+    for (int l = 0; l < p->n_layers; l++)
     {
-        if (xSemaphoreTake(semaDataReady, portMAX_DELAY) == pdTRUE)
+        for (int pos = n_keep + n_discard; pos < n_past; pos++)
         {
-            //   ESP_LOGI(TAG, "Started Task %s", tName);
-            for (int i = p->start; i < p->end; i++)
+            int src = (l * p->seq_len + pos) * p->n_kv_heads;
+            int dst = src - n_discard * p->n_kv_heads;
+            // s->k is free between tokens, forward() rewrites it before reading
+            for (int h = 0; h < p->n_kv_heads; h++)
             {
-                v4sf val = 0.0f;
-                v4sf *row = &p->w[i * p->n]; // Pointer to the start of the current row in matrix w
-                dsps_dotprod_f32_aes3(row, p->x, &val, p->n);
-                p->xout[i] = val;
+                kv_load(s->key_cache, s->key_scale, src + h, s->k + h * head_size, head_size);
             }
-            //    ESP_LOGI(TAG, "Completed task %s", tName);
-            xSemaphoreGive(semaDataReady);
-            xEventGroupSync(xEventGroup, p->task_num, ALL_SYNC_BITS, portMAX_DELAY);
+            rope_rotate(s->k, kv_dim, s->rope_cos, s->rope_sin, head_size);
+            for (int h = 0; h < p->n_kv_heads; h++)
+            {
+                kv_store(s->key_cache, s->key_scale, dst + h, s->k + h * head_size, head_size);
+            }
+            memmove(s->value_cache + dst * head_size, s->value_cache + src * head_size, kv_dim * sizeof(kv_t));
+            if (s->value_scale)
+            {
+                memmove(s->value_scale + dst, s->value_scale + src, p->n_kv_heads * sizeof(v4sf));
+            }
+        }
+    }
+}
+
+static inline float kv_elem(const kv_t *vec, int i)
+{
+    // element i of a cached head vector, before its int8 scale
+#if LLM_KV_CACHE == LLM_KV_CACHE_F16
+    return f16_to_f32(vec[i]);
+#else
+    return vec[i];
+#endif
+}
+
+static inline void kv_dot_group(float *scores, const kv_t *k, const v4sf *scales, int vec, const v4sf *q, int n_q, int head_size)
+{
+    // q . k for n_q consecutive query heads against the cached head vector k in slot vec,
+    // so each element of k is read and dequantized once for all of them
+    for (int j = 0; j < n_q; j++)
+    {
+        scores[j] = 0.0f;
+    }
+    for (int i = 0; i < head_size; i++)
+    {
+        v4sf ki = kv_elem(k, i);
+        for (int j = 0; j < n_q; j++)
+        {
+            scores[j] += q[j * head_size + i] * ki;
+        }
+    }
+#if LLM_KV_CACHE == LLM_KV_CACHE_INT8
+    for (int j = 0; j < n_q; j++)
+    {
+        scores[j] *= scales[vec];
+    }
+#endif
+}
+
+static inline void kv_accumulate_group(v4sf *xb, const float *a, const kv_t *v, const v4sf *scales, int vec, int n_q, int head_size)
+{
+    // xb[j] += a[j] * v for n_q consecutive query heads and the cached head vector v in slot vec
+    float w[LLM_ATTENTION_GROUP];
+    for (int j = 0; j < n_q; j++)
+    {
+#if LLM_KV_CACHE == LLM_KV_CACHE_INT8
+        w[j] = a[j] * scales[vec];
+#else
+        w[j] = a[j];
+#endif
+    }
+    for (int i = 0; i < head_size; i++)
+    {
+        v4sf vi = kv_elem(v, i);
+        for (int j = 0; j < n_q; j++)
+        {
+            xb[j * head_size + i] += w[j] * vi;
         }
     }
 }
 
-void forward_task(void *params)
+void attention_heads(void *arg, int start, int end)
 {
-    const TickType_t xDelay = 1 / portTICK_PERIOD_MS;
-    ForwardTaskParams *t_params = (ForwardTaskParams *)params;
-    TaskHandle_t current_task = xTaskGetCurrentTaskHandle();
-    char *tName = pcTaskGetName(current_task);
-    // ESP_LOGI(TAG, "Created Task %s", tName);
-    for (;;)
+    ForwardTaskParams *t_params = (ForwardTaskParams *)arg;
+    RunState *s = t_params->s;
+    int head_size = t_params->head_size;
+    int n_kv_heads = t_params->kv_dim / head_size;
+    v4sf scale = 1.0f / sqrtf(head_size);
+    // query heads [start, end) go in groups that share a kv head (at most LLM_ATTENTION_GROUP
+    // at a time), so with grouped-query attention each cached key and value is streamed
+    // once per group rather than once per query head
+    int h0 = start;
+    while (h0 < end)
     {
-        if (xSemaphoreTake(semaForwardDataReady, portMAX_DELAY) == pdTRUE)
+        int kv_head = h0 / t_params->kv_mul;
+        int h1 = (kv_head + 1) * t_params->kv_mul;
+        h1 = h1 < end ? h1 : end;
+        h1 = h1 < h0 + LLM_ATTENTION_GROUP ? h1 : h0 + LLM_ATTENTION_GROUP;
+        int n_q = h1 - h0;
+
+        // the query vectors of the group, with 1/sqrt(head_size) folded in so the
+        // scores come out scaled. q is not read again after attention
+        v4sf *q = t_params->q + h0 * head_size;
+        for (int i = 0; i < n_q * head_size; i++)
+        {
+            q[i] *= scale;
+        }
+        // one tile of scores per query head; each tile of timesteps is scored, turned into
+        // weights and applied to the values before the next, with the softmax done online:
+        // a running max and sum per head, and xb rescaled whenever the max goes up
+        v4sf *att = s->att + h0 * LLM_ATTENTION_TILE;
+        v4sf *xb = t_params->xb + h0 * head_size;
+        memset(xb, 0, n_q * head_size * sizeof(v4sf));
+        float max_score[LLM_ATTENTION_GROUP];
+        float sum[LLM_ATTENTION_GROUP];
+        for (int j = 0; j < n_q; j++)
+        {
+            max_score[j] = -INFINITY;
+            sum[j] = 0.0f;
+        }
+        // cache slot of the kv head's vector at timestep 0; each timestep is n_kv_heads slots further
+        int vec0 = t_params->loff / head_size + kv_head;
+        float scores[LLM_ATTENTION_GROUP];
+        // iterate over all timesteps, including the current one
+        for (int t0 = 0; t0 <= t_params->pos; t0 += LLM_ATTENTION_TILE)
         {
-            //   ESP_LOGI(TAG, "Started Task %s", tName);
-            int h;
-            // #pragma omp parallel for private(h)
-            for (h = t_params->start; h < t_params->end; h++)
+            int n_t = t_params->pos + 1 - t0 < LLM_ATTENTION_TILE ? t_params->pos + 1 - t0 : LLM_ATTENTION_TILE;
+            for (int t = 0; t < n_t; t++)
             {
-                // get the query vector for this head
-                v4sf *q = t_params->s->q + h * t_params->head_size;
-                // attention scores for this head
-                v4sf *att = t_params->s->att + h * t_params->p->seq_len;
-                // iterate over all timesteps, including the current one
-                for (int t = 0; t <= t_params->pos; t++)
+                int vec = vec0 + (t0 + t) * n_kv_heads;
+                kv_dot_group(scores, s->key_cache + vec * head_size, s->key_scale, vec, q, n_q, head_size);
+                for (int j = 0; j < n_q; j++)
                 {
-                    // get the key vector for this head and at this timestep
-                    v4sf *k = t_params->s->key_cache + t_params->loff + t * t_params->kv_dim + (h / t_params->kv_mul) * t_params->head_size;
-                    // calculate the attention score as the dot product of q and k
-                    v4sf score = 0.0f;
-                    for (int i = 0; i < t_params->head_size; i++)
-                    {
-                        score += q[i] * k[i];
-                    }
-                    score /= sqrtf(t_params->head_size);
-                    // save the score to the attention buffer
-                    att[t] = score;
+                    att[j * LLM_ATTENTION_TILE + t] = scores[j];
                 }
+            }
 
-                // softmax the scores to get attention weights, from 0..pos inclusively
-                softmax(att, t_params->pos + 1);
-
-                // weighted sum of the values, store back into xb
-                v4sf *xb = t_params->s->xb + h * t_params->head_size;
-                memset(xb, 0, t_params->head_size * sizeof(v4sf));
-                for (int t = 0; t <= t_params->pos; t++)
+            for (int j = 0; j < n_q; j++)
+            {
+                v4sf *row = att + j * LLM_ATTENTION_TILE;
+                float tile_max = max_score[j];
+                for (int t = 0; t < n_t; t++)
+                {
+                    tile_max = row[t] > tile_max ? row[t] : tile_max;
+                }
+                if (tile_max > max_score[j])
                 {
-                    // get the value vector for this head and at this timestep
-                    v4sf *v = t_params->s->value_cache + t_params->loff + t * t_params->kv_dim + (h / t_params->kv_mul) * t_params->head_size;
-                    // get the attention weight for this timestep
-                    v4sf a = att[t];
-                    // accumulate the weighted value into xb
-                    for (int i = 0; i < t_params->head_size; i++)
+                    // exp(-inf) is 0, so the first tile only sets the max
+                    float rescale = llm_expf(max_score[j] - tile_max);
+                    sum[j] *= rescale;
+                    for (int i = 0; i < head_size; i++)
                     {
-                        xb[i] += a * v[i];
+                        xb[j * head_size + i] *= rescale;
                     }
+                    max_score[j] = tile_max;
                 }
+                for (int t = 0; t < n_t; t++)
+                {
+                    row[t] = llm_expf(row[t] - tile_max);
+                    sum[j] += row[t];
+                }
+            }
+
+            // weighted sum of the values of the tile, into xb
+            for (int t = 0; t < n_t; t++)
+            {
+                int vec = vec0 + (t0 + t) * n_kv_heads;
+                for (int j = 0; j < n_q; j++)
+                {
+                    scores[j] = att[j * LLM_ATTENTION_TILE + t];
+                }
+                kv_accumulate_group(xb, scores, s->value_cache + vec * head_size, s->value_scale, vec, n_q, head_size);
             }
-            //   ESP_LOGI(TAG, "Completed task %s", tName);
-            xSemaphoreGive(semaForwardDataReady);
-            xEventGroupSync(ForwardEventGroup, t_params->task_num, ALL_FORWARD_TASKS, portMAX_DELAY);
         }
+
+        // normalize by the softmax sum
+        for (int j = 0; j < n_q; j++)
+        {
+            float inv_sum = 1.0f / sum[j];
+            for (int i = 0; i < head_size; i++)
+            {
+                xb[j * head_size + i] *= inv_sum;
+            }
+        }
+        h0 = h1;
     }
 }
 
 void matmul(v4sf *xout, v4sf *x, v4sf *w, int n, int d)
 {
-
     // d is the number of rows
     // n is the number of columns
     // d X n
-    *matmul_params = (MatMulTaskParams){xout, x, w, d / 2, d, n, d, TASK_1_BIT};
-    xSemaphoreGive(semaDataReady);
-    for (int i = 0; i < d / 2; i++)
+    MatMulTaskParams job = {.xout = xout, .x = x, .w = w, .n = n, .d = d};
+    llm_pool_parallel_for(matmul_rows, &job, d);
+}
+
+void matmul_q8(v4sf *xout, QuantizedTensor *x, QuantizedTensor *w, int n, int d, int group_size)
+{
+    MatMulTaskParams job = {.xout = xout, .xq = x, .wq = w, .group_size = group_size, .n = n, .d = d};
+    llm_pool_parallel_for(matmul_rows, &job, d);
+}
+
+void matmul_qkv(RunState *s, TransformerWeights *w, int l, int dim, int kv_dim)
+{
+    // q, k and v all read xb, so they go out as one job over dim + 2 * kv_dim rows
+    StackedMatMulParams job = {.count = 3};
+    v4sf *out[3] = {s->q, s->k, s->v};
+    int rows[3] = {dim, kv_dim, kv_dim};
+    for (int m = 0; m < 3; m++)
     {
-        v4sf val = 0.0f;
-        v4sf *row = &w[i * n]; // Pointer to the start of the current row in matrix w
-        dsps_dotprod_f32_aes3(row, x, &val, n);
-        xout[i] = val;
+        job.part[m] = (MatMulTaskParams){.xout = out[m], .x = s->xb, .xq = &s->xq, .group_size = w->group_size, .n = dim, .d = rows[m]};
     }
-    if (xSemaphoreTake(semaDataReady, portMAX_DELAY) == pdTRUE)
+    if (w->group_size)
     {
-        xEventGroupSync(xEventGroup,
-                        TASK_0_BIT,
-                        ALL_SYNC_BITS,
-                        portMAX_DELAY);
+        job.part[0].wq = w->q_wq + l;
+        job.part[1].wq = w->q_wk + l;
+        job.part[2].wq = w->q_wv + l;
+    }
+    else
+    {
+        job.part[0].w = w->wq + l * dim * dim;
+        job.part[1].w = w->wk + l * dim * kv_dim;
+        job.part[2].w = w->wv + l * dim * kv_dim;
+    }
+    llm_pool_parallel_for(stacked_matmul_rows, &job, dim + 2 * kv_dim);
+}
 
-        xEventGroupClearBits(xEventGroup, ALL_SYNC_BITS);
+void matmul_swiglu(RunState *s, TransformerWeights *w, int l, int dim, int hidden_dim)
+{
+    // w1 and w3 in one job, writing silu(w1(x)) * w3(x) straight into hb
+    StackedMatMulParams job = {.count = 2};
+    for (int m = 0; m < 2; m++)
+    {
+        job.part[m] = (MatMulTaskParams){.xout = s->hb, .x = s->xb, .xq = &s->xq, .group_size = w->group_size, .n = dim, .d = hidden_dim};
+    }
+    if (w->group_size)
+    {
+        job.part[0].wq = w->q_w1 + l;
+        job.part[1].wq = w->q_w3 + l;
+    }
+    else
+    {
+        job.part[0].w = w->w1 + l * dim * hidden_dim;
+        job.part[1].w = w->w3 + l * dim * hidden_dim;
     }
-    //   ESP_LOGI(TAG, "Completed MatMul tasks");
+    llm_pool_parallel_for(swiglu_rows, &job, hidden_dim);
 }
 
-v4sf *forward(Transformer *transformer, int token, int pos)
+v4sf *forward_layers(Transformer *transformer, int token, int pos)
 {
+    // every layer and the final rmsnorm for one token, leaving the classifier input in x
     ESP_LOGD(TAG, "ram available: %lu", esp_get_free_heap_size());
 
     // a few convenience variables
@@ -421,172 +1293,645 @@ v4sf *forward(Transformer *transformer, int token, int pos)
     int kv_mul = p->n_heads / p->n_kv_heads; // integer multiplier of the kv sharing in multiquery
     int hidden_dim = p->hidden_dim;
     int head_size = dim / p->n_heads;
+    int gs = w->group_size;
+    LLM_PROF_TOKEN_BEGIN();
 
     // copy the token embedding into x
-    v4sf *content_row = w->token_embedding_table + token * dim;
-    ESP_LOGD(TAG, "Content row: %f", *content_row);
-    memcpy(x, content_row, dim * sizeof(*x));
+    LLM_PROF_START(PROF_EMBEDDING);
+    if (gs)
+    {
+        dequantize_row(x, w->q_tokens, token, dim, gs);
+    }
+    else
+    {
+        v4sf *content_row = w->token_embedding_table + token * dim;
+        ESP_LOGD(TAG, "Content row: %f", *content_row);
+        memcpy(x, content_row, dim * sizeof(*x));
+    }
+    LLM_PROF_STOP();
+
+    // rotation of this position, shared by every layer
+    LLM_PROF_START(PROF_ROPE);
+    rope_row(&s->rope, pos, s->rope_cos, s->rope_sin);
+    LLM_PROF_STOP();
 
     // forward all the layers
     for (unsigned long long l = 0; l < p->n_layers; l++)
     {
         ESP_LOGD(TAG, "X: %f, Weights %f", *x, *w->rms_att_weight);
         // attention rmsnorm
-        rmsnorm(s->xb, x, w->rms_att_weight + l * dim, dim);
+        LLM_PROF_START(PROF_RMSNORM);
+        llm_rmsnorm(s->xb, x, w->rms_att_weight + l * dim, dim);
+        LLM_PROF_STOP();
 
-        // key and value point to the kv cache
         int loff = l * p->seq_len * kv_dim; // kv cache layer offset for convenience
-        s->k = s->key_cache + loff + pos * kv_dim;
-        s->v = s->value_cache + loff + pos * kv_dim;
 
-        // qkv matmuls for this position
-        matmul(s->q, s->xb, w->wq + l * dim * dim, dim, dim);
-        matmul(s->k, s->xb, w->wk + l * dim * kv_dim, dim, kv_dim);
-        matmul(s->v, s->xb, w->wv + l * dim * kv_dim, dim, kv_dim);
+        // qkv matmuls for this position, as a single job
+        if (gs)
+        {
+            LLM_PROF_START(PROF_QUANTIZE);
+            quantize(&s->xq, s->xb, dim, gs);
+            LLM_PROF_STOP();
+        }
+        LLM_PROF_START(PROF_QKV);
+        matmul_qkv(s, w, l, dim, kv_dim);
+        LLM_PROF_STOP();
 
         // RoPE relative positional encoding: complex-valued rotate q and k in each head
-        for (int i = 0; i < dim; i += 2)
-        {
-            int head_dim = i % head_size;
-            v4sf freq = 1.0f / powf(10000.0f, head_dim / (v4sf)head_size);
-            v4sf val = pos * freq;
-            v4sf fcr = cosf(val);
-            v4sf fci = sinf(val);
-            int rotn = i < kv_dim ? 2 : 1; // how many vectors? 2 = q & k, 1 = q only
-            for (int v = 0; v < rotn; v++)
-            {
-                v4sf *vec = v == 0 ? s->q : s->k; // the vector to rotate (query or key)
-                v4sf v0 = vec[i];
-                v4sf v1 = vec[i + 1];
-                vec[i] = v0 * fcr - v1 * fci;
-                vec[i + 1] = v0 * fci + v1 * fcr;
-            }
-        }
-        // start task
-        *forward_params = (ForwardTaskParams){
+        LLM_PROF_START(PROF_ROPE);
+        rope_rotate(s->q, dim, s->rope_cos, s->rope_sin, head_size);
+        rope_rotate(s->k, kv_dim, s->rope_cos, s->rope_sin, head_size);
+        kv_store_position(s, p, l, pos, s->k, s->v);
+        LLM_PROF_STOP();
+
+        // multihead attention. iterate over all heads, half of them on each core
+        ForwardTaskParams attention = {
             .s = s,
             .w = w,
             .p = p,
+            .q = s->q,
+            .xb = s->xb,
             .pos = pos,
-            .start = p->n_heads / 2,
             .loff = loff,
-            .end = p->n_heads,
             .dim = dim,
             .kv_dim = kv_dim,
             .kv_mul = kv_mul,
             .hidden_dim = hidden_dim,
             .head_size = head_size,
-            .task_num = FORWARD_TASK_1,
         };
-        xSemaphoreGive(semaForwardDataReady);
-
-        // multihead attention. iterate over all heads
-        int h;
-        // #pragma omp parallel for private(h)
-        for (h = 0; h < (p->n_heads / 2); h++)
-        {
-            // get the query vector for this head
-            v4sf *q = s->q + h * head_size;
-            // attention scores for this head
-            v4sf *att = s->att + h * p->seq_len;
-            // iterate over all timesteps, including the current one
-            for (int t = 0; t <= pos; t++)
-            {
-                // get the key vector for this head and at this timestep
-                v4sf *k = s->key_cache + loff + t * kv_dim + (h / kv_mul) * head_size;
-                // calculate the attention score as the dot product of q and k
-                v4sf score = 0.0f;
-                for (int i = 0; i < head_size; i++)
-                {
-                    score += q[i] * k[i];
-                }
-                score /= sqrtf(head_size);
-                // save the score to the attention buffer
-                att[t] = score;
-            }
+        LLM_PROF_START(PROF_ATTENTION);
+        llm_pool_parallel_for(attention_heads, &attention, p->n_heads);
+        LLM_PROF_STOP();
+
+        // final matmul to get the output of the attention
+        if (gs)
+        {
+            LLM_PROF_START(PROF_QUANTIZE);
+            quantize(&s->xq, s->xb, dim, gs);
+            LLM_PROF_STOP();
+            LLM_PROF_START(PROF_WO);
+            matmul_q8(s->xb2, &s->xq, w->q_wo + l, dim, dim, gs);
+        }
+        else
+        {
+            LLM_PROF_START(PROF_WO);
+            matmul(s->xb2, s->xb, w->wo + l * dim * dim, dim, dim);
+        }
+        LLM_PROF_STOP();
+
+        // residual connection back into x
+        LLM_PROF_START(PROF_RESIDUAL);
+        llm_residual(x, s->xb2, dim);
+        LLM_PROF_STOP();
+
+        // ffn rmsnorm
+        LLM_PROF_START(PROF_RMSNORM);
+        llm_rmsnorm(s->xb, x, w->rms_ffn_weight + l * dim, dim);
+        LLM_PROF_STOP();
+
+        // Now for FFN in PyTorch we have: self.w2(F.silu(self.w1(x)) * self.w3(x))
+        // w1(x), w3(x) and the SwiGLU non-linearity are computed in one pass
+        if (gs)
+        {
+            LLM_PROF_START(PROF_QUANTIZE);
+            quantize(&s->xq, s->xb, dim, gs);
+            LLM_PROF_STOP();
+        }
+        LLM_PROF_START(PROF_FFN);
+        matmul_swiglu(s, w, l, dim, hidden_dim);
+        LLM_PROF_STOP();
+
+        // final matmul to get the output of the ffn
+        if (gs)
+        {
+            LLM_PROF_START(PROF_QUANTIZE);
+            quantize(&s->hq, s->hb, hidden_dim, gs);
+            LLM_PROF_STOP();
+            LLM_PROF_START(PROF_W2);
+            matmul_q8(s->xb, &s->hq, w->q_w2 + l, hidden_dim, dim, gs);
+        }
+        else
+        {
+            LLM_PROF_START(PROF_W2);
+            matmul(s->xb, s->hb, w->w2 + l * dim * hidden_dim, hidden_dim, dim);
+        }
+        LLM_PROF_STOP();
+
+        // residual connection
+        LLM_PROF_START(PROF_RESIDUAL);
+        llm_residual(x, s->xb, dim);
+        LLM_PROF_STOP();
+    }
+
+    // final rmsnorm
+    LLM_PROF_START(PROF_RMSNORM);
+    llm_rmsnorm(x, x, w->rms_final_weight, dim);
+    LLM_PROF_STOP();
+    return x;
+}
+
+v4sf *forward(Transformer *transformer, int token, int pos)
+{
+    Config *p = &transformer->config;
+    TransformerWeights *w = &transformer->weights;
+    RunState *s = &transformer->state;
+    v4sf *x = forward_layers(transformer, token, pos);
+    int gs = w->group_size;
+
+    // classifier into logits
+    if (gs)
+    {
+        LLM_PROF_START(PROF_QUANTIZE);
+        quantize(&s->xq, x, p->dim, gs);
+        LLM_PROF_STOP();
+        LLM_PROF_START(PROF_CLASSIFIER);
+        matmul_q8(s->logits, &s->xq, w->q_wcls, p->dim, p->vocab_size, gs);
+    }
+    else
+    {
+        LLM_PROF_START(PROF_CLASSIFIER);
+        matmul(s->logits, x, w->wcls, p->dim, p->vocab_size);
+    }
+    LLM_PROF_STOP();
+    LLM_PROF_TOKEN_END();
+    return s->logits;
+}
+
+void subset_matmul_rows(void *arg, int start, int end)
+{
+    // entries [start, end) of the listed rows of W @ x, through the same row kernel as
+    // matmul(), so each logit comes out exactly as the full classifier computes it
+    SubsetMatMulParams *p = (SubsetMatMulParams *)arg;
+    for (int i = start; i < end; i++)
+    {
+        p->m.xout[i] = matmul_row(&p->m, p->rows[i]);
+    }
+}
+
+void prescore_rows(void *arg, int start, int end)
+{
+    // the same with int8 weights, one scale per row, against the fp32 x
+    SubsetMatMulParams *p = (SubsetMatMulParams *)arg;
+    int n = p->m.n;
+    for (int i = start; i < end; i++)
+    {
+        const int8_t *row = p->m.wq->q + (size_t)p->rows[i] * n;
+        v4sf val = 0.0f;
+        for (int j = 0; j < n; j++)
+        {
+            val += row[j] * p->m.x[j];
+        }
+        p->m.xout[i] = val * p->m.wq->s[p->rows[i]];
+    }
+}
+
+int prune_candidates(RunState *s, v4sf *x, int dim, int *rows, int n)
+{
+    // greedy sampling only needs the argmax. rounding wcls to int8 moves a logit by at most
+    // half a step per weight, so the pre-score of row r is within margin * scale[r] of the
+    // logit matmul() would compute, with the rounding of both dot products included. rows
+    // whose pre-score plus margin is below another's pre-score minus margin cannot be the
+    // argmax and are dropped; rows keeps its order, so ties still go to the lowest id
+    v4sf l1 = 0.0f;
+    for (int j = 0; j < dim; j++)
+    {
+        l1 += fabsf(x[j]);
+    }
+    v4sf margin = l1 * (0.5f + 128.0f * (dim + 1) * FLT_EPSILON);
+    v4sf *scale = s->cls_prescore.s;
+    SubsetMatMulParams job = {.m = {.xout = s->logits, .x = x, .wq = &s->cls_prescore, .n = dim}, .rows = rows};
+    llm_pool_parallel_for(prescore_rows, &job, n);
+    v4sf floor = -INFINITY;
+    for (int i = 0; i < n; i++)
+    {
+        v4sf low = s->logits[i] - margin * scale[rows[i]];
+        floor = low > floor ? low : floor;
+    }
+    int kept = 0;
+    for (int i = 0; i < n; i++)
+    {
+        if (s->logits[i] + margin * scale[rows[i]] >= floor)
+        {
+            rows[kept++] = rows[i];
+        }
+    }
+    return kept;
+}
 
-            // softmax the scores to get attention weights, from 0..pos inclusively
-            softmax(att, pos + 1);
+int classifier_sparse(Transformer *transformer, Sampler *sampler, v4sf *x)
+{
+    // the classifier rows are the tokens the sampler may return; temperature sampling needs
+    // the exact logit of each of them, greedy sampling only of the few that can be the argmax.
+    // leaves their ids in cls_rows and their logits in the same order in logits, returns how many
+    Config *p = &transformer->config;
+    TransformerWeights *w = &transformer->weights;
+    RunState *s = &transformer->state;
+    int gs = w->group_size;
+    int *rows = s->cls_rows;
+    int n = sampler->allowed ? sampler->n_allowed : p->vocab_size;
+    for (int i = 0; i < n; i++)
+    {
+        rows[i] = sampler->allowed ? sampler->allowed[i] : i;
+    }
+    SubsetMatMulParams job = {.m = {.xout = s->logits, .x = x, .w = w->wcls, .n = p->dim}, .rows = rows};
+    if (gs)
+    {
+        LLM_PROF_START(PROF_QUANTIZE);
+        quantize(&s->xq, x, p->dim, gs);
+        LLM_PROF_STOP();
+        job.m.xq = &s->xq;
+        job.m.wq = w->q_wcls;
+        job.m.group_size = gs;
+    }
+    LLM_PROF_START(PROF_CLASSIFIER);
+    if (sampler->temperature == 0.0f && s->cls_prescore.q)
+    {
+        n = prune_candidates(s, x, p->dim, rows, n);
+    }
+    llm_pool_parallel_for(subset_matmul_rows, &job, n);
+    LLM_PROF_STOP();
+    return n;
+}
+
+int forward_sample(Transformer *transformer, Sampler *sampler, int token, int pos)
+{
+#if LLM_SPARSE_CLASSIFIER
+    v4sf *x = forward_layers(transformer, token, pos);
+    int n = classifier_sparse(transformer, sampler, x);
+    LLM_PROF_TOKEN_END();
+    return sample_sparse(sampler, transformer->state.logits, transformer->state.cls_rows, n);
+#else
+    return sample(sampler, forward(transformer, token, pos));
+#endif
+}
+
+void malloc_prefill_state(PrefillState *ps, Config *p, int group_size, int T)
+{
+    int widest = p->hidden_dim > p->dim ? p->hidden_dim : p->dim;
+    int kv_dim = p->dim * p->n_kv_heads / p->n_heads;
+    int half = p->dim / p->n_heads / 2;
+    ps->x = llm_buffer("prefill_x", (size_t)T * p->dim * sizeof(v4sf), MALLOC_CAP_DEFAULT);
+    ps->xb = llm_buffer("prefill_xb", (size_t)T * p->dim * sizeof(v4sf), MALLOC_CAP_DEFAULT);
+    ps->xb2 = llm_buffer("prefill_xb2", (size_t)T * p->dim * sizeof(v4sf), MALLOC_CAP_DEFAULT);
+    ps->q = llm_buffer("prefill_q", (size_t)T * p->dim * sizeof(v4sf), MALLOC_CAP_DEFAULT);
+    ps->k = llm_buffer("prefill_k", (size_t)T * kv_dim * sizeof(v4sf), MALLOC_CAP_DEFAULT);
+    ps->v = llm_buffer("prefill_v", (size_t)T * kv_dim * sizeof(v4sf), MALLOC_CAP_DEFAULT);
+    ps->hb = llm_buffer("prefill_hb", (size_t)T * p->hidden_dim * sizeof(v4sf), MALLOC_CAP_DEFAULT);
+    ps->hb2 = llm_buffer("prefill_hb2", (size_t)T * p->hidden_dim * sizeof(v4sf), MALLOC_CAP_DEFAULT);
+    ps->xt = llm_buffer("prefill_xt", (size_t)T * widest * sizeof(v4sf), MALLOC_CAP_DEFAULT);
+    ps->ct = llm_buffer("prefill_ct", (size_t)T * widest * sizeof(v4sf), MALLOC_CAP_DEFAULT);
+    ps->rope_cos = llm_buffer("prefill_rope_cos", (size_t)T * half * sizeof(v4sf), MALLOC_CAP_DEFAULT);
+    ps->rope_sin = llm_buffer("prefill_rope_sin", (size_t)T * half * sizeof(v4sf), MALLOC_CAP_DEFAULT);
+    ps->xq = NULL;
+    if (group_size)
+    {
+        // one block of int8 values and one of scales, carved into a row per token
+        ps->xq = llm_buffer("prefill_xq", T * sizeof(QuantizedTensor), MALLOC_CAP_DEFAULT);
+        int8_t *q = llm_buffer("prefill_xq_values", (size_t)T * widest, MALLOC_CAP_DEFAULT);
+        v4sf *sc = llm_buffer("prefill_xq_scales", (size_t)T * widest / group_size * sizeof(v4sf), MALLOC_CAP_DEFAULT);
+        for (int t = 0; t < T; t++)
+        {
+            ps->xq[t] = (QuantizedTensor){q + t * widest, sc + t * widest / group_size};
+        }
+    }
+}
+
+void free_prefill_state(PrefillState *ps)
+{
+    llm_buffer_free(ps->x);
+    llm_buffer_free(ps->xb);
+    llm_buffer_free(ps->xb2);
+    llm_buffer_free(ps->q);
+    llm_buffer_free(ps->k);
+    llm_buffer_free(ps->v);
+    llm_buffer_free(ps->hb);
+    llm_buffer_free(ps->hb2);
+    llm_buffer_free(ps->xt);
+    llm_buffer_free(ps->ct);
+    llm_buffer_free(ps->rope_cos);
+    llm_buffer_free(ps->rope_sin);
+    if (ps->xq)
+    {
+        llm_buffer_free(ps->xq[0].q);
+        llm_buffer_free(ps->xq[0].s);
+        llm_buffer_free(ps->xq);
+    }
+}
+
+void prefill_input(PrefillState *ps, v4sf *x, int n, int T, int group_size)
+{
+    // lays out the (T, n) input the way batch_matmul_rows() consumes it
+    if (group_size)
+    {
+        for (int t = 0; t < T; t++)
+        {
+            quantize(&ps->xq[t], x + t * n, n, group_size);
+        }
+        return;
+    }
+    for (int t = 0; t < T; t++)
+    {
+        for (int i = 0; i < n; i++)
+        {
+            ps->xt[i * T + t] = x[t * n + i];
+        }
+    }
+}
+
+void batch_matmul(PrefillState *ps, v4sf *out, v4sf *w, QuantizedTensor *wq, int n, int d, int T, int group_size)
+{
+    // out (T, d) = input (T, n) @ W (d, n)^T, input already staged by prefill_input()
+    BatchMatMulParams job = {.out = out, .xt = ps->xt, .xq = ps->xq, .w = group_size ? NULL : w, .wq = group_size ? wq : NULL,
+                             .ct = ps->ct, .group_size = group_size, .n = n, .d = d, .T = T};
+    llm_pool_parallel_for(batch_matmul_rows, &job, d);
+}
+
+void prefill_chunk(Transformer *transformer, PrefillState *ps, int *tokens, int T, int pos0)
+{
+    // one pass of positions [pos0, pos0 + T) through every layer
+    Config *p = &transformer->config;
+    TransformerWeights *w = &transformer->weights;
+    RunState *s = &transformer->state;
+    int dim = p->dim;
+    int kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
+    int kv_mul = p->n_heads / p->n_kv_heads;
+    int hidden_dim = p->hidden_dim;
+    int head_size = dim / p->n_heads;
+    int gs = w->group_size;
+
+    // copy the token embeddings into x and look up the rotation of each position
+    int half = head_size / 2;
+    for (int t = 0; t < T; t++)
+    {
+        rope_row(&s->rope, pos0 + t, ps->rope_cos + t * half, ps->rope_sin + t * half);
+        if (gs)
+        {
+            dequantize_row(ps->x + t * dim, w->q_tokens, tokens[t], dim, gs);
+        }
+        else
+        {
+            memcpy(ps->x + t * dim, w->token_embedding_table + tokens[t] * dim, dim * sizeof(v4sf));
+        }
+    }
+
+    for (int l = 0; l < p->n_layers; l++)
+    {
+        // attention rmsnorm
+        for (int t = 0; t < T; t++)
+        {
+            llm_rmsnorm(ps->xb + t * dim, ps->x + t * dim, w->rms_att_weight + l * dim, dim);
+        }
+
+        // qkv matmuls for the whole chunk, then keys and values go into the kv cache. only the
+        // fp32 or the Q8 weights exist, so the other pointer stays NULL rather than offset
+        int loff = l * p->seq_len * kv_dim;
+        prefill_input(ps, ps->xb, dim, T, gs);
+        batch_matmul(ps, ps->q, gs ? NULL : w->wq + l * dim * dim, gs ? w->q_wq + l : NULL, dim, dim, T, gs);
+        batch_matmul(ps, ps->k, gs ? NULL : w->wk + l * dim * kv_dim, gs ? w->q_wk + l : NULL, dim, kv_dim, T, gs);
+        batch_matmul(ps, ps->v, gs ? NULL : w->wv + l * dim * kv_dim, gs ? w->q_wv + l : NULL, dim, kv_dim, T, gs);
+
+        for (int t = 0; t < T; t++)
+        {
+            rope_rotate(ps->q + t * dim, dim, ps->rope_cos + t * half, ps->rope_sin + t * half, head_size);
+            rope_rotate(ps->k + t * kv_dim, kv_dim, ps->rope_cos + t * half, ps->rope_sin + t * half, head_size);
+            kv_store_position(s, p, l, pos0 + t, ps->k + t * kv_dim, ps->v + t * kv_dim);
+        }
+
+        // causal attention, position by position, against the cache filled so far
+        for (int t = 0; t < T; t++)
+        {
+            ForwardTaskParams attention = {
+                .s = s,
+                .w = w,
+                .p = p,
+                .q = ps->q + t * dim,
+                .xb = ps->xb + t * dim,
+                .pos = pos0 + t,
+                .loff = loff,
+                .dim = dim,
+                .kv_dim = kv_dim,
+                .kv_mul = kv_mul,
+                .hidden_dim = hidden_dim,
+                .head_size = head_size,
+            };
+            llm_pool_parallel_for(attention_heads, &attention, p->n_heads);
+        }
+
+        // output of the attention and residual connection back into x
+        prefill_input(ps, ps->xb, dim, T, gs);
+        batch_matmul(ps, ps->xb2, gs ? NULL : w->wo + l * dim * dim, gs ? w->q_wo + l : NULL, dim, dim, T, gs);
+        llm_residual(ps->x, ps->xb2, T * dim);
+
+        // ffn rmsnorm
+        for (int t = 0; t < T; t++)
+        {
+            llm_rmsnorm(ps->xb + t * dim, ps->x + t * dim, w->rms_ffn_weight + l * dim, dim);
+        }
+
+        // self.w2(F.silu(self.w1(x)) * self.w3(x))
+        prefill_input(ps, ps->xb, dim, T, gs);
+        batch_matmul(ps, ps->hb, gs ? NULL : w->w1 + l * dim * hidden_dim, gs ? w->q_w1 + l : NULL, dim, hidden_dim, T, gs);
+        batch_matmul(ps, ps->hb2, gs ? NULL : w->w3 + l * dim * hidden_dim, gs ? w->q_w3 + l : NULL, dim, hidden_dim, T, gs);
+        llm_swiglu(ps->hb, ps->hb2, T * hidden_dim);
+        prefill_input(ps, ps->hb, hidden_dim, T, gs);
+        batch_matmul(ps, ps->xb, gs ? NULL : w->w2 + l * dim * hidden_dim, gs ? w->q_w2 + l : NULL, hidden_dim, dim, T, gs);
+
+        // residual connection
+        llm_residual(ps->x, ps->xb, T * dim);
+    }
+
+    // hand the last position over to the single-token state
+    memcpy(s->x, ps->x + (T - 1) * dim, dim * sizeof(v4sf));
+}
+
+v4sf *forward_prefill(Transformer *transformer, int *tokens, int n, int start_pos)
+{
+    // feeds tokens[0..n) at positions start_pos.. through the model with weight-stationary
+    // matrix-matrix passes and returns the logits of the last one, as forward() would
+    Config *p = &transformer->config;
+    TransformerWeights *w = &transformer->weights;
+    RunState *s = &transformer->state;
+    if (n < 1 || start_pos + n > p->seq_len)
+    {
+        ESP_LOGE(TAG, "Prefill of %d tokens at %d exceeds seq_len %d", n, start_pos, p->seq_len);
+        exit(EXIT_FAILURE);
+    }
 
-            // weighted sum of the values, store back into xb
-            v4sf *xb = s->xb + h * head_size;
-            memset(xb, 0, head_size * sizeof(v4sf));
-            for (int t = 0; t <= pos; t++)
-            {
-                // get the value vector for this head and at this timestep
-                v4sf *v = s->value_cache + loff + t * kv_dim + (h / kv_mul) * head_size;
-                // get the attention weight for this timestep
-                v4sf a = att[t];
-                // accumulate the weighted value into xb
-                for (int i = 0; i < head_size; i++)
-                {
-                    xb[i] += a * v[i];
-                }
-            }
-        }
-        if (xSemaphoreTake(semaForwardDataReady, portMAX_DELAY) == pdTRUE)
-        {
+    PrefillState ps;
+    int T = n < PREFILL_CHUNK ? n : PREFILL_CHUNK;
+    malloc_prefill_state(&ps, p, w->group_size, T);
+    for (int done = 0; done < n; done += T)
+    {
+        int chunk = n - done < T ? n - done : T;
+        prefill_chunk(transformer, &ps, tokens + done, chunk, start_pos + done);
+    }
+    free_prefill_state(&ps);
 
-            xEventGroupSync(ForwardEventGroup,
-                            FORWARD_TASK_2,
-                            ALL_FORWARD_TASKS,
-                            portMAX_DELAY);
+    // final rmsnorm and classifier for the last position only
+    v4sf *x = s->x;
+    llm_rmsnorm(x, x, w->rms_final_weight, p->dim);
+    if (w->group_size)
+    {
+        quantize(&s->xq, x, p->dim, w->group_size);
+        matmul_q8(s->logits, &s->xq, w->q_wcls, p->dim, p->vocab_size, w->group_size);
+    }
+    else
+    {
+        matmul(s->logits, x, w->wcls, p->dim, p->vocab_size);
+    }
+    return s->logits;
+}
 
-            xEventGroupClearBits(ForwardEventGroup, ALL_FORWARD_TASKS);
+v4sf *forward_verify(Transformer *transformer, int *tokens, int n, int pos)
+{
+    // the batched layers of forward_prefill(), then the final rmsnorm and classifier for every
+    // position instead of the last, so n draft positions cost one pass over the layer weights
+    Config *p = &transformer->config;
+    TransformerWeights *w = &transformer->weights;
+    RunState *s = &transformer->state;
+    if (!s->spec_logits || n < 1 || n > LLM_SPEC_DRAFT + 1 || pos + n > p->seq_len)
+    {
+        ESP_LOGE(TAG, "Verify of %d tokens at %d exceeds %d tokens or seq_len %d", n, pos, LLM_SPEC_DRAFT + 1, p->seq_len);
+        exit(EXIT_FAILURE);
+    }
 
-            // final matmul to get the output of the attention
-            matmul(s->xb2, s->xb, w->wo + l * dim * dim, dim, dim);
+    PrefillState ps;
+    malloc_prefill_state(&ps, p, w->group_size, n);
+    prefill_chunk(transformer, &ps, tokens, n, pos);
+    for (int t = 0; t < n; t++)
+    {
+        v4sf *x = ps.x + t * p->dim;
+        v4sf *logits = s->spec_logits + t * p->vocab_size;
+        llm_rmsnorm(x, x, w->rms_final_weight, p->dim);
+        if (w->group_size)
+        {
+            quantize(&s->xq, x, p->dim, w->group_size);
+            matmul_q8(logits, &s->xq, w->q_wcls, p->dim, p->vocab_size, w->group_size);
+        }
+        else
+        {
+            matmul(logits, x, w->wcls, p->dim, p->vocab_size);
+        }
+    }
+    free_prefill_state(&ps);
+    return s->spec_logits;
+}
 
-            // residual connection back into x
-            for (int i = 0; i < dim; i++)
+int draft_tokens(const int *context, int n, int *draft, int max_draft)
+{
+    // prompt lookup: the tokens that followed the latest earlier occurrence of the last
+    // LLM_SPEC_NGRAM tokens of context[0..n). stories repeat names and phrases a lot, and
+    // a miss only costs the scan
+    if (n <= LLM_SPEC_NGRAM)
+    {
+        return 0;
+    }
+    const int *tail = context + n - LLM_SPEC_NGRAM;
+    for (int i = n - LLM_SPEC_NGRAM - 1; i >= 0; i--)
+    {
+        if (memcmp(context + i, tail, LLM_SPEC_NGRAM * sizeof(int)) == 0)
+        {
+            int k = 0;
+            for (; k < max_draft && i + LLM_SPEC_NGRAM + k < n; k++)
             {
-                x[i] += s->xb2[i];
+                draft[k] = context[i + LLM_SPEC_NGRAM + k];
             }
+            return k;
+        }
+    }
+    return 0;
+}
 
-            // ffn rmsnorm
-            rmsnorm(s->xb, x, w->rms_ffn_weight + l * dim, dim);
-
-            // Now for FFN in PyTorch we have: self.w2(F.silu(self.w1(x)) * self.w3(x))
-            // first calculate self.w1(x) and self.w3(x)
-            matmul(s->hb, s->xb, w->w1 + l * dim * hidden_dim, dim, hidden_dim);
-            matmul(s->hb2, s->xb, w->w3 + l * dim * hidden_dim, dim, hidden_dim);
+// ----------------------------------------------------------------------------
+// The Byte Pair Encoding (BPE) Tokenizer that translates strings <-> tokens
 
-            // SwiGLU non-linearity
-            for (int i = 0; i < hidden_dim; i++)
-            {
-                v4sf val = s->hb[i];
-                // silu(x)=x*σ(x), where σ(x) is the logistic sigmoid
-                val *= (1.0f / (1.0f + expf(-val)));
-                // elementwise multiply with w3(x)
-                val *= s->hb2[i];
-                s->hb[i] = val;
-            }
+// FNV-1a, fed piece by piece so a pair of tokens hashes like their concatenation
+#define VOCAB_HASH_SEED 2166136261u
 
-            // final matmul to get the output of the ffn
-            matmul(s->xb, s->hb, w->w2 + l * dim * hidden_dim, hidden_dim, dim);
+uint32_t vocab_hash_bytes(uint32_t h, const char *str, int len)
+{
+    for (int i = 0; i < len; i++)
+    {
+        h = (h ^ (unsigned char)str[i]) * 16777619u;
+    }
+    return h;
+}
 
-            // residual connection
-            for (int i = 0; i < dim; i++)
-            {
-                x[i] += s->xb[i];
-            }
+int vocab_find(Tokenizer *t, const char *a, int len_a, const char *b, int len_b)
+{
+    // id of the vocab entry spelled a followed by b, or -1 if there is none
+    uint32_t h = vocab_hash_bytes(vocab_hash_bytes(VOCAB_HASH_SEED, a, len_a), b, len_b);
+    for (unsigned int i = h & t->vocab_hash_mask;; i = (i + 1) & t->vocab_hash_mask)
+    {
+        int id = t->vocab_hash[i];
+        if (id == -1)
+        {
+            return -1;
+        }
+        if (t->vocab_len[id] == len_a + len_b && memcmp(t->vocab[id], a, len_a) == 0 &&
+            memcmp(t->vocab[id] + len_a, b, len_b) == 0)
+        {
+            return id;
         }
     }
+}
 
-    // final rmsnorm
-    rmsnorm(x, x, w->rms_final_weight, dim);
-
-    // classifier into logits
-    matmul(s->logits, x, w->wcls, p->dim, p->vocab_size);
-    return s->logits;
+unsigned int vocab_hash_size(int vocab_size)
+{
+    // at most half full, so probes stay short
+    unsigned int size = 1;
+    while (size < 2u * vocab_size)
+    {
+        size <<= 1;
+    }
+    return size;
 }
 
-// ----------------------------------------------------------------------------
-// The Byte Pair Encoding (BPE) Tokenizer that translates strings <-> tokens
+void build_vocab_hash(Tokenizer *t)
+{
+    unsigned int size = vocab_hash_size(t->vocab_size);
+    t->vocab_hash_mask = size - 1;
+    t->vocab_hash = llm_buffer("vocab_hash", size * sizeof(int), MALLOC_CAP_DEFAULT);
+    memset(t->vocab_hash, -1, size * sizeof(int));
+    for (int id = 0; id < t->vocab_size; id++)
+    {
+        // a duplicate string keeps the lowest id
+        if (vocab_find(t, t->vocab[id], t->vocab_len[id], "", 0) != -1)
+        {
+            continue;
+        }
+        unsigned int i = vocab_hash_bytes(VOCAB_HASH_SEED, t->vocab[id], t->vocab_len[id]) & t->vocab_hash_mask;
+        while (t->vocab_hash[i] != -1)
+        {
+            i = (i + 1) & t->vocab_hash_mask;
+        }
+        t->vocab_hash[i] = id;
+    }
+}
 
-int compare_tokens(const void *a, const void *b)
+void build_led_tokens(Tokenizer *t)
 {
-    return strcmp(((TokenIndex *)a)->str, ((TokenIndex *)b)->str);
+    // tokens whose piece has a letter or digit, the characters char_to_led_index() lights;
+    // the shortcut words are made of letters too. whitespace and punctuation pieces would
+    // be skipped by the board, so a sampler restricted to this list only picks tokens that
+    // show. BOS and EOS stay in so stories can still end
+    t->led_tokens = llm_buffer("led_tokens", t->vocab_size * sizeof(int), MALLOC_CAP_DEFAULT);
+    t->n_led_tokens = 0;
+    for (int i = 0; i < t->vocab_size; i++)
+    {
+        const char *piece = t->vocab_arena + t->decode_table[i].offset;
+        int shown = i == 1 || i == 2;
+        for (int j = 0; j < t->decode_table[i].length && !shown; j++)
+        {
+            unsigned char c = piece[j];
+            shown = c < 128 && isalnum(c);
+        }
+        if (shown)
+        {
+            t->led_tokens[t->n_led_tokens++] = i;
+        }
+    }
+    ESP_LOGI(TAG, "%d of %d tokens can be shown on the LEDs", t->n_led_tokens, t->vocab_size);
 }
 
 void build_tokenizer(Tokenizer *t, char *tokenizer_path, int vocab_size)
@@ -594,15 +1939,6 @@ void build_tokenizer(Tokenizer *t, char *tokenizer_path, int vocab_size)
     // i should have written the vocab_size into the tokenizer file... sigh
     ESP_LOGI(TAG, "Vocab size is %d\n", vocab_size);
     t->vocab_size = vocab_size;
-    // malloc space to hold the scores and the strings
-    t->vocab = (char **)malloc(vocab_size * sizeof(char *));
-    t->vocab_scores = (v4sf *)malloc(vocab_size * sizeof(v4sf));
-    t->sorted_vocab = NULL; // initialized lazily
-    for (int i = 0; i < 256; i++)
-    {
-        t->byte_pieces[i * 2] = (unsigned char)i;
-        t->byte_pieces[i * 2 + 1] = '\0';
-    }
     // read in the file
     FILE *file = fopen(tokenizer_path, "rb");
     if (!file)
@@ -611,12 +1947,32 @@ void build_tokenizer(Tokenizer *t, char *tokenizer_path, int vocab_size)
         exit(EXIT_FAILURE);
     }
     ESP_LOGI(TAG, "Opened Tokenizer File");
+    // the strings and their terminators take less room than the file, which also stores
+    // a score and a length for each of them; the arena is trimmed to size once it is read
+    fseek(file, 0, SEEK_END);
+    long file_size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    // the tables come from the transformer's arena, sized by vocab_size. the strings are
+    // sized by the file, which the plan cannot know, and stay one heap block read at setup
+    t->vocab = llm_buffer("vocab", vocab_size * sizeof(char *), MALLOC_CAP_DEFAULT);
+    t->vocab_scores = llm_buffer("vocab_scores", vocab_size * sizeof(v4sf), MALLOC_CAP_DEFAULT);
+    t->vocab_len = llm_buffer("vocab_len", vocab_size * sizeof(int), MALLOC_CAP_DEFAULT);
+    t->decode_table = llm_buffer("decode_table", vocab_size * sizeof(TokenPiece), MALLOC_CAP_DEFAULT);
+    t->vocab_arena = (char *)malloc(file_size + 256 * 2);
+    t->vocab_hash = NULL;
+    if (!t->vocab_arena)
+    {
+        ESP_LOGE(TAG, "Malloc operation failed");
+        exit(EXIT_FAILURE);
+    }
     if (fread(&t->max_token_length, sizeof(int), 1, file) != 1)
     {
         ESP_LOGE(TAG, "failed read");
         exit(EXIT_FAILURE);
     }
     int len;
+    int arena_size = 0;
     for (int i = 0; i < vocab_size; i++)
     {
         if (fread(t->vocab_scores + i, sizeof(v4sf), 1, file) != 1)
@@ -629,44 +1985,65 @@ void build_tokenizer(Tokenizer *t, char *tokenizer_path, int vocab_size)
             ESP_LOGE(TAG, "failed read len");
             exit(EXIT_FAILURE);
         }
-        t->vocab[i] = (char *)malloc(len + 1);
-        if (fread(t->vocab[i], len, 1, file) != 1)
+        if (len < 0 || arena_size + len + 1 > file_size || (len > 0 && fread(t->vocab_arena + arena_size, len, 1, file) != 1))
         {
             ESP_LOGE(TAG, "failed read vocab");
             exit(EXIT_FAILURE);
         }
-        t->vocab[i][len] = '\0'; // add the string terminating token
+        t->vocab_len[i] = len;
+        t->vocab_arena[arena_size + len] = '\0'; // add the string terminating token
+        arena_size += len + 1;
     }
     fclose(file);
+
+    // every possible raw byte as a single-character string
+    int byte_pieces = arena_size;
+    for (int i = 0; i < 256; i++)
+    {
+        t->vocab_arena[arena_size++] = (char)i;
+        t->vocab_arena[arena_size++] = '\0';
+    }
+    char *arena = realloc(t->vocab_arena, arena_size);
+    t->vocab_arena = arena ? arena : t->vocab_arena;
+
+    // resolve what each token decodes to once, so decode() is a lookup. tokens
+    // that designate raw bytes look like e.g. '<0x01>' and print as that byte
+    for (int i = 0, offset = 0; i < vocab_size; offset += t->vocab_len[i] + 1, i++)
+    {
+        t->vocab[i] = t->vocab_arena + offset;
+        t->decode_table[i] = (TokenPiece){offset, t->vocab_len[i]};
+        unsigned char byte_val;
+        if (sscanf(t->vocab[i], "<0x%02hhX>", &byte_val) == 1)
+        {
+            t->decode_table[i] = (TokenPiece){byte_pieces + byte_val * 2, byte_val != 0};
+        }
+    }
+    // index the vocab up front so encode() never has to sort or bsearch it
+    build_vocab_hash(t);
+    build_led_tokens(t);
     ESP_LOGI(TAG, "Tokenizer successfully built");
 }
 
 void free_tokenizer(Tokenizer *t)
 {
-    for (int i = 0; i < t->vocab_size; i++)
-    {
-        free(t->vocab[i]);
-    }
-    free(t->vocab);
-    free(t->vocab_scores);
-    free(t->sorted_vocab);
+    free(t->vocab_arena);
+    llm_buffer_free(t->vocab);
+    llm_buffer_free(t->decode_table);
+    llm_buffer_free(t->vocab_scores);
+    llm_buffer_free(t->vocab_len);
+    llm_buffer_free(t->vocab_hash);
+    llm_buffer_free(t->led_tokens);
 }
 
 char *decode(Tokenizer *t, int prev_token, int token)
 {
-    char *piece = t->vocab[token];
-    // following BOS (1) token, sentencepiece decoder strips any leading whitespace (see PR #89)
-    if (prev_token == 1 && piece[0] == ' ')
+    char *piece = t->vocab_arena + t->decode_table[token].offset;
+    // following BOS (1) token, sentencepiece decoder strips any leading whitespace (see PR #89).
+    // a raw ' ' byte token is spelled '<0x20>' and keeps its space
+    if (prev_token == 1 && t->vocab[token][0] == ' ')
     {
         piece++;
     }
-    // careful, some tokens designate raw bytes, and look like e.g. '<0x01>'
-    // parse this and convert and return the actual byte
-    unsigned char byte_val;
-    if (sscanf(piece, "<0x%02hhX>", &byte_val) == 1)
-    {
-        piece = (char *)t->byte_pieces + byte_val * 2;
-    }
     return piece;
 }
 
@@ -702,12 +2079,82 @@ void safe_printf(char *piece)
     fflush(stdout);
 }
 
-int str_lookup(char *str, TokenIndex *sorted_vocab, int vocab_size)
+int str_lookup(char *str, Tokenizer *t)
+{
+    // find the perfect match for str in vocab, return its index or -1 if not found
+    return vocab_find(t, str, strlen(str), "", 0);
+}
+
+typedef struct
+{
+    float score;   // vocab score of the merged token
+    int left;      // position of the pair's left piece in tokens[]
+    int right;     // position of its right neighbour when the pair was found
+    int left_tok;  // the two tokens at those positions back then
+    int right_tok;
+    int id;        // token they merge into
+} MergeCandidate;
+
+size_t encode_scratch_size(int n_tokens)
+{
+    // the merge heap, then the next/prev links of the piece list
+    return 3 * n_tokens * sizeof(MergeCandidate) + n_tokens * 2 * sizeof(int);
+}
+
+int merge_before(MergeCandidate *a, MergeCandidate *b)
+{
+    // best score first; ties go to the leftmost pair, like a left-to-right scan would
+    return a->score > b->score || (a->score == b->score && a->left < b->left);
+}
+
+void merge_heap_push(MergeCandidate *heap, int *n, MergeCandidate c)
+{
+    int i = (*n)++;
+    while (i > 0 && merge_before(&c, &heap[(i - 1) / 2]))
+    {
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap[i] = c;
+}
+
+MergeCandidate merge_heap_pop(MergeCandidate *heap, int *n)
+{
+    MergeCandidate top = heap[0];
+    MergeCandidate last = heap[--(*n)];
+    int i = 0;
+    while (2 * i + 1 < *n)
+    {
+        int child = 2 * i + 1;
+        if (child + 1 < *n && merge_before(&heap[child + 1], &heap[child]))
+        {
+            child++;
+        }
+        if (!merge_before(&heap[child], &last))
+        {
+            break;
+        }
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = last;
+    return top;
+}
+
+void merge_heap_offer(Tokenizer *t, MergeCandidate *heap, int *n, int *tokens, int left, int right)
 {
-    // efficiently find the perfect match for str in vocab, return its index or -1 if not found
-    TokenIndex tok = {.str = str}; // acts as the key to search for
-    TokenIndex *res = bsearch(&tok, sorted_vocab, vocab_size, sizeof(TokenIndex), compare_tokens);
-    return res != NULL ? res->id : -1;
+    // queue the pair (left, right) if it spells a vocab entry
+    if (left == -1 || right == -1)
+    {
+        return;
+    }
+    int a = tokens[left];
+    int b = tokens[right];
+    int id = vocab_find(t, t->vocab[a], t->vocab_len[a], t->vocab[b], t->vocab_len[b]);
+    if (id != -1)
+    {
+        merge_heap_push(heap, n, (MergeCandidate){t->vocab_scores[id], left, right, a, b, id});
+    }
 }
 
 void encode(Tokenizer *t, char *text, int8_t bos, int8_t eos, int *tokens, int *n_tokens)
@@ -720,21 +2167,8 @@ void encode(Tokenizer *t, char *text, int8_t bos, int8_t eos, int *tokens, int *
         exit(EXIT_FAILURE);
     }
 
-    if (t->sorted_vocab == NULL)
-    {
-        // lazily malloc and sort the vocabulary
-        t->sorted_vocab = malloc(t->vocab_size * sizeof(TokenIndex));
-        for (int i = 0; i < t->vocab_size; i++)
-        {
-            t->sorted_vocab[i].str = t->vocab[i];
-            t->sorted_vocab[i].id = i;
-        }
-        qsort(t->sorted_vocab, t->vocab_size, sizeof(TokenIndex), compare_tokens);
-    }
-
-    // create a temporary buffer that will store merge candidates of always two consecutive tokens
-    // *2 for concat, +1 for null terminator +2 for UTF8 (in case max_token_length is 1)
-    char *str_buffer = malloc((t->max_token_length * 2 + 1 + 2) * sizeof(char));
+    // buffer for the bytes of one UTF-8 codepoint, plus a null terminator
+    char str_buffer[5];
     size_t str_len = 0;
 
     // start at 0 tokens
@@ -750,7 +2184,7 @@ void encode(Tokenizer *t, char *text, int8_t bos, int8_t eos, int *tokens, int *
     // energy to read more of the sentencepiece code to figure out what it's doing
     if (text[0] != '\0')
     {
-        int dummy_prefix = str_lookup(" ", t->sorted_vocab, t->vocab_size);
+        int dummy_prefix = str_lookup(" ", t);
         tokens[(*n_tokens)++] = dummy_prefix;
     }
 
@@ -790,7 +2224,7 @@ void encode(Tokenizer *t, char *text, int8_t bos, int8_t eos, int *tokens, int *
         }
 
         // ok c+1 is not a continuation byte, so we've read in a full codepoint
-        int id = str_lookup(str_buffer, t->sorted_vocab, t->vocab_size);
+        int id = str_lookup(str_buffer, t);
 
         if (id != -1)
         {
@@ -810,47 +2244,57 @@ void encode(Tokenizer *t, char *text, int8_t bos, int8_t eos, int *tokens, int *
         str_len = 0; // protect against a sequence of stray UTF8 continuation bytes
     }
 
-    // merge the best consecutive pair each iteration, according the scores in vocab_scores
-    while (1)
+    // merge the best consecutive pair each iteration, according the scores in vocab_scores.
+    // the pieces form a doubly linked list over tokens[] and every mergeable pair waits in a
+    // max-heap, so each merge only looks at the two pairs it creates instead of rescanning.
+    // the heap holds the n - 1 initial pairs plus at most two new ones per merge
+    int n = *n_tokens;
+    MergeCandidate *heap = llm_buffer("encode_scratch", encode_scratch_size(n), MALLOC_CAP_DEFAULT);
+    int *next = (int *)(heap + 3 * n);
+    int *prev = next + n;
+    int heap_size = 0;
+    for (int i = 0; i < n; i++)
     {
-        v4sf best_score = -1e10;
-        int best_id = -1;
-        int best_idx = -1;
+        next[i] = i + 1 < n ? i + 1 : -1;
+        prev[i] = i - 1;
+    }
+    for (int i = 0; i + 1 < n; i++)
+    {
+        merge_heap_offer(t, heap, &heap_size, tokens, i, i + 1);
+    }
 
-        for (int i = 0; i < (*n_tokens - 1); i++)
+    while (heap_size > 0)
+    {
+        MergeCandidate c = merge_heap_pop(heap, &heap_size);
+        // skip pairs that an earlier merge took apart; merged pieces only get longer,
+        // so a position never holds the same token twice
+        if (tokens[c.left] != c.left_tok || next[c.left] != c.right || tokens[c.right] != c.right_tok)
         {
-            // check if we can merge the pair (tokens[i], tokens[i+1])
-            sprintf(str_buffer, "%s%s", t->vocab[tokens[i]], t->vocab[tokens[i + 1]]);
-            int id = str_lookup(str_buffer, t->sorted_vocab, t->vocab_size);
-            if (id != -1 && t->vocab_scores[id] > best_score)
-            {
-                // this merge pair exists in vocab! record its score and position
-                best_score = t->vocab_scores[id];
-                best_id = id;
-                best_idx = i;
-            }
+            continue;
         }
-
-        if (best_idx == -1)
+        // merge the pair into its left piece and unlink the right one
+        tokens[c.left] = c.id;
+        tokens[c.right] = -1;
+        next[c.left] = next[c.right];
+        if (next[c.right] != -1)
         {
-            break; // we couldn't find any more pairs to merge, so we're done
+            prev[next[c.right]] = c.left;
         }
+        merge_heap_offer(t, heap, &heap_size, tokens, prev[c.left], c.left);
+        merge_heap_offer(t, heap, &heap_size, tokens, c.left, next[c.left]);
+    }
 
-        // merge the consecutive pair (best_idx, best_idx+1) into new token best_id
-        tokens[best_idx] = best_id;
-        // delete token at position best_idx+1, shift the entire sequence back 1
-        for (int i = best_idx + 1; i < (*n_tokens - 1); i++)
-        {
-            tokens[i] = tokens[i + 1];
-        }
-        (*n_tokens)--; // token length decreased
+    // compact the surviving pieces back into tokens[]
+    *n_tokens = 0;
+    for (int i = n > 0 ? 0 : -1; i != -1; i = next[i])
+    {
+        tokens[(*n_tokens)++] = tokens[i];
     }
+    llm_buffer_free(heap);
 
     // add optional EOS (=2) token, if desired
     if (eos)
         tokens[(*n_tokens)++] = 2;
-
-    free(str_buffer);
 }
 
 // ----------------------------------------------------------------------------
@@ -900,6 +2344,44 @@ int compare(const void *a, const void *b)
     return 0;
 }
 
+void swap_probindex(ProbIndex *a, int i, int j)
+{
+    ProbIndex tmp = a[i];
+    a[i] = a[j];
+    a[j] = tmp;
+}
+
+void partition_desc(ProbIndex *a, int lo, int hi, int *gt_end, int *eq_end, v4sf *gt_mass, v4sf *eq_mass)
+{
+    // three-way split of a[lo, hi) around a median-of-three pivot: entries above it first,
+    // then the ones equal to it, then the rest, each group in no particular order
+    int mid = lo + (hi - lo) / 2;
+    v4sf x = a[lo].prob, y = a[mid].prob, z = a[hi - 1].prob;
+    v4sf pivot = x < y ? (y < z ? y : (x < z ? z : x)) : (x < z ? x : (y < z ? z : y));
+    int g = lo;
+    *gt_mass = 0.0f;
+    for (int i = lo; i < hi; i++)
+    {
+        if (a[i].prob > pivot)
+        {
+            *gt_mass += a[i].prob;
+            swap_probindex(a, g++, i);
+        }
+    }
+    int e = g;
+    *eq_mass = 0.0f;
+    for (int i = g; i < hi; i++)
+    {
+        if (a[i].prob == pivot)
+        {
+            *eq_mass += a[i].prob;
+            swap_probindex(a, e++, i);
+        }
+    }
+    *gt_end = g;
+    *eq_end = e;
+}
+
 int sample_topp(v4sf *probabilities, int n, v4sf topp, ProbIndex *probindex, v4sf coin)
 {
     // top-p sampling (or "nucleus sampling") samples from the smallest set of
@@ -907,65 +2389,74 @@ int sample_topp(v4sf *probabilities, int n, v4sf topp, ProbIndex *probindex, v4s
     // have very low probabilities and are less likely to go "off the rails".
     // coin is a random number in [0, 1), usually from random_f32()
 
-    // Parameter validation
-    if (!probabilities || !probindex || n <= 0) {
-        ESP_LOGE(TAG, "Invalid parameters in sample_topp");
-        return 0;
+    // values smaller than (1 - topp) / (n - 1) cannot be part of the result
+    // so for efficiency we crop these out as candidates before sorting
+    int n0 = 0;
+    const v4sf cutoff = (1.0f - topp) / (n - 1);
+    for (int i = 0; i < n; i++)
+    {
+        if (probabilities[i] >= cutoff)
+        {
+            probindex[n0].index = i;
+            probindex[n0].prob = probabilities[i];
+            n0++;
+        }
     }
 
-    // First, create index array and sort by probability in descending order
-    for (int i = 0; i < n; i++) {
-        probindex[i].index = i;
-        probindex[i].prob = probabilities[i];
-    }
-    
-    // Use custom bubble sort instead of qsort for PSRAM compatibility
-    for (int i = 0; i < n - 1; i++) {
-        for (int j = 0; j < n - i - 1; j++) {
-            if (probindex[j].prob < probindex[j + 1].prob) {
-                ProbIndex temp = probindex[j];
-                probindex[j] = probindex[j + 1];
-                probindex[j + 1] = temp;
-            }
-        }
+    if (n0 == 0)
+    {
+        // only possible for topp < 1 / n on a flat distribution
+        return sample_mult(probabilities, n, coin);
     }
 
-    // Find the cutoff point where cumulative probability exceeds topp
+    // quickselect the nucleus instead of sorting every candidate: keep the part above the
+    // pivot while it already reaches topp, otherwise bank its mass and look below it.
+    // everything in [0, lo) is in the nucleus, the boundary is somewhere in [lo, hi)
+    int lo = 0;
+    int hi = n0;
     v4sf cumulative_prob = 0.0f;
-    int last_idx = n - 1; // Default to all tokens if cumulative never reaches topp
-    for (int i = 0; i < n; i++) {
-        cumulative_prob += probindex[i].prob;
-        if (cumulative_prob >= topp) {
-            last_idx = i;
+    while (hi - lo > 16)
+    {
+        int gt_end, eq_end;
+        v4sf gt_mass, eq_mass;
+        partition_desc(probindex, lo, hi, &gt_end, &eq_end, &gt_mass, &eq_mass);
+        if (cumulative_prob + gt_mass >= topp)
+        {
+            hi = gt_end;
+        }
+        else if (cumulative_prob + gt_mass + eq_mass >= topp)
+        {
+            // the boundary falls among equal entries, which need no further ordering
+            cumulative_prob += gt_mass;
+            lo = gt_end;
+            hi = eq_end;
             break;
         }
+        else
+        {
+            cumulative_prob += gt_mass + eq_mass;
+            lo = eq_end;
+        }
     }
-    
-    // Debug logging - ensure safe array access
-    v4sf max_prob = (n > 0) ? probindex[0].prob : 0.0f;
-    v4sf min_prob = (n > 0) ? probindex[n-1].prob : 0.0f;
-    v4sf cutoff_prob = (last_idx >= 0 && last_idx < n) ? probindex[last_idx].prob : 0.0f;
-    ESP_LOGI(TAG, "Top-p debug: topp=%.3f, n=%d, cutoff=%.6f, max_prob=%.6f, min_prob=%.6f", 
-             topp, n, cutoff_prob, max_prob, min_prob);
-    
-    // If probabilities are too small, fall back to simple multinomial sampling
-    if (max_prob < 0.0001f) {
-        ESP_LOGW(TAG, "No tokens passed cutoff, falling back to multinomial sampling");
-        // Just return a simple multinomial sample instead of complex top-p
-        v4sf cdf = 0.0f;
-        for (int i = 0; i < n; i++) {
-            cdf += probabilities[i];
-            if (coin < cdf) {
-                return i;
-            }
+    qsort(probindex + lo, hi - lo, sizeof(ProbIndex), compare);
+
+    // truncate the list where cumulative probability reaches topp
+    int last_idx = hi - 1; // in case of rounding errors consider all elements
+    for (int i = lo; i < hi; i++)
+    {
+        cumulative_prob += probindex[i].prob;
+        if (cumulative_prob >= topp)
+        {
+            last_idx = i;
+            break; // we've reached topp by including last_idx
         }
-        return n - 1; // fallback to last token
     }
 
-    // sample from the truncated list
+    // sample from the truncated list. it is only ordered around its boundary, which
+    // changes which token a given coin lands on but not the distribution drawn from
     v4sf r = coin * cumulative_prob;
     v4sf cdf = 0.0f;
-    for (int i = 0; i <= last_idx && i < n; i++)
+    for (int i = 0; i <= last_idx; i++)
     {
         cdf += probindex[i].prob;
         if (r < cdf)
@@ -973,14 +2464,7 @@ int sample_topp(v4sf *probabilities, int n, v4sf topp, ProbIndex *probindex, v4s
             return probindex[i].index;
         }
     }
-    
-    // Final fallback with bounds checking
-    if (last_idx >= 0 && last_idx < n) {
-        return probindex[last_idx].index; // in case of rounding errors
-    } else {
-        ESP_LOGE(TAG, "Invalid last_idx in sample_topp: %d, n: %d", last_idx, n);
-        return 0; // fallback to first token
-    }
+    return probindex[last_idx].index; // in case of rounding errors
 }
 
 void build_sampler(Sampler *sampler, int vocab_size, v4sf temperature, v4sf topp, unsigned long long rng_seed)
@@ -989,19 +2473,23 @@ void build_sampler(Sampler *sampler, int vocab_size, v4sf temperature, v4sf topp
     sampler->temperature = temperature;
     sampler->topp = topp;
     sampler->rng_state = rng_seed;
-    // buffer only used with nucleus sampling; may not need but it's ~small
-    // Force allocation in internal RAM to avoid PSRAM access issues with qsort
-    sampler->probindex = heap_caps_malloc(sampler->vocab_size * sizeof(ProbIndex), MALLOC_CAP_INTERNAL);
-    if (!sampler->probindex) {
-        ESP_LOGE(TAG, "Failed to allocate probindex buffer");
-        exit(EXIT_FAILURE);
-    }
+    sampler->allowed = NULL;
+    sampler->n_allowed = 0;
+    // buffer only used with nucleus sampling; may not need but it's ~small.
+    // sample_topp() walks it several times per token, so it is planned as a hot buffer
+    sampler->probindex = llm_buffer("probindex", sampler->vocab_size * sizeof(ProbIndex), MALLOC_CAP_INTERNAL);
     ESP_LOGI(TAG, "Sampler Successfully built");
 }
 
+void sampler_restrict(Sampler *sampler, const int *tokens, int n)
+{
+    sampler->allowed = n > 0 ? tokens : NULL;
+    sampler->n_allowed = n;
+}
+
 void free_sampler(Sampler *sampler)
 {
-    free(sampler->probindex);
+    llm_buffer_free(sampler->probindex);
 }
 
 unsigned int random_u32(unsigned long long *state)
@@ -1017,39 +2505,57 @@ v4sf random_f32(unsigned long long *state)
     return (random_u32(state) >> 8) / 16777216.0f;
 }
 
-int sample(Sampler *sampler, v4sf *logits)
+int sample_sparse(Sampler *sampler, v4sf *logits, const int *ids, int n)
 {
-    // sample the token given the logits and some hyperparameters
+    // sample among the n candidates given their logits and some hyperparameters. tokens
+    // that are not candidates are never picked, as if their logits were -inf
     int next;
     if (sampler->temperature == 0.0f)
     {
         // greedy argmax sampling: take the token with the highest probability
-        next = sample_argmax(logits, sampler->vocab_size);
+        next = sample_argmax(logits, n);
     }
     else
     {
         // apply the temperature to the logits
-        for (int q = 0; q < sampler->vocab_size; q++)
+        for (int q = 0; q < n; q++)
         {
             logits[q] /= sampler->temperature;
         }
         // apply softmax to the logits to get the probabilities for next token
-        softmax(logits, sampler->vocab_size);
+        llm_softmax(logits, n);
         // flip a (v4sf) coin (this is our source of entropy for sampling)
         v4sf coin = random_f32(&sampler->rng_state);
         // we sample from this distribution to get the next token
         if (sampler->topp <= 0 || sampler->topp >= 1)
         {
             // simply sample from the predicted probability distribution
-            next = sample_mult(logits, sampler->vocab_size, coin);
+            next = sample_mult(logits, n, coin);
         }
         else
         {
             // top-p (nucleus) sampling, clamping the least likely tokens to zero
-            next = sample_topp(logits, sampler->vocab_size, sampler->topp, sampler->probindex, coin);
+            next = sample_topp(logits, n, sampler->topp, sampler->probindex, coin);
+        }
+    }
+    return ids ? ids[next] : next;
+}
+
+int sample(Sampler *sampler, v4sf *logits)
+{
+    // sample the token given the logits of the whole vocabulary
+    int n = sampler->vocab_size;
+    if (sampler->allowed)
+    {
+        // move the allowed logits to the front and sample among those alone. allowed is
+        // ascending, so each logit is read before anything is written over it
+        n = sampler->n_allowed;
+        for (int i = 0; i < n; i++)
+        {
+            logits[i] = logits[sampler->allowed[i]];
         }
     }
-    return next;
+    return sample_sparse(sampler, logits, sampler->allowed, n);
 }
 
 // ----------------------------------------------------------------------------
@@ -1066,6 +2572,45 @@ long time_in_ms()
 // ----------------------------------------------------------------------------
 // generation loop
 
+#if LLM_SPEC_DRAFT
+int speculate(Transformer *t, Sampler *sampler, const int *context, int pos, SpecStats *stats, int *out)
+{
+    // one pass for the token at pos (the last of context[0..pos]): forward() when the drafter
+    // has nothing, otherwise forward_verify() of it and its draft. each position is sampled in
+    // turn and a draft token is kept only while the sampler picked it, so the tokens written
+    // to out are drawn exactly as sampling them one at a time would draw them. returns how many
+    int batch[LLM_SPEC_DRAFT + 1];
+    int room = t->config.seq_len - 1 - pos;
+    int n_draft = draft_tokens(context, pos + 1, batch + 1, room < LLM_SPEC_DRAFT ? room : LLM_SPEC_DRAFT);
+    int n = 0;
+    stats->passes++;
+    if (n_draft == 0)
+    {
+        out[n++] = forward_sample(t, sampler, context[pos], pos);
+    }
+    else
+    {
+        // keys and values of the rejected drafts stay in the cache past the last accepted
+        // position, where the next pass overwrites them before attention could read them
+        batch[0] = context[pos];
+        v4sf *logits = forward_verify(t, batch, n_draft + 1, pos);
+        stats->drafted += n_draft;
+        while (n <= n_draft)
+        {
+            out[n] = sample(sampler, logits + n * t->config.vocab_size);
+            n++;
+            if (n > n_draft || out[n - 1] != batch[n])
+            {
+                break;
+            }
+            stats->accepted++;
+        }
+    }
+    stats->produced += n;
+    return n;
+}
+#endif
+
 void generate(Transformer *transformer, Tokenizer *tokenizer, Sampler *sampler, char *prompt, int steps, generated_complete_cb cb_done, token_generated_cb cb_token)
 {
     char *empty_prompt = "";
@@ -1076,54 +2621,138 @@ void generate(Transformer *transformer, Tokenizer *tokenizer, Sampler *sampler,
 
     // encode the (string) prompt into tokens sequence
     int num_prompt_tokens = 0;
-    int *prompt_tokens = (int *)malloc((strlen(prompt) + 3) * sizeof(int)); // +3 for '\0', ?BOS, ?EOS
+    int *prompt_tokens = llm_buffer("prompt_tokens", (strlen(prompt) + 3) * sizeof(int), MALLOC_CAP_DEFAULT); // +3 for '\0', ?BOS, ?EOS
     encode(tokenizer, prompt, 1, 0, prompt_tokens, &num_prompt_tokens);
     if (num_prompt_tokens < 1)
     {
         ESP_LOGE(TAG, "something is wrong, expected at least 1 prompt token");
         exit(EXIT_FAILURE);
     }
+    // the prompt is prefilled in one go, before anything could shift the cache, so it has to
+    // fit with room for one generated token; a longer one keeps its end
+    if (num_prompt_tokens > transformer->config.seq_len - 1)
+    {
+        int cut = num_prompt_tokens - (transformer->config.seq_len - 1);
+        ESP_LOGW(TAG, "Prompt is %d tokens, keeping the last %d of them", num_prompt_tokens, num_prompt_tokens - cut);
+        memmove(prompt_tokens, prompt_tokens + cut, (num_prompt_tokens - cut) * sizeof(int));
+        num_prompt_tokens -= cut;
+    }
 
     // start the main loop
+    Config *p = &transformer->config;
     long start = 0;               // used to time our code, only initialized after first iteration
     int next;                     // will store the next token in the sequence
     int token = prompt_tokens[0]; // kick off with the first token in the prompt
-    int pos = 0;                  // position in the sequence
-    while (pos < steps)
+    int pos = 0;                  // position in the kv cache, pulled back by every kv_shift()
+    int step = 0;                 // tokens gone through so far
+#if LLM_SPEC_DRAFT
+    // the token at every cache position, for the drafter, and the tokens the last pass
+    // produced that are still to be handed out
+    int *context = llm_buffer("spec_history", p->seq_len * sizeof(int), MALLOC_CAP_DEFAULT);
+    int queue[LLM_SPEC_DRAFT + 1];
+    int n_queued = 0;
+    int queued = 0;
+    SpecStats spec = {0};
+#endif
+    while (steps < 0 || step < steps)
     {
-        // forward the transformer to get logits for the next token
-        v4sf *logits = forward(transformer, token, pos);
+        // a full cache makes room by dropping the oldest half past the attention sinks,
+        // so attention never spans more than seq_len however long this runs
+        if (pos == p->seq_len)
+        {
+            int keep = LLM_KV_SINK_TOKENS < p->seq_len / 2 ? LLM_KV_SINK_TOKENS : 0;
+            int discard = (p->seq_len - keep) / 2;
+            kv_shift(transformer, keep, discard, pos);
+#if LLM_SPEC_DRAFT
+            memmove(context + keep, context + keep + discard, (pos - keep - discard) * sizeof(int));
+#endif
+            pos -= discard;
+        }
+#if LLM_SPEC_DRAFT
+        context[pos] = token;
+#endif
 
         // advance the state machine
-        if (pos < num_prompt_tokens - 1)
+        if (step < num_prompt_tokens - 1)
         {
             // if we are still processing the input prompt, force the next prompt token
-            next = prompt_tokens[pos + 1];
+            next = prompt_tokens[step + 1];
         }
-        else
+        else if (step == num_prompt_tokens - 1)
         {
-            // otherwise sample the next token from the logits
+            // the whole prompt goes through in one batched pass once its last token is reached
+            v4sf *logits;
+            long prefill_start = time_in_ms();
+#if LLM_KV_SNAPSHOT
+            // a prompt seen last time comes back from flash instead; one-token prompts
+            // are cheaper to run than to look up
+            logits = num_prompt_tokens > 1 ? snapshot_restore(transformer, prompt_tokens, num_prompt_tokens) : NULL;
+            if (logits)
+            {
+                ESP_LOGI(TAG, "Restored %d prompt tokens from snapshot in %ld ms", num_prompt_tokens, time_in_ms() - prefill_start);
+            }
+            else
+#endif
+            {
+                logits = forward_prefill(transformer, prompt_tokens, num_prompt_tokens, 0);
+                ESP_LOGI(TAG, "Prefilled %d prompt tokens in %ld ms", num_prompt_tokens, time_in_ms() - prefill_start);
+#if LLM_KV_SNAPSHOT
+                // before sample(), which scales the logits in place
+                if (num_prompt_tokens > 1)
+                {
+                    snapshot_save(transformer, prompt_tokens, num_prompt_tokens);
+                }
+#endif
+            }
+            // sample the next token from the logits
             next = sample(sampler, logits);
         }
+#if LLM_SPEC_DRAFT
+        else
+        {
+            // one pass may produce several tokens; they are handed out one per step, with
+            // their keys and values already in the cache
+            if (queued == n_queued)
+            {
+                n_queued = speculate(transformer, sampler, context, pos, &spec, queue);
+                queued = 0;
+            }
+            next = queue[queued++];
+        }
+#else
+        else
+        {
+            // forward the transformer to get logits for the next token, and sample it
+            next = forward_sample(transformer, sampler, token, pos);
+        }
+#endif
         pos++;
+        step++;
 
-        // data-dependent terminating condition: the BOS (=1) token delimits sequences
+        // data-dependent terminating condition: the BOS (=1) token delimits sequences.
+        // endless generation feeds it back in, without printing it, and starts another story
         if (next == 1)
         {
-            break;
+            if (steps >= 0)
+            {
+                break;
+            }
+            token = next;
+            continue;
         }
 
         // print the token as string, decode it with the Tokenizer object
         char *piece = decode(tokenizer, token, next);
-        ESP_LOGI(TAG, "Generated token %d -> piece: '%s' (len=%d)", next, piece, piece ? strlen(piece) : 0);
-        
-        // Debug: print each character's ASCII value in the piece
-        if (piece) {
-            for (int i = 0; i < strlen(piece); i++) {
-                ESP_LOGI(TAG, "  Piece char %d: '%c' (ASCII %d)", i, piece[i], (int)piece[i]);
-            }
+#if LLM_TRACE_LEVEL >= LLM_TRACE_TOKENS
+        ESP_LOGI(TAG, "Generated token %d -> piece: '%s' (len=%d)", next, piece, tokenizer->decode_table[next].length);
+#endif
+#if LLM_TRACE_LEVEL >= LLM_TRACE_BYTES
+        for (int i = 0; piece[i] != '\0'; i++)
+        {
+            ESP_LOGI(TAG, "  Piece char %d: '%c' (ASCII %d)", i, piece[i], (int)piece[i]);
         }
-        
+#endif
+
         // Call token callback if provided
         if (cb_token && piece) {
             cb_token(piece);
@@ -1131,24 +2760,32 @@ void generate(Transformer *transformer, Tokenizer *tokenizer, Sampler *sampler,
         safe_printf(piece); // same as printf("%s", piece), but skips "unsafe" bytes
         token = next;
 
-        // init the timer here because the first iteration can be slower
-        if (start == 0)
+        // init the timer once the prompt is in, its prefill isn't part of the decode rate
+        if (start == 0 && step >= num_prompt_tokens)
         {
             start = time_in_ms();
         }
     }
     printf("\n");
 
-    // report achieved tok/s (pos-1 because the timer starts after first iteration)
-    if (pos > 1)
+    // report achieved tok/s over the tokens generated after the timer started
+    if (step > num_prompt_tokens)
     {
         long end = time_in_ms();
-        float tks = (pos - 1) / (double)(end - start) * 1000;
+        float tks = (step - num_prompt_tokens) / (double)(end - start) * 1000;
         fprintf(stderr, "achieved tok/s: %f\n", tks);
         cb_done(tks);
     }
+#if LLM_SPEC_DRAFT
+    if (spec.passes)
+    {
+        ESP_LOGI(TAG, "Speculative decoding: %d of %d drafted tokens accepted, %.2f tokens per forward pass",
+                 spec.accepted, spec.drafted, (float)spec.produced / spec.passes);
+    }
+    llm_buffer_free(context);
+#endif
 
-    free(prompt_tokens);
+    llm_buffer_free(prompt_tokens);
     ESP_LOGI(TAG, "Generate complete");
 }
 
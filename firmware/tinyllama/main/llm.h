@@ -10,14 +10,104 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include "sdkconfig.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
-#include "freertos/semphr.h"
-#include "freertos/task.h"
-#include "freertos/event_groups.h"
+#include "llm_rope.h"
+
+// Per-token logging in generate() and main.c, compiled out unless asked for
+#define LLM_TRACE_NONE 0
+#define LLM_TRACE_TOKENS 1 // every generated piece
+#define LLM_TRACE_BYTES 2  // every piece and each of its bytes
+
+#ifndef LLM_TRACE_LEVEL
+#define LLM_TRACE_LEVEL LLM_TRACE_NONE
+#endif
 
 typedef float v4sf __attribute__((aligned(16)));
 
+// Precision of the kv cache (menuconfig: "KV cache precision"). Lower precisions shrink the
+// history attention has to stream on every token and let short contexts live in internal RAM
+#define LLM_KV_CACHE_F32 0
+#define LLM_KV_CACHE_F16 1  // IEEE half floats
+#define LLM_KV_CACHE_INT8 2 // int8 with one fp32 scale per head vector
+
+#ifndef LLM_KV_CACHE
+#if CONFIG_LLM_KV_CACHE_F16
+#define LLM_KV_CACHE LLM_KV_CACHE_F16
+#elif CONFIG_LLM_KV_CACHE_INT8
+#define LLM_KV_CACHE LLM_KV_CACHE_INT8
+#else
+#define LLM_KV_CACHE LLM_KV_CACHE_F32
+#endif
+#endif
+
+#if LLM_KV_CACHE == LLM_KV_CACHE_F16
+typedef uint16_t kv_t;
+#elif LLM_KV_CACHE == LLM_KV_CACHE_INT8
+typedef int8_t kv_t;
+#else
+typedef float kv_t;
+#endif
+
+// Once generation reaches seq_len, kv_shift() keeps the first LLM_KV_SINK_TOKENS positions
+// (the attention sinks every later token leans on), drops the oldest half of the rest and
+// slides the newer half down, so generation can go on with attention over at most seq_len
+#ifndef LLM_KV_SINK_TOKENS
+#define LLM_KV_SINK_TOKENS 4
+#endif
+
+// most query heads attention_heads() scores in one pass over the keys and values of the
+// kv head they share; grouped-query models with more heads per kv head take several passes
+#ifndef LLM_ATTENTION_GROUP
+#define LLM_ATTENTION_GROUP 8
+#endif
+
+// timesteps attention scores at a time. Each tile is scored, softmaxed online against the
+// running max and sum of its head and applied to the values before the next one, so the
+// scores never need a whole seq_len row
+#ifndef LLM_ATTENTION_TILE
+#define LLM_ATTENTION_TILE 32
+#endif
+
+// Speculative decoding: generate() drafts up to LLM_SPEC_DRAFT tokens by prompt lookup (the
+// tokens that followed the last earlier occurrence of the newest LLM_SPEC_NGRAM tokens in
+// the context), checks them all with one forward_verify() pass and keeps the longest prefix
+// the sampler agrees with. 0 turns it off (menuconfig: "Speculative decoding draft length")
+#ifndef LLM_SPEC_DRAFT
+#ifdef CONFIG_LLM_SPEC_DRAFT
+#define LLM_SPEC_DRAFT CONFIG_LLM_SPEC_DRAFT
+#else
+#define LLM_SPEC_DRAFT 0
+#endif
+#endif
+#ifndef LLM_SPEC_NGRAM
+#define LLM_SPEC_NGRAM 2
+#endif
+
+// Sparse classifier: forward_sample() computes logits only for the tokens the sampler can
+// return (its sampler_restrict() list, or the whole vocabulary). For greedy sampling with an
+// fp32 checkpoint it first pre-scores them against an int8 copy of wcls and recomputes in
+// full only those whose error bound leaves them a chance of being the argmax, so it picks the
+// same token the full classifier would. 0 turns it off (menuconfig: "Sparse classifier")
+#ifndef LLM_SPARSE_CLASSIFIER
+#if CONFIG_LLM_SPARSE_CLASSIFIER
+#define LLM_SPARSE_CLASSIFIER 1
+#else
+#define LLM_SPARSE_CLASSIFIER 0
+#endif
+#endif
+
+// internal RAM the buffer arena leaves to everything else (task stacks, drivers)
+#define LLM_ARENA_INTERNAL_RESERVE (64 * 1024)
+
+// prompts up to this long are encoded and prefilled in planned buffers; longer ones
+// still work, with their token buffers taken from the heap
+#ifndef LLM_MAX_PROMPT_BYTES
+#define LLM_MAX_PROMPT_BYTES 256
+#endif
+
 typedef struct {
     float prob;
     int index;
@@ -29,20 +119,27 @@ typedef struct {
     float temperature;
     float topp;
     unsigned long long rng_state;
+    const int* allowed; // when set, the only token ids sample() returns, ascending
+    int n_allowed;
 } Sampler;
 
 typedef struct {
-    char *str;
-    int id;
-} TokenIndex;
+    int offset; // start of the decoded text in vocab_arena, null terminated
+    int length; // its length in bytes
+} TokenPiece;
 
 typedef struct {
-    char** vocab;
+    char* vocab_arena; // every vocab string back to back, then the 256 single-byte pieces
+    char** vocab; // each token's vocab string, pointing into vocab_arena
+    TokenPiece* decode_table; // what each token prints as, with raw-byte tokens resolved
     v4sf* vocab_scores;
-    TokenIndex *sorted_vocab;
+    int* vocab_len; // strlen of every vocab entry
+    int* vocab_hash; // open-addressing table of vocab ids keyed by their string, -1 marks empty slots
+    unsigned int vocab_hash_mask; // table size - 1, the size is a power of two
     int vocab_size;
     unsigned int max_token_length;
-    unsigned char byte_pieces[512]; // stores all single-byte strings
+    int* led_tokens; // ids of the tokens the LED board can show something of, ascending, plus BOS and EOS
+    int n_led_tokens;
 } Tokenizer;
 
 typedef struct {
@@ -55,6 +152,11 @@ typedef struct {
     int seq_len; // max sequence length
 } Config;
 
+typedef struct {
+    int8_t* q;    // quantized values
+    v4sf* s;      // scaling factors, one per group
+} QuantizedTensor;
+
 typedef struct {
     // token embedding table
     v4sf* token_embedding_table;    // (vocab_size, dim)
@@ -74,6 +176,18 @@ typedef struct {
     v4sf* rms_final_weight; // (dim,)
     // (optional) classifier weights for the logits, on the last layer
     v4sf* wcls;
+    // int8 weights of a Q8 checkpoint; when group_size is set these replace
+    // the fp32 embedding table and matmul weights above, which are left NULL
+    int group_size; // quantization group size, 0 for fp32 checkpoints
+    QuantizedTensor* q_tokens; // (vocab_size, dim)
+    QuantizedTensor* q_wq; // (layer, dim, n_heads * head_size)
+    QuantizedTensor* q_wk; // (layer, dim, n_kv_heads * head_size)
+    QuantizedTensor* q_wv; // (layer, dim, n_kv_heads * head_size)
+    QuantizedTensor* q_wo; // (layer, n_heads * head_size, dim)
+    QuantizedTensor* q_w1; // (layer, hidden_dim, dim)
+    QuantizedTensor* q_w2; // (layer, dim, hidden_dim)
+    QuantizedTensor* q_w3; // (layer, hidden_dim, dim)
+    QuantizedTensor* q_wcls;
 } TransformerWeights;
 
 typedef struct {
@@ -82,15 +196,25 @@ typedef struct {
     v4sf *xb; // same, but inside a residual branch (dim,)
     v4sf *xb2; // an additional buffer just for convenience (dim,)
     v4sf *hb; // buffer for hidden dimension in the ffn (hidden_dim,)
-    v4sf *hb2; // buffer for hidden dimension in the ffn (hidden_dim,)
     v4sf *q; // query (dim,)
-    v4sf *k; // key (dim,)
-    v4sf *v; // value (dim,)
-    v4sf *att; // buffer for scores/attention values (n_heads, seq_len)
+    v4sf *k; // key of the current position, before it is stored in the cache (kv_dim,)
+    v4sf *v; // value of the current position (kv_dim,)
+    v4sf *att; // one tile of scores/attention values per head (n_heads, LLM_ATTENTION_TILE)
     v4sf *logits; // output logits
+    v4sf *spec_logits; // logits of every verified position (LLM_SPEC_DRAFT + 1, vocab_size), speculative decoding only
+    QuantizedTensor xq; // quantized x (dim,), only used with Q8 checkpoints
+    QuantizedTensor hq; // quantized hb (hidden_dim,), only used with Q8 checkpoints
+    QuantizedTensor cls_prescore; // int8 wcls with one scale per row (vocab_size, dim), sparse classifier with fp32 checkpoints only
+    int *cls_rows; // token ids the sparse classifier scores (vocab_size,)
+    // rotary embeddings
+    RopeTable rope; // per-pair frequencies, and optionally the whole table
+    v4sf *rope_cos; // cos of the current position (head_size / 2,)
+    v4sf *rope_sin; // sin of the current position (head_size / 2,)
     // kv cache
-    v4sf* key_cache;   // (layer, seq_len, dim)
-    v4sf* value_cache; // (layer, seq_len, dim)
+    kv_t* key_cache;   // (layer, seq_len, kv_dim)
+    kv_t* value_cache; // (layer, seq_len, kv_dim)
+    v4sf* key_scale;   // (layer, seq_len, n_kv_heads), LLM_KV_CACHE_INT8 only
+    v4sf* value_scale; // (layer, seq_len, n_kv_heads), LLM_KV_CACHE_INT8 only
 } RunState;
 
 
@@ -101,18 +225,55 @@ typedef struct {
     // some more state needed to properly clean up the memory mapping (sigh)
     int fd; // file descriptor for memory mapping
     v4sf* data; // memory mapped data pointer
-    size_t file_size; // size of the checkpoint file in bytes
+    size_t file_size; // size of the checkpoint in bytes, without the padding of the partition it is mapped from
+    uint32_t model_crc; // CRC-32 of the checkpoint, the model half of snapshot keys
 } Transformer;
 
 
 
+typedef struct {
+    int passes;   // forward() or forward_verify() calls
+    int produced; // tokens those passes sampled
+    int drafted;  // draft tokens verified
+    int accepted; // draft tokens the sampler agreed with
+} SpecStats;
+
 typedef void (*generated_complete_cb)(float tokens_ps);
 typedef void (*token_generated_cb)(const char* token_str);
 
 void build_transformer(Transformer *t, char* checkpoint_path);
+void build_transformer_from_partition(Transformer *t, const char* partition_label);
 void build_tokenizer(Tokenizer* t, char* tokenizer_path, int vocab_size);
 void build_sampler(Sampler* sampler, int vocab_size, float temperature, float topp, unsigned long long rng_seed);
+float* forward(Transformer* transformer, int token, int pos);
+float* forward_prefill(Transformer* transformer, int* tokens, int n, int start_pos);
+// tokens[0..n) at positions pos.. in one batched pass, returning the logits of each of them
+// (n rows of vocab_size); n is at most LLM_SPEC_DRAFT + 1
+float* forward_verify(Transformer* transformer, int* tokens, int n, int pos);
+// one speculative decoding pass for the token at pos, context[0..pos] holding the token at
+// every position: writes the tokens it produced to out (up to LLM_SPEC_DRAFT + 1 of them, the
+// keys and values of all but the last already cached) and returns how many. LLM_SPEC_DRAFT only
+int speculate(Transformer* transformer, Sampler* sampler, const int* context, int pos, SpecStats* stats, int* out);
+// forward() and sample() in one, with the classifier limited as LLM_SPARSE_CLASSIFIER describes
+int forward_sample(Transformer* transformer, Sampler* sampler, int token, int pos);
+void encode(Tokenizer* t, char* text, int8_t bos, int8_t eos, int* tokens, int* n_tokens);
+char* decode(Tokenizer* t, int prev_token, int token);
+int sample(Sampler* sampler, float* logits);
+// sample among n candidates, logits[i] being the logit of token ids[i] (of token i when ids
+// is NULL); returns the token id. like sample(), it scales the logits in place
+int sample_sparse(Sampler* sampler, float* logits, const int* ids, int n);
+// limit sample() to the n ascending token ids in tokens (which must outlive the sampler), e.g.
+// the tokenizer's led_tokens; NULL lifts the limit
+void sampler_restrict(Sampler* sampler, const int* tokens, int n);
+unsigned int random_u32(unsigned long long *state);
+float random_f32(unsigned long long *state);
+// steps may exceed seq_len, the kv cache is shifted as it fills; steps < 0 generates forever,
+// carrying on across the BOS tokens that end each story
 void generate(Transformer *transformer, Tokenizer *tokenizer, Sampler *sampler, char *prompt, int steps, generated_complete_cb cb_done, token_generated_cb cb_token);
+// drop cache positions [n_keep, n_keep + n_discard) and move the ones up to n_past down over them
+void kv_shift(Transformer *t, int n_keep, int n_discard, int n_past);
+// the tokenizer and sampler take their buffers from the transformer's arena when it
+// planned them, so free them before the transformer
 void free_sampler(Sampler* sampler);
 void free_transformer(Transformer* t);
 void free_tokenizer(Tokenizer* t);
@@ -0,0 +1,150 @@
+#include "llm_arena.h"
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_heap_caps.h"
+
+static const char *TAG = "LLM_ARENA";
+
+static const char *region_names[ARENA_REGIONS] = {"internal", "external"};
+
+static ArenaBuffer *arena_find(const Arena *a, const char *name)
+{
+    for (int i = 0; i < a->n_buffers; i++)
+    {
+        if (strcmp(a->buffers[i].name, name) == 0)
+        {
+            return (ArenaBuffer *)&a->buffers[i];
+        }
+    }
+    return NULL;
+}
+
+void arena_reserve(Arena *a, const char *name, size_t size, int heat)
+{
+    if (a->base[ARENA_INTERNAL] || a->base[ARENA_EXTERNAL])
+    {
+        ESP_LOGE(TAG, "Cannot reserve %s, the arena is already planned", name);
+        exit(EXIT_FAILURE);
+    }
+    size = (size + LLM_ARENA_ALIGN - 1) & ~(size_t)(LLM_ARENA_ALIGN - 1);
+    ArenaBuffer *b = arena_find(a, name);
+    if (b)
+    {
+        b->size = size > b->size ? size : b->size;
+        return;
+    }
+    if (a->n_buffers == LLM_ARENA_MAX_BUFFERS)
+    {
+        ESP_LOGE(TAG, "More than %d arena buffers", LLM_ARENA_MAX_BUFFERS);
+        exit(EXIT_FAILURE);
+    }
+    a->buffers[a->n_buffers++] = (ArenaBuffer){name, size, heat, ARENA_EXTERNAL, 0, 0};
+}
+
+static void *region_alloc(ArenaRegion region, size_t size)
+{
+    if (size == 0)
+    {
+        return NULL;
+    }
+    void *ptr;
+    if (region == ARENA_INTERNAL)
+    {
+        ptr = heap_caps_aligned_alloc(LLM_ARENA_ALIGN, size, MALLOC_CAP_INTERNAL);
+    }
+    else
+    {
+        // boards without PSRAM fall back to whatever the default heap has
+        ptr = heap_caps_aligned_alloc(LLM_ARENA_ALIGN, size, MALLOC_CAP_SPIRAM);
+        ptr = ptr ? ptr : heap_caps_aligned_alloc(LLM_ARENA_ALIGN, size, MALLOC_CAP_DEFAULT);
+    }
+    if (!ptr)
+    {
+        ESP_LOGE(TAG, "Failed to allocate %zu bytes of %s arena", size, region_names[region]);
+        exit(EXIT_FAILURE);
+    }
+    return ptr;
+}
+
+void arena_plan(Arena *a, size_t internal_budget)
+{
+    // hottest first, reservation order among equals; the placement is first fit, so a
+    // colder buffer still lands in internal RAM if it fits in what a bigger one left over
+    int order[LLM_ARENA_MAX_BUFFERS];
+    for (int i = 0; i < a->n_buffers; i++)
+    {
+        int j = i;
+        for (; j > 0 && a->buffers[order[j - 1]].heat < a->buffers[i].heat; j--)
+        {
+            order[j] = order[j - 1];
+        }
+        order[j] = i;
+    }
+    a->budget = internal_budget;
+    a->used[ARENA_INTERNAL] = 0;
+    a->used[ARENA_EXTERNAL] = 0;
+    for (int i = 0; i < a->n_buffers; i++)
+    {
+        ArenaBuffer *b = &a->buffers[order[i]];
+        b->region = a->used[ARENA_INTERNAL] + b->size <= internal_budget ? ARENA_INTERNAL : ARENA_EXTERNAL;
+        b->offset = a->used[b->region];
+        a->used[b->region] += b->size;
+    }
+    a->base[ARENA_INTERNAL] = region_alloc(ARENA_INTERNAL, a->used[ARENA_INTERNAL]);
+    a->base[ARENA_EXTERNAL] = region_alloc(ARENA_EXTERNAL, a->used[ARENA_EXTERNAL]);
+}
+
+void *arena_take(Arena *a, const char *name, size_t size)
+{
+    ArenaBuffer *b = arena_find(a, name);
+    if (!b || !a->base[b->region] || b->taken || size > b->size)
+    {
+        return NULL;
+    }
+    b->taken = 1;
+    void *ptr = a->base[b->region] + b->offset;
+    memset(ptr, 0, size);
+    return ptr;
+}
+
+int arena_release(Arena *a, void *ptr)
+{
+    for (int i = 0; i < a->n_buffers; i++)
+    {
+        ArenaBuffer *b = &a->buffers[i];
+        if (a->base[b->region] && ptr == a->base[b->region] + b->offset)
+        {
+            b->taken = 0;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+ArenaRegion arena_region(const Arena *a, const char *name)
+{
+    ArenaBuffer *b = arena_find(a, name);
+    return b ? b->region : ARENA_EXTERNAL;
+}
+
+void arena_report(const Arena *a)
+{
+    for (int i = 0; i < a->n_buffers; i++)
+    {
+        const ArenaBuffer *b = &a->buffers[i];
+        ESP_LOGI(TAG, "%-16s %8zu bytes  %s +%zu", b->name, b->size, region_names[b->region], b->offset);
+    }
+    ESP_LOGI(TAG, "%d of %d buffers", a->n_buffers, LLM_ARENA_MAX_BUFFERS);
+    ESP_LOGI(TAG, "internal: %zu of %zu budgeted bytes, %zu free after the arena", a->used[ARENA_INTERNAL],
+             a->budget, heap_caps_get_free_size(MALLOC_CAP_INTERNAL));
+    ESP_LOGI(TAG, "external: %zu bytes, %zu free after the arena", a->used[ARENA_EXTERNAL],
+             heap_caps_get_free_size(MALLOC_CAP_SPIRAM));
+}
+
+void arena_free(Arena *a)
+{
+    free(a->base[ARENA_INTERNAL]);
+    free(a->base[ARENA_EXTERNAL]);
+    memset(a, 0, sizeof(*a));
+}
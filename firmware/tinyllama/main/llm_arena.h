@@ -0,0 +1,73 @@
+#ifndef LLM_ARENA_H
+#define LLM_ARENA_H
+
+/**
+ * Two-region static arena for the inference buffers.
+ *
+ * Every buffer is reserved up front under a name, with its size and how hot
+ * it is (how often forward() or the sampler reads it per token).
+ * arena_plan() then places them, hottest first, into internal RAM while they
+ * fit in the given budget and into PSRAM otherwise. It allocates each region
+ * as one block. arena_take() hands out a zeroed buffer by name and
+ * arena_release() returns it. Nothing after the plan goes through the heap.
+ *
+ * Buffers are found by name with a linear scan, which is fine for the few
+ * dozen a model needs and only happens while things are being built.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+// plan_buffers() reserves up to 48, for a Q8 checkpoint with the int8 kv cache, the RoPE table,
+// drafting and the sparse classifier on; the host's arena_all_on tests build that plan
+#define LLM_ARENA_MAX_BUFFERS 64
+#define LLM_ARENA_ALIGN 16 // every buffer starts 16-byte aligned, as v4sf promises
+
+typedef enum
+{
+    ARENA_INTERNAL,
+    ARENA_EXTERNAL,
+    ARENA_REGIONS
+} ArenaRegion;
+
+typedef struct
+{
+    const char *name;
+    size_t size;        // bytes, rounded up to LLM_ARENA_ALIGN
+    int heat;           // placement order, higher goes to internal RAM first
+    ArenaRegion region; // set by arena_plan()
+    size_t offset;      // within the region, set by arena_plan()
+    int taken;          // handed out by arena_take() and not released since
+} ArenaBuffer;
+
+typedef struct
+{
+    ArenaBuffer buffers[LLM_ARENA_MAX_BUFFERS];
+    int n_buffers;
+    uint8_t *base[ARENA_REGIONS]; // NULL until planned
+    size_t used[ARENA_REGIONS];   // bytes of each region the plan placed
+    size_t budget;                // internal bytes the plan was allowed
+} Arena;
+
+// Add a buffer to the plan; reserving the same name twice keeps the larger size
+void arena_reserve(Arena *a, const char *name, size_t size, int heat);
+
+// Place every reserved buffer and allocate both regions, at most internal_budget bytes of internal RAM
+void arena_plan(Arena *a, size_t internal_budget);
+
+// The zeroed buffer reserved as name, or NULL when it was not planned, is smaller than size or already taken
+void *arena_take(Arena *a, const char *name, size_t size);
+
+// Give a buffer from arena_take() back; returns 0 for pointers that are not in the arena
+int arena_release(Arena *a, void *ptr);
+
+// Region of a planned buffer
+ArenaRegion arena_region(const Arena *a, const char *name);
+
+// Log where every buffer went and what each region has left
+void arena_report(const Arena *a);
+
+// Free both regions and forget the plan
+void arena_free(Arena *a);
+
+#endif // LLM_ARENA_H
@@ -0,0 +1,88 @@
+#include "llm_container.h"
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_rom_crc.h"
+
+static const char *TAG = "LLM_CONTAINER";
+
+static const ContainerTensor *container_table(const void *data)
+{
+    return (const ContainerTensor *)((const char *)data + CONTAINER_HEADER_SIZE);
+}
+
+void container_open(const void *data, size_t available_size, ContainerHeader *header)
+{
+    memcpy(header, data, sizeof(ContainerHeader));
+    if (header->version != CONTAINER_VERSION)
+    {
+        ESP_LOGE(TAG, "Unsupported container version %ld", (long)header->version);
+        exit(EXIT_FAILURE);
+    }
+    size_t table_end = CONTAINER_HEADER_SIZE + (size_t)header->n_tensors * sizeof(ContainerTensor);
+    if (header->total_size > available_size || table_end > header->total_size)
+    {
+        ESP_LOGE(TAG, "Container claims %lu bytes, %zu available", (unsigned long)header->total_size, available_size);
+        exit(EXIT_FAILURE);
+    }
+    if (header->alignment < CONTAINER_MIN_ALIGNMENT || header->alignment % CONTAINER_MIN_ALIGNMENT != 0)
+    {
+        ESP_LOGE(TAG, "Container alignment %lu is not a multiple of %d", (unsigned long)header->alignment,
+                 CONTAINER_MIN_ALIGNMENT);
+        exit(EXIT_FAILURE);
+    }
+    if ((uintptr_t)data % header->alignment != 0)
+    {
+        ESP_LOGW(TAG, "Container mapped at %p, tensors are not %lu-byte aligned in memory", data,
+                 (unsigned long)header->alignment);
+    }
+
+#if LLM_CONTAINER_VERIFY_CRC
+    const uint8_t *body = (const uint8_t *)data + CONTAINER_HEADER_SIZE;
+    uint32_t crc = esp_rom_crc32_le(0, body, header->total_size - CONTAINER_HEADER_SIZE);
+    if (crc != header->crc32)
+    {
+        ESP_LOGE(TAG, "Container CRC mismatch: stored %08lx, computed %08lx", (unsigned long)header->crc32,
+                 (unsigned long)crc);
+        exit(EXIT_FAILURE);
+    }
+#endif
+    ESP_LOGI(TAG, "Container v%ld: %lu tensors, %lu bytes, %lu-byte aligned", (long)header->version,
+             (unsigned long)header->n_tensors, (unsigned long)header->total_size, (unsigned long)header->alignment);
+}
+
+const ContainerTensor *container_find(const void *data, const ContainerHeader *header, const char *name,
+                                      uint8_t dtype, size_t numel)
+{
+    const ContainerTensor *table = container_table(data);
+    for (uint32_t i = 0; i < header->n_tensors; i++)
+    {
+        const ContainerTensor *t = &table[i];
+        if (strncmp(t->name, name, sizeof(t->name)) != 0)
+        {
+            continue;
+        }
+        size_t count = 1;
+        for (int d = 0; d < t->n_dims && d < 4; d++)
+        {
+            count *= t->shape[d];
+        }
+        size_t value_size = dtype == CONTAINER_DTYPE_Q8 ? sizeof(int8_t) : sizeof(float);
+        if (t->dtype != dtype || count != numel || t->size != numel * value_size)
+        {
+            ESP_LOGE(TAG, "Tensor %s: dtype %d with %zu values, expected dtype %d with %zu", name, t->dtype, count,
+                     dtype, numel);
+            exit(EXIT_FAILURE);
+        }
+        size_t scale_size = dtype == CONTAINER_DTYPE_Q8 ? numel / header->group_size * sizeof(float) : 0;
+        if (t->offset % header->alignment != 0 || (size_t)t->offset + t->size > header->total_size ||
+            (dtype == CONTAINER_DTYPE_Q8 && (t->scale_offset % header->alignment != 0 ||
+                                             (size_t)t->scale_offset + scale_size > header->total_size)))
+        {
+            ESP_LOGE(TAG, "Tensor %s is misaligned or out of bounds", name);
+            exit(EXIT_FAILURE);
+        }
+        return t;
+    }
+    return NULL;
+}
@@ -0,0 +1,73 @@
+#ifndef LLM_CONTAINER_H
+#define LLM_CONTAINER_H
+
+/**
+ * Version 3 checkpoint container, written by tools/export_checkpoint.py.
+ *
+ * Layout, all little endian:
+ *   ContainerHeader, zero padded to CONTAINER_HEADER_SIZE bytes
+ *   n_tensors ContainerTensor entries
+ *   tensor data, every tensor (and every q8 scale block) starting at a
+ *   multiple of the header's alignment
+ *
+ * Tensors are looked up by name, so the loader does not depend on the order
+ * they were written in, and each one records its dtype and shape so a file
+ * that does not match the Config is rejected instead of read out of bounds.
+ * The CRC covers everything after the header; checking it streams the whole
+ * file once at load, so it can be turned off with LLM_CONTAINER_VERIFY_CRC.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include "llm.h"
+
+#define CONTAINER_MAGIC 0x616b3432 // "ak42", shared with the version 2 Q8 format
+#define CONTAINER_VERSION 3
+#define CONTAINER_HEADER_SIZE 256
+#define CONTAINER_MIN_ALIGNMENT 16 // what the aes3 kernels need from every row they load
+
+#define CONTAINER_SHARED_CLASSIFIER 1 // flags: no wcls tensor, the embedding table doubles as the classifier
+
+#define CONTAINER_DTYPE_F32 0
+#define CONTAINER_DTYPE_Q8 1 // int8 values, then fp32 scales for each group of group_size values
+
+#ifndef LLM_CONTAINER_VERIFY_CRC
+#define LLM_CONTAINER_VERIFY_CRC 1
+#endif
+
+typedef struct
+{
+    uint32_t magic;      // "ak42", shared with the version 2 Q8 format
+    int32_t version;     // CONTAINER_VERSION
+    Config config;
+    uint32_t flags;      // CONTAINER_SHARED_CLASSIFIER
+    int32_t group_size;  // of the q8 tensors, 0 when there are none
+    uint32_t n_tensors;  // entries in the tensor table
+    uint32_t alignment;  // every tensor offset is a multiple of this
+    uint32_t total_size; // header, table and data, in bytes
+    uint32_t crc32;      // CRC-32 (zlib polynomial) of bytes [CONTAINER_HEADER_SIZE, total_size)
+} ContainerHeader;
+
+typedef struct
+{
+    char name[32];         // null terminated, e.g. "wq" or "rms_final"
+    uint8_t dtype;         // CONTAINER_DTYPE_*
+    uint8_t n_dims;        // used entries of shape
+    uint16_t reserved;
+    int32_t shape[4];      // outermost first
+    uint32_t offset;       // of the values, from the start of the file
+    uint32_t scale_offset; // of the group scales, q8 only
+    uint32_t size;         // bytes of values
+} ContainerTensor;
+
+// Validate the header and tensor table (and the CRC, if enabled) of the container
+// at data, available_size bytes long. Fills header; exits on anything malformed
+void container_open(const void *data, size_t available_size, ContainerHeader *header);
+
+// The tensor called name with the given dtype and element count, or NULL when the
+// file has no such tensor. A tensor with the right name but the wrong dtype, size
+// or alignment is fatal
+const ContainerTensor *container_find(const void *data, const ContainerHeader *header, const char *name,
+                                      uint8_t dtype, size_t numel);
+
+#endif // LLM_CONTAINER_H
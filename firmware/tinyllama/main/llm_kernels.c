@@ -0,0 +1,116 @@
+#include "llm_kernels.h"
+#include <math.h>
+#include "esp_dsp.h"
+#include "llm_math.h"
+
+// ----------------------------------------------------------------------------
+// scalar reference
+
+void llm_rmsnorm_ansi(float *o, const float *x, const float *weight, int size)
+{
+    // calculate sum of squares
+    float ss = 0.0f;
+    for (int j = 0; j < size; j++)
+    {
+        ss += x[j] * x[j];
+    }
+    ss /= size;
+    ss += 1e-5f;
+    ss = 1.0f / sqrtf(ss);
+    // normalize and scale
+    for (int j = 0; j < size; j++)
+    {
+        o[j] = weight[j] * (ss * x[j]);
+    }
+}
+
+void llm_softmax_ansi(float *x, int size)
+{
+    // find max value (for numerical stability)
+    float max_val = x[0];
+    for (int i = 1; i < size; i++)
+    {
+        if (x[i] > max_val)
+        {
+            max_val = x[i];
+        }
+    }
+    // exp and sum
+    float sum = 0.0f;
+    for (int i = 0; i < size; i++)
+    {
+        x[i] = llm_expf(x[i] - max_val);
+        sum += x[i];
+    }
+    // normalize
+    for (int i = 0; i < size; i++)
+    {
+        x[i] /= sum;
+    }
+}
+
+void llm_residual_ansi(float *x, const float *y, int size)
+{
+    for (int i = 0; i < size; i++)
+    {
+        x[i] += y[i];
+    }
+}
+
+void llm_swiglu_ansi(float *h, const float *g, int size)
+{
+    for (int i = 0; i < size; i++)
+    {
+        float val = h[i];
+        // silu(x)=x*σ(x), where σ(x) is the logistic sigmoid
+        val *= llm_sigmoid(val);
+        // elementwise multiply with w3(x)
+        val *= g[i];
+        h[i] = val;
+    }
+}
+
+// ----------------------------------------------------------------------------
+// esp-dsp builds
+
+void llm_rmsnorm_dsp(float *o, const float *x, const float *weight, int size)
+{
+    // sum of squares as x . x on the aes3 dot product, then o = (x * weight) * scale
+    float ss;
+    dsps_dotprod_f32_aes3(x, x, &ss, size);
+    float scale = 1.0f / sqrtf(ss / size + 1e-5f);
+    dsps_mul_f32(x, weight, o, size, 1, 1, 1);
+    dsps_mulc_f32(o, o, size, scale, 1, 1);
+}
+
+void llm_softmax_dsp(float *x, int size)
+{
+    float max_val = x[0];
+    for (int i = 1; i < size; i++)
+    {
+        max_val = x[i] > max_val ? x[i] : max_val;
+    }
+    float sum = 0.0f;
+    for (int i = 0; i < size; i++)
+    {
+        x[i] = llm_expf(x[i] - max_val);
+        sum += x[i];
+    }
+    // one reciprocal instead of a division per element
+    dsps_mulc_f32(x, x, size, 1.0f / sum, 1, 1);
+}
+
+void llm_residual_dsp(float *x, const float *y, int size)
+{
+    dsps_add_f32(x, y, x, size, 1, 1, 1);
+}
+
+void llm_swiglu_dsp(float *h, const float *g, int size)
+{
+    // the sigmoid stays scalar, the gate product runs as one vector multiply
+    for (int i = 0; i < size; i++)
+    {
+        h[i] *= llm_sigmoid(h[i]);
+    }
+    dsps_mul_f32(h, g, h, size, 1, 1, 1);
+}
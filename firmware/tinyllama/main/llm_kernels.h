@@ -0,0 +1,51 @@
+#ifndef LLM_KERNELS_H
+#define LLM_KERNELS_H
+
+/**
+ * Vector kernels forward() runs around the matmuls: rmsnorm, softmax, the
+ * residual add and the SwiGLU gate.
+ *
+ * Every kernel comes in two builds, named like esp-dsp's:
+ *   _ansi  portable scalar C, the reference the others are checked against
+ *   _dsp   built on esp-dsp, the aes3 dot product for the rmsnorm sum of
+ *          squares and the zero-overhead-loop ae32 routines for elementwise
+ *          products and sums (esp-dsp has no aes3 versions of those)
+ *
+ * The unsuffixed names pick _dsp when esp-dsp is built optimized
+ * (CONFIG_DSP_OPTIMIZED) and _ansi otherwise. The _dsp builds round
+ * differently from the reference: they multiply by reciprocals and sum in
+ * another order, so outputs agree to float precision, not bit for bit.
+ * Both use the exp() selected in llm_math.h.
+ */
+
+#include "sdkconfig.h"
+
+// o = weight * x / rms(x); o may alias x
+void llm_rmsnorm_ansi(float *o, const float *x, const float *weight, int size);
+void llm_rmsnorm_dsp(float *o, const float *x, const float *weight, int size);
+
+// x = exp(x - max(x)) / sum, in place
+void llm_softmax_ansi(float *x, int size);
+void llm_softmax_dsp(float *x, int size);
+
+// x += y
+void llm_residual_ansi(float *x, const float *y, int size);
+void llm_residual_dsp(float *x, const float *y, int size);
+
+// h = silu(h) * g, where silu(v) = v * sigmoid(v)
+void llm_swiglu_ansi(float *h, const float *g, int size);
+void llm_swiglu_dsp(float *h, const float *g, int size);
+
+#if CONFIG_DSP_OPTIMIZED
+#define llm_rmsnorm llm_rmsnorm_dsp
+#define llm_softmax llm_softmax_dsp
+#define llm_residual llm_residual_dsp
+#define llm_swiglu llm_swiglu_dsp
+#else
+#define llm_rmsnorm llm_rmsnorm_ansi
+#define llm_softmax llm_softmax_ansi
+#define llm_residual llm_residual_ansi
+#define llm_swiglu llm_swiglu_ansi
+#endif
+
+#endif // LLM_KERNELS_H
@@ -0,0 +1,22 @@
+#include "llm_math.h"
+#include "esp_attr.h"
+
+// read for every lut_expf() call, so it lives in internal RAM rather than behind the flash cache
+DRAM_ATTR const float llm_exp2_table[64] = {
+    1.000000000e+00f, 1.010889286e+00f, 1.021897149e+00f, 1.033024879e+00f,
+    1.044273782e+00f, 1.055645178e+00f, 1.067140401e+00f, 1.078760798e+00f,
+    1.090507733e+00f, 1.102382583e+00f, 1.114386743e+00f, 1.126521619e+00f,
+    1.138788635e+00f, 1.151189230e+00f, 1.163724859e+00f, 1.176396992e+00f,
+    1.189207115e+00f, 1.202156731e+00f, 1.215247360e+00f, 1.228480536e+00f,
+    1.241857812e+00f, 1.255380757e+00f, 1.269050957e+00f, 1.282870016e+00f,
+    1.296839555e+00f, 1.310961212e+00f, 1.325236643e+00f, 1.339667524e+00f,
+    1.354255547e+00f, 1.369002423e+00f, 1.383909882e+00f, 1.398979673e+00f,
+    1.414213562e+00f, 1.429613338e+00f, 1.445180807e+00f, 1.460917794e+00f,
+    1.476826146e+00f, 1.492907728e+00f, 1.509164428e+00f, 1.525598151e+00f,
+    1.542210825e+00f, 1.559004400e+00f, 1.575980845e+00f, 1.593142151e+00f,
+    1.610490332e+00f, 1.628027422e+00f, 1.645755478e+00f, 1.663676580e+00f,
+    1.681792831e+00f, 1.700106354e+00f, 1.718619298e+00f, 1.737333835e+00f,
+    1.756252160e+00f, 1.775376493e+00f, 1.794709075e+00f, 1.814252176e+00f,
+    1.834008086e+00f, 1.853979125e+00f, 1.874167634e+00f, 1.894575982e+00f,
+    1.915206561e+00f, 1.936061793e+00f, 1.957144124e+00f, 1.978456026e+00f,
+};
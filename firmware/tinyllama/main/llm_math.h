@@ -0,0 +1,91 @@
+#ifndef LLM_MATH_H
+#define LLM_MATH_H
+
+/**
+ * exp() and sigmoid for the softmaxes and the SwiGLU gate.
+ *
+ * libm's expf is exact to the last bit but costly on the S3, and softmax
+ * calls it for every attention score and, in the sampler, for every
+ * vocabulary entry of every token. Menuconfig (LLM Inference -> exp()
+ * implementation) picks what llm_expf() is:
+ *   CONFIG_LLM_EXP_EXACT  libm expf (default)
+ *   CONFIG_LLM_EXP_FAST   fast_expf: range reduction to |r| <= ln2/2 and a
+ *                         degree 7 polynomial, within about 1e-7 relative
+ *   CONFIG_LLM_EXP_LUT    lut_expf: a 64-entry 2^(j/64) table and a cubic on
+ *                         |r| <= ln2/128, within about 2e-7 relative
+ * Both approximations flush results below 2^-126 to zero and saturate above
+ * exp(88), which is all softmax ever needs: its inputs are <= 0.
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include "sdkconfig.h"
+
+#define LLM_EXP_MIN -87.3f // exp of anything lower is subnormal; returned as 0
+#define LLM_EXP_MAX 88.0f  // inputs are clamped here, just short of FLT_MAX
+
+extern const float llm_exp2_table[64]; // 2^(j/64)
+
+static inline float llm_pow2i(int n)
+{
+    // 2^n for n in [-126, 127], straight into the exponent bits
+    uint32_t bits = (uint32_t)(n + 127) << 23;
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+static inline float fast_expf(float x)
+{
+    if (x < LLM_EXP_MIN)
+    {
+        return 0.0f;
+    }
+    x = x > LLM_EXP_MAX ? LLM_EXP_MAX : x;
+    // x = n ln2 + r, with ln2 split in two so r keeps its low bits (Cody-Waite)
+    float t = x * 1.44269504f;
+    int n = (int)(t + (t >= 0.0f ? 0.5f : -0.5f));
+    float r = x - n * 0.693359375f + n * 2.12194440e-4f;
+    // exp(r) on [-ln2/2, ln2/2], coefficients from Cephes expf
+    float p = 1.9875691500e-4f;
+    p = p * r + 1.3981999507e-3f;
+    p = p * r + 8.3334519073e-3f;
+    p = p * r + 4.1665795894e-2f;
+    p = p * r + 1.6666665459e-1f;
+    p = p * r + 5.0000001201e-1f;
+    p = p * r * r + r + 1.0f;
+    return p * llm_pow2i(n);
+}
+
+static inline float lut_expf(float x)
+{
+    if (x < LLM_EXP_MIN)
+    {
+        return 0.0f;
+    }
+    x = x > LLM_EXP_MAX ? LLM_EXP_MAX : x;
+    // x = (64 n + j) ln2/64 + r: 2^n from the exponent bits, 2^(j/64) from the table;
+    // the high part of ln2/64 has 11 bits, so k * hi is exact for every |k| < 2^13
+    float t = x * 92.3324826f;
+    int k = (int)(t + (t >= 0.0f ? 0.5f : -0.5f));
+    float r = x - k * 1.0826110840e-2f - k * 4.3138566070e-6f;
+    float p = 1.0f + r * (1.0f + r * (0.5f + r * (1.0f / 6.0f)));
+    return p * llm_exp2_table[k & 63] * llm_pow2i(k >> 6);
+}
+
+#if CONFIG_LLM_EXP_FAST
+#define llm_expf fast_expf
+#elif CONFIG_LLM_EXP_LUT
+#define llm_expf lut_expf
+#else
+#define llm_expf expf
+#endif
+
+// logistic sigmoid on whichever exp() was selected
+static inline float llm_sigmoid(float x)
+{
+    return 1.0f / (1.0f + llm_expf(-x));
+}
+
+#endif // LLM_MATH_H
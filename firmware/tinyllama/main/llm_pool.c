@@ -0,0 +1,145 @@
+#include "llm_pool.h"
+#include <stdatomic.h>
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "llm_profile.h"
+
+// How long either side busy-waits before blocking on a task notification.
+// A forward pass dispatches jobs back to back, so the worker almost never sleeps mid-token.
+#define POOL_SPIN_LIMIT 20000
+
+static const char *TAG = "LLM_POOL";
+
+typedef struct
+{
+    llm_pool_fn fn;
+    void *arg;
+    int start;
+    int end;
+    atomic_uint seq;  // bumped by the caller to publish a job
+    atomic_uint done; // set to seq by the worker once its half is finished
+#if LLM_PROFILE
+    uint32_t worker_cycles; // spent on the worker's half, published by done
+#endif
+} PoolJob;
+
+static PoolJob job;
+static atomic_int worker_sleeping;
+static atomic_int caller_waiting;
+static TaskHandle_t worker_task = NULL;
+static TaskHandle_t caller_task = NULL;
+
+static void pool_worker(void *params)
+{
+    unsigned int last = 0;
+    for (;;)
+    {
+        // wait for a new job: spin first, then block until the caller notifies us
+        unsigned int seq;
+        int spins = 0;
+        while ((seq = atomic_load(&job.seq)) == last)
+        {
+            if (++spins < POOL_SPIN_LIMIT)
+            {
+                continue;
+            }
+            atomic_store(&worker_sleeping, 1);
+            if (atomic_load(&job.seq) == last)
+            {
+                ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            }
+            atomic_store(&worker_sleeping, 0);
+            spins = 0;
+        }
+        last = seq;
+
+#if LLM_PROFILE
+        uint32_t started = esp_cpu_get_cycle_count();
+        job.fn(job.arg, job.start, job.end);
+        job.worker_cycles = esp_cpu_get_cycle_count() - started;
+#else
+        job.fn(job.arg, job.start, job.end);
+#endif
+
+        atomic_store(&job.done, seq);
+        if (atomic_load(&caller_waiting))
+        {
+            xTaskNotifyGive(caller_task);
+        }
+    }
+}
+
+void llm_pool_init(void)
+{
+    if (worker_task)
+    {
+        return;
+    }
+    atomic_store(&job.seq, 0);
+    atomic_store(&job.done, 0);
+    xTaskCreatePinnedToCore(pool_worker, "LlmWorker", 2048, NULL, 19, &worker_task, 1); // Run on Core 1
+    ESP_LOGI(TAG, "Created worker task");
+}
+
+void llm_pool_parallel_for(llm_pool_fn fn, void *arg, int n)
+{
+    int split = n / 2;
+    // publish the upper half; the seq store releases the descriptor fields to the worker
+    caller_task = xTaskGetCurrentTaskHandle();
+    job.fn = fn;
+    job.arg = arg;
+    job.start = split;
+    job.end = n;
+    unsigned int seq = atomic_load(&job.seq) + 1;
+    atomic_store(&job.seq, seq);
+    if (atomic_load(&worker_sleeping))
+    {
+        xTaskNotifyGive(worker_task);
+    }
+
+#if LLM_PROFILE
+    uint32_t started = esp_cpu_get_cycle_count();
+    fn(arg, 0, split);
+    uint32_t finished = esp_cpu_get_cycle_count();
+#else
+    fn(arg, 0, split);
+#endif
+
+    // barrier: wait for the worker to finish its half
+    int spins = 0;
+    while (atomic_load(&job.done) != seq)
+    {
+        if (++spins < POOL_SPIN_LIMIT)
+        {
+            continue;
+        }
+        atomic_store(&caller_waiting, 1);
+        if (atomic_load(&job.done) != seq)
+        {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        }
+        atomic_store(&caller_waiting, 0);
+        spins = 0;
+    }
+#if LLM_PROFILE
+    llm_profile_pool(finished - started, job.worker_cycles, esp_cpu_get_cycle_count() - finished);
+#endif
+}
+
+static void pool_noop(void *arg, int start, int end)
+{
+}
+
+float llm_pool_benchmark(int iterations)
+{
+    int64_t start = esp_timer_get_time();
+    for (int i = 0; i < iterations; i++)
+    {
+        llm_pool_parallel_for(pool_noop, NULL, 2);
+    }
+    int64_t elapsed = esp_timer_get_time() - start;
+    return (float)elapsed / iterations;
+}
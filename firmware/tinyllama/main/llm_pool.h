@@ -0,0 +1,27 @@
+#ifndef LLM_POOL_H
+#define LLM_POOL_H
+
+/**
+ * Minimal two-core parallel-for used by llm.c.
+ *
+ * A single worker task pinned to core 1 picks up the upper half of every
+ * range while the calling task (core 0) runs the lower half. Jobs are
+ * published through a sequence-numbered descriptor with atomics; both sides
+ * spin briefly before falling back to direct-to-task notifications, so a
+ * dispatch in the steady state costs a handful of cache accesses instead of
+ * a semaphore and event group round trip.
+ */
+
+// Work function: process items [start, end) of the range
+typedef void (*llm_pool_fn)(void *arg, int start, int end);
+
+// Create the worker task. Must be called once before llm_pool_parallel_for()
+void llm_pool_init(void);
+
+// Run fn over [0, n), split between the caller and the core 1 worker. Returns when both halves are done
+void llm_pool_parallel_for(llm_pool_fn fn, void *arg, int n);
+
+// Average cost of dispatching an empty job and waiting for it, in microseconds
+float llm_pool_benchmark(int iterations);
+
+#endif // LLM_POOL_H
@@ -0,0 +1,152 @@
+#include "llm_profile.h"
+#include <stdio.h>
+#include <string.h>
+#include "esp_log.h"
+
+static const char *TAG = "LLM_PROFILE";
+
+#define PROFILE_BUCKETS 32 // log2 of the cycle count
+
+static const char *op_names[PROF_OPS] = {
+    "embedding", "rmsnorm", "quantize", "qkv", "rope+kv", "attention",
+    "wo", "residual", "ffn", "w2", "classifier",
+};
+
+typedef struct
+{
+    uint32_t count;
+    uint64_t total;
+    uint32_t min;
+    uint32_t max;
+    uint32_t hist[PROFILE_BUCKETS];
+} ProfileStat;
+
+ProfileRing llm_profile_ring = {.op = -1};
+
+static ProfileStat stats[PROF_OPS][PROF_KINDS];
+static uint64_t forward_cycles;
+static uint32_t dropped;
+static int tokens;
+
+void llm_profile_pool(uint32_t core0, uint32_t core1, uint32_t barrier)
+{
+    int op = llm_profile_ring.op;
+    if (op < 0)
+    {
+        return;
+    }
+    llm_profile_record(op, PROF_CORE0, core0);
+    llm_profile_record(op, PROF_CORE1, core1);
+    llm_profile_record(op, PROF_BARRIER, barrier);
+}
+
+static void stat_add(ProfileStat *st, uint32_t cycles)
+{
+    st->min = st->count == 0 || cycles < st->min ? cycles : st->min;
+    st->max = cycles > st->max ? cycles : st->max;
+    st->count++;
+    st->total += cycles;
+    st->hist[cycles ? 31 - __builtin_clz(cycles) : 0]++;
+}
+
+// "2^9:5 2^10:150", the occupied buckets of a histogram
+static void format_histogram(char *out, size_t size, const ProfileStat *st)
+{
+    out[0] = '\0';
+    for (int b = 0, len = 0; b < PROFILE_BUCKETS && len < (int)size; b++)
+    {
+        if (st->hist[b])
+        {
+            len += snprintf(out + len, size - len, "%s2^%d:%lu", len ? " " : "", b, (unsigned long)st->hist[b]);
+        }
+    }
+}
+
+static void profile_print(void)
+{
+    uint64_t self = 0;
+    for (int op = 0; op < PROF_OPS; op++)
+    {
+        self += stats[op][PROF_SELF].total;
+    }
+    ESP_LOGI(TAG, "%d tokens, %llu cycles/token in forward(), %llu outside the stages, %lu events dropped", tokens,
+             (unsigned long long)(forward_cycles / tokens), (unsigned long long)((forward_cycles - self) / tokens),
+             (unsigned long)dropped);
+    ESP_LOGI(TAG, "%-10s %9s %11s %6s %9s %9s  %s", "op", "calls/tok", "cycles/tok", "share", "min", "max",
+             "histogram (log2 cycles: calls)");
+    for (int op = 0; op < PROF_OPS; op++)
+    {
+        const ProfileStat *st = &stats[op][PROF_SELF];
+        if (st->count == 0)
+        {
+            continue;
+        }
+        char hist[160];
+        format_histogram(hist, sizeof(hist), st);
+        ESP_LOGI(TAG, "%-10s %9.1f %11llu %5.1f%% %9lu %9lu  %s", op_names[op], (float)st->count / tokens,
+                 (unsigned long long)(st->total / tokens), 100.0f * st->total / forward_cycles,
+                 (unsigned long)st->min, (unsigned long)st->max, hist);
+    }
+
+    // the two-core stages: imbalance is how much longer the busier core worked than the other
+    ESP_LOGI(TAG, "%-10s %9s %11s %11s %11s %9s", "parallel", "jobs/tok", "core0/tok", "core1/tok", "barrier/tok",
+             "imbalance");
+    uint64_t all[PROF_KINDS] = {0};
+    for (int op = 0; op <= PROF_OPS; op++)
+    {
+        uint64_t c0, c1, wait;
+        uint32_t jobs;
+        if (op < PROF_OPS)
+        {
+            if (stats[op][PROF_CORE0].count == 0)
+            {
+                continue;
+            }
+            jobs = stats[op][PROF_CORE0].count;
+            c0 = stats[op][PROF_CORE0].total;
+            c1 = stats[op][PROF_CORE1].total;
+            wait = stats[op][PROF_BARRIER].total;
+            all[PROF_SELF] += jobs;
+            all[PROF_CORE0] += c0;
+            all[PROF_CORE1] += c1;
+            all[PROF_BARRIER] += wait;
+        }
+        else
+        {
+            jobs = all[PROF_SELF];
+            c0 = all[PROF_CORE0];
+            c1 = all[PROF_CORE1];
+            wait = all[PROF_BARRIER];
+        }
+        uint64_t busier = c0 > c1 ? c0 : c1;
+        float imbalance = busier ? 100.0f * (busier - (c0 > c1 ? c1 : c0)) / busier : 0.0f;
+        ESP_LOGI(TAG, "%-10s %9.1f %11llu %11llu %11llu %8.1f%%", op < PROF_OPS ? op_names[op] : "total",
+                 (float)jobs / tokens, (unsigned long long)(c0 / tokens), (unsigned long long)(c1 / tokens),
+                 (unsigned long long)(wait / tokens), imbalance);
+    }
+}
+
+void llm_profile_token_end(void)
+{
+    ProfileRing *r = &llm_profile_ring;
+    forward_cycles += esp_cpu_get_cycle_count() - r->token_start;
+    if (r->head - r->tail > LLM_PROFILE_RING)
+    {
+        dropped += r->head - r->tail - LLM_PROFILE_RING;
+        r->tail = r->head - LLM_PROFILE_RING;
+    }
+    for (; r->tail != r->head; r->tail++)
+    {
+        ProfileEvent *e = &r->events[r->tail & (LLM_PROFILE_RING - 1)];
+        stat_add(&stats[e->op][e->kind], e->cycles);
+    }
+
+    if (++tokens == LLM_PROFILE_EVERY)
+    {
+        profile_print();
+        memset(stats, 0, sizeof(stats));
+        forward_cycles = 0;
+        dropped = 0;
+        tokens = 0;
+    }
+}
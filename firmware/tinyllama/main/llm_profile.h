@@ -0,0 +1,126 @@
+#ifndef LLM_PROFILE_H
+#define LLM_PROFILE_H
+
+/**
+ * Per-operator cycle profiler for forward().
+ *
+ * Each stage of forward() is bracketed by LLM_PROF_START(op) and
+ * LLM_PROF_STOP(), which read the CPU cycle counter and append one event to a
+ * ring buffer. Every llm_pool_parallel_for() inside a stage adds three more:
+ * the cycles core 0 spent on its half, the cycles the core 1 worker spent on
+ * its half, and how long core 0 then waited at the barrier. Recording is a
+ * counter read and a store; the ring is folded into per-op totals and log2
+ * histograms at the end of each token and printed every LLM_PROFILE_EVERY
+ * tokens.
+ *
+ * Compiled out unless LLM_PROFILE is 1 (menuconfig: "Profile forward()"), in
+ * which case the macros below expand to nothing. Only forward() is
+ * instrumented; the prompt prefill is not. On the host the "cycles" are
+ * nanoseconds.
+ */
+
+#include <stdint.h>
+#include "sdkconfig.h"
+#include "esp_cpu.h"
+
+#ifndef LLM_PROFILE
+#if CONFIG_LLM_PROFILE
+#define LLM_PROFILE 1
+#else
+#define LLM_PROFILE 0
+#endif
+#endif
+
+#ifndef LLM_PROFILE_EVERY
+#ifdef CONFIG_LLM_PROFILE_EVERY
+#define LLM_PROFILE_EVERY CONFIG_LLM_PROFILE_EVERY
+#else
+#define LLM_PROFILE_EVERY 32 // tokens per printed summary
+#endif
+#endif
+
+#define LLM_PROFILE_RING 1024 // events, a power of two; a stories260K token records about 150
+
+typedef enum
+{
+    PROF_EMBEDDING,
+    PROF_RMSNORM,
+    PROF_QUANTIZE,
+    PROF_QKV,
+    PROF_ROPE, // rotation of q and k and the kv cache store
+    PROF_ATTENTION,
+    PROF_WO,
+    PROF_RESIDUAL,
+    PROF_FFN, // w1, w3 and SwiGLU
+    PROF_W2,
+    PROF_CLASSIFIER,
+    PROF_OPS
+} ProfileOp;
+
+typedef enum
+{
+    PROF_SELF,    // the whole stage, as seen from the calling task
+    PROF_CORE0,   // core 0's half of a parallel_for
+    PROF_CORE1,   // the core 1 worker's half
+    PROF_BARRIER, // core 0 waiting for the worker after its own half
+    PROF_KINDS
+} ProfileKind;
+
+typedef struct
+{
+    uint8_t op;
+    uint8_t kind;
+    uint32_t cycles;
+} ProfileEvent;
+
+typedef struct
+{
+    ProfileEvent events[LLM_PROFILE_RING];
+    uint32_t head;        // events recorded, wraps
+    uint32_t tail;        // events folded into the totals
+    int op;               // stage running now, -1 between stages
+    uint32_t op_start;    // cycle count at LLM_PROF_START
+    uint32_t token_start; // cycle count at LLM_PROF_TOKEN_BEGIN
+} ProfileRing;
+
+extern ProfileRing llm_profile_ring;
+
+static inline void llm_profile_record(int op, ProfileKind kind, uint32_t cycles)
+{
+    ProfileEvent *e = &llm_profile_ring.events[llm_profile_ring.head++ & (LLM_PROFILE_RING - 1)];
+    e->op = op;
+    e->kind = kind;
+    e->cycles = cycles;
+}
+
+static inline void llm_profile_start(ProfileOp op)
+{
+    llm_profile_ring.op = op;
+    llm_profile_ring.op_start = esp_cpu_get_cycle_count();
+}
+
+static inline void llm_profile_stop(void)
+{
+    llm_profile_record(llm_profile_ring.op, PROF_SELF, esp_cpu_get_cycle_count() - llm_profile_ring.op_start);
+    llm_profile_ring.op = -1;
+}
+
+// Record one parallel_for against the running stage; ignored outside forward()
+void llm_profile_pool(uint32_t core0, uint32_t core1, uint32_t barrier);
+
+// Fold the ring into the totals, and print and reset them every LLM_PROFILE_EVERY tokens
+void llm_profile_token_end(void);
+
+#if LLM_PROFILE
+#define LLM_PROF_TOKEN_BEGIN() (llm_profile_ring.token_start = esp_cpu_get_cycle_count())
+#define LLM_PROF_TOKEN_END() llm_profile_token_end()
+#define LLM_PROF_START(op) llm_profile_start(op)
+#define LLM_PROF_STOP() llm_profile_stop()
+#else
+#define LLM_PROF_TOKEN_BEGIN() ((void)0)
+#define LLM_PROF_TOKEN_END() ((void)0)
+#define LLM_PROF_START(op) ((void)0)
+#define LLM_PROF_STOP() ((void)0)
+#endif
+
+#endif // LLM_PROFILE_H
@@ -0,0 +1,146 @@
+#include "llm_rope.h"
+#include <math.h>
+#include "esp_log.h"
+#include "esp_dsp.h"
+
+#define ROPE_Q15_ONE 32767.0f
+// pairs rope_rotate_dsp() takes at a time, the size of its stack scratch rows
+#define ROPE_DSP_CHUNK 32
+
+static const char *TAG = "LLM_ROPE";
+
+size_t rope_freq_size(int head_size)
+{
+    return head_size / 2 * sizeof(float);
+}
+
+size_t rope_table_size(int head_size, int seq_len)
+{
+#if LLM_ROPE_TABLE == LLM_ROPE_TABLE_F32
+    return (size_t)seq_len * (head_size / 2) * 2 * sizeof(float); // cos rows, then sin rows
+#elif LLM_ROPE_TABLE == LLM_ROPE_TABLE_Q15
+    return (size_t)seq_len * (head_size / 2) * 2 * sizeof(int16_t);
+#else
+    (void)head_size;
+    (void)seq_len;
+    return 0;
+#endif
+}
+
+void rope_init(RopeTable *r, int head_size, int seq_len, float *freq, void *table)
+{
+    r->half = head_size / 2;
+    r->seq_len = seq_len;
+    r->freq = freq;
+    r->table_cos = NULL;
+    r->table_sin = NULL;
+    r->table_q15 = NULL;
+    (void)table;
+
+    for (int j = 0; j < r->half; j++)
+    {
+        int head_dim = 2 * j;
+        r->freq[j] = 1.0f / powf(10000.0f, head_dim / (float)head_size);
+    }
+
+#if LLM_ROPE_TABLE == LLM_ROPE_TABLE_F32
+    r->table_cos = table;
+    r->table_sin = r->table_cos + (size_t)seq_len * r->half;
+    for (int pos = 0; pos < seq_len; pos++)
+    {
+        for (int j = 0; j < r->half; j++)
+        {
+            float val = pos * r->freq[j];
+            r->table_cos[pos * r->half + j] = cosf(val);
+            r->table_sin[pos * r->half + j] = sinf(val);
+        }
+    }
+    ESP_LOGI(TAG, "RoPE table: %d positions, f32", seq_len);
+#elif LLM_ROPE_TABLE == LLM_ROPE_TABLE_Q15
+    r->table_q15 = table;
+    for (int pos = 0; pos < seq_len; pos++)
+    {
+        for (int j = 0; j < r->half; j++)
+        {
+            float val = pos * r->freq[j];
+            r->table_q15[(pos * r->half + j) * 2] = (int16_t)lrintf(cosf(val) * ROPE_Q15_ONE);
+            r->table_q15[(pos * r->half + j) * 2 + 1] = (int16_t)lrintf(sinf(val) * ROPE_Q15_ONE);
+        }
+    }
+    ESP_LOGI(TAG, "RoPE table: %d positions, q15", seq_len);
+#endif
+}
+
+void rope_row(RopeTable *r, int pos, float *fcr, float *fci)
+{
+#if LLM_ROPE_TABLE == LLM_ROPE_TABLE_F32
+    if (pos < r->seq_len)
+    {
+        for (int j = 0; j < r->half; j++)
+        {
+            fcr[j] = r->table_cos[pos * r->half + j];
+            fci[j] = r->table_sin[pos * r->half + j];
+        }
+        return;
+    }
+#elif LLM_ROPE_TABLE == LLM_ROPE_TABLE_Q15
+    if (pos < r->seq_len)
+    {
+        const int16_t *row = r->table_q15 + pos * r->half * 2;
+        for (int j = 0; j < r->half; j++)
+        {
+            fcr[j] = row[2 * j] * (1.0f / ROPE_Q15_ONE);
+            fci[j] = row[2 * j + 1] * (1.0f / ROPE_Q15_ONE);
+        }
+        return;
+    }
+#endif
+    // positions past the table (or no table at all) come straight from the frequencies
+    for (int j = 0; j < r->half; j++)
+    {
+        float val = pos * r->freq[j];
+        fcr[j] = cosf(val);
+        fci[j] = sinf(val);
+    }
+}
+
+void rope_rotate_ansi(float *vec, int n, const float *fcr, const float *fci, int head_size)
+{
+    // complex-valued rotate each (even, odd) pair; every head reuses the same row
+    int half = head_size / 2;
+    for (int h = 0; h < n; h += head_size)
+    {
+        float *v = vec + h;
+        for (int j = 0; j < half; j++)
+        {
+            float v0 = v[2 * j];
+            float v1 = v[2 * j + 1];
+            v[2 * j] = v0 * fcr[j] - v1 * fci[j];
+            v[2 * j + 1] = v0 * fci[j] + v1 * fcr[j];
+        }
+    }
+}
+
+void rope_rotate_dsp(float *vec, int n, const float *fcr, const float *fci, int head_size)
+{
+    // the same rotation as four strided products and a strided sub/add per run of pairs: the
+    // even lanes of a head are vec[0], vec[2].. (step 2) and the odd ones vec[1], vec[3]..
+    int half = head_size / 2;
+    float odd_sin[ROPE_DSP_CHUNK];
+    float even_sin[ROPE_DSP_CHUNK];
+    for (int h = 0; h < n; h += head_size)
+    {
+        for (int j = 0; j < half; j += ROPE_DSP_CHUNK)
+        {
+            int len = half - j < ROPE_DSP_CHUNK ? half - j : ROPE_DSP_CHUNK;
+            float *even = vec + h + 2 * j;
+            float *odd = even + 1;
+            dsps_mul_f32(odd, fci + j, odd_sin, len, 2, 1, 1);
+            dsps_mul_f32(even, fci + j, even_sin, len, 2, 1, 1);
+            dsps_mul_f32(even, fcr + j, even, len, 2, 1, 2);
+            dsps_mul_f32(odd, fcr + j, odd, len, 2, 1, 2);
+            dsps_sub_f32(even, odd_sin, even, len, 2, 1, 2);
+            dsps_add_f32(odd, even_sin, odd, len, 2, 1, 2);
+        }
+    }
+}
@@ -0,0 +1,69 @@
+#ifndef LLM_ROPE_H
+#define LLM_ROPE_H
+
+/**
+ * Rotary position embedding tables for llm.c.
+ *
+ * The per-pair frequencies are computed once when the transformer is built.
+ * forward() then fetches the cos/sin row of its position once per token and
+ * every layer rotates q and k with it, instead of calling powf/cosf/sinf for
+ * each pair of each layer. The frequencies and the table live in buffers the
+ * caller provides, sized by rope_freq_size() and rope_table_size(); llm.c
+ * plans them in its arena with the other inference buffers.
+ *
+ * LLM_ROPE_TABLE picks where the rows come from:
+ *   LLM_ROPE_TABLE_NONE  cosf/sinf of the cached frequencies, once per position (default)
+ *   LLM_ROPE_TABLE_F32   a (seq_len, head_size / 2) cos and sin table built up front
+ *   LLM_ROPE_TABLE_Q15   the same table in Q15 fixed point, half the f32 size,
+ *                        for long seq_len where the f32 table would not fit in RAM
+ *
+ * rope_rotate() comes in the two builds llm_kernels.h describes: _ansi, the
+ * scalar reference, and _dsp, which runs the even and odd lanes of each head
+ * through esp-dsp's ae32 multiply, add and subtract with a stride of 2. The
+ * unsuffixed name picks _dsp when esp-dsp is built optimized
+ * (CONFIG_DSP_OPTIMIZED), like the kernels there.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include "sdkconfig.h"
+
+#define LLM_ROPE_TABLE_NONE 0
+#define LLM_ROPE_TABLE_F32 1
+#define LLM_ROPE_TABLE_Q15 2
+
+#ifndef LLM_ROPE_TABLE
+#define LLM_ROPE_TABLE LLM_ROPE_TABLE_NONE
+#endif
+
+typedef struct
+{
+    int half;          // rotation pairs per head, head_size / 2
+    int seq_len;       // positions covered by the table modes
+    float *freq;       // (half,) frequency of each pair
+    float *table_cos;  // (seq_len, half), LLM_ROPE_TABLE_F32 only
+    float *table_sin;  // (seq_len, half), LLM_ROPE_TABLE_F32 only
+    int16_t *table_q15; // (seq_len, half, 2) interleaved cos/sin, LLM_ROPE_TABLE_Q15 only
+} RopeTable;
+
+// Bytes of the buffers rope_init() fills; the table is 0 bytes with LLM_ROPE_TABLE_NONE
+size_t rope_freq_size(int head_size);
+size_t rope_table_size(int head_size, int seq_len);
+
+// Compute the frequencies into freq (and the full table into table, depending on LLM_ROPE_TABLE)
+void rope_init(RopeTable *r, int head_size, int seq_len, float *freq, void *table);
+
+// Fill fcr/fci (half,) with the cos/sin of every pair at position pos
+void rope_row(RopeTable *r, int pos, float *fcr, float *fci);
+
+// Rotate the n values of vec (n / head_size heads) by a row from rope_row()
+void rope_rotate_ansi(float *vec, int n, const float *fcr, const float *fci, int head_size);
+void rope_rotate_dsp(float *vec, int n, const float *fcr, const float *fci, int head_size);
+
+#if CONFIG_DSP_OPTIMIZED
+#define rope_rotate rope_rotate_dsp
+#else
+#define rope_rotate rope_rotate_ansi
+#endif
+
+#endif // LLM_ROPE_H
@@ -0,0 +1,210 @@
+#include "llm_snapshot.h"
+#include <string.h>
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "esp_timer.h"
+#include "esp_rom_crc.h"
+#include "llm_container.h"
+
+static const char *TAG = "LLM_SNAPSHOT";
+
+// the snapshot partition, looked up on first use
+static const esp_partition_t *snapshot_partition(void)
+{
+    static const esp_partition_t *partition = NULL;
+    static int looked_up = 0;
+    if (!looked_up)
+    {
+        looked_up = 1;
+        partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, LLM_SNAPSHOT_PARTITION);
+        if (!partition)
+        {
+            ESP_LOGI(TAG, "No %s partition, prompt snapshots are off", LLM_SNAPSHOT_PARTITION);
+        }
+    }
+    return partition;
+}
+
+static uint32_t fnv1a(uint32_t h, const void *data, size_t len)
+{
+    const uint8_t *bytes = data;
+    for (size_t i = 0; i < len; i++)
+    {
+        h = (h ^ bytes[i]) * 16777619u;
+    }
+    return h;
+}
+
+void snapshot_init(Transformer *t)
+{
+    t->model_crc = 0;
+    if (!LLM_KV_SNAPSHOT || !snapshot_partition())
+    {
+        return;
+    }
+    // any change to the weights has to change the key, so all of them are covered; file_size is
+    // the checkpoint's own size, so the erased rest of a model partition is not
+    const ContainerHeader *header = (const ContainerHeader *)t->data;
+    if (t->file_size >= sizeof(ContainerHeader) && header->magic == CONTAINER_MAGIC && header->version == CONTAINER_VERSION)
+    {
+        t->model_crc = header->crc32;
+        return;
+    }
+    int64_t start = esp_timer_get_time();
+    t->model_crc = esp_rom_crc32_le(0, (const uint8_t *)t->data, t->file_size);
+    ESP_LOGI(TAG, "Checkpoint CRC %08lx over %zu bytes in %lld ms", (unsigned long)t->model_crc, t->file_size,
+             (long long)(esp_timer_get_time() - start) / 1000);
+}
+
+uint32_t snapshot_key(Transformer *t, const int *tokens, int n)
+{
+    uint32_t h = 2166136261u;
+    int kv_bytes = sizeof(kv_t);
+    h = fnv1a(h, &t->config, sizeof(Config));
+    h = fnv1a(h, &t->weights.group_size, sizeof(int));
+    h = fnv1a(h, &kv_bytes, sizeof(int));
+    h = fnv1a(h, &t->model_crc, sizeof(uint32_t));
+    return fnv1a(h, tokens, n * sizeof(int));
+}
+
+typedef void (*snapshot_chunk_fn)(void *ctx, void *ptr, size_t size);
+
+static size_t snapshot_chunks(Transformer *t, int n, snapshot_chunk_fn fn, void *ctx)
+{
+    // walks the RunState memory a snapshot holds, in file order; returns its size
+    Config *p = &t->config;
+    RunState *s = &t->state;
+    int kv_dim = p->dim * p->n_kv_heads / p->n_heads;
+    size_t total = 0;
+#define CHUNK(ptr, size)                \
+    do                                  \
+    {                                   \
+        if (fn)                         \
+        {                               \
+            fn(ctx, (ptr), (size));     \
+        }                               \
+        total += (size);                \
+    } while (0)
+    CHUNK(s->logits, p->vocab_size * sizeof(float));
+    for (int l = 0; l < p->n_layers; l++)
+    {
+        size_t vec0 = (size_t)l * p->seq_len * p->n_kv_heads;
+        CHUNK(s->key_cache + vec0 * (kv_dim / p->n_kv_heads), n * kv_dim * sizeof(kv_t));
+        CHUNK(s->value_cache + vec0 * (kv_dim / p->n_kv_heads), n * kv_dim * sizeof(kv_t));
+        if (s->key_scale)
+        {
+            CHUNK(s->key_scale + vec0, n * p->n_kv_heads * sizeof(float));
+            CHUNK(s->value_scale + vec0, n * p->n_kv_heads * sizeof(float));
+        }
+    }
+#undef CHUNK
+    return total;
+}
+
+typedef struct
+{
+    const uint8_t *src;
+    uint32_t crc;
+} RestoreCursor;
+
+static void crc_chunk(void *ctx, void *ptr, size_t size)
+{
+    RestoreCursor *c = ctx;
+    c->crc = esp_rom_crc32_le(c->crc, c->src, size);
+    c->src += size;
+}
+
+static void restore_chunk(void *ctx, void *ptr, size_t size)
+{
+    RestoreCursor *c = ctx;
+    memcpy(ptr, c->src, size);
+    c->src += size;
+}
+
+float *snapshot_restore(Transformer *t, const int *tokens, int n)
+{
+    const esp_partition_t *partition = LLM_KV_SNAPSHOT ? snapshot_partition() : NULL;
+    if (!partition)
+    {
+        return NULL;
+    }
+    SnapshotHeader header;
+    size_t data_size = snapshot_chunks(t, n, NULL, NULL);
+    if (esp_partition_read(partition, 0, &header, sizeof(header)) != ESP_OK ||
+        header.magic != LLM_SNAPSHOT_MAGIC || header.key != snapshot_key(t, tokens, n) || header.n_tokens != n ||
+        header.kv_bytes != (int32_t)sizeof(kv_t) || header.data_size != data_size)
+    {
+        return NULL;
+    }
+
+    const void *mapped;
+    esp_partition_mmap_handle_t handle;
+    if (esp_partition_mmap(partition, 0, sizeof(header) + data_size, ESP_PARTITION_MMAP_DATA, &mapped, &handle) != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to map the %s partition", LLM_SNAPSHOT_PARTITION);
+        return NULL;
+    }
+    // check the whole snapshot before any of it lands in the cache
+    RestoreCursor cursor = {(const uint8_t *)mapped + sizeof(header), 0};
+    snapshot_chunks(t, n, crc_chunk, &cursor);
+    if (cursor.crc != header.crc32)
+    {
+        ESP_LOGW(TAG, "Snapshot CRC mismatch, prefilling instead");
+        esp_partition_munmap(handle);
+        return NULL;
+    }
+    cursor.src = (const uint8_t *)mapped + sizeof(header);
+    snapshot_chunks(t, n, restore_chunk, &cursor);
+    esp_partition_munmap(handle);
+    return t->state.logits;
+}
+
+typedef struct
+{
+    const esp_partition_t *partition;
+    size_t offset;
+    uint32_t crc;
+    esp_err_t err;
+} SaveCursor;
+
+static void save_chunk(void *ctx, void *ptr, size_t size)
+{
+    SaveCursor *c = ctx;
+    if (c->err == ESP_OK)
+    {
+        c->err = esp_partition_write(c->partition, c->offset, ptr, size);
+    }
+    c->crc = esp_rom_crc32_le(c->crc, ptr, size);
+    c->offset += size;
+}
+
+void snapshot_save(Transformer *t, const int *tokens, int n)
+{
+    const esp_partition_t *partition = LLM_KV_SNAPSHOT ? snapshot_partition() : NULL;
+    if (!partition)
+    {
+        return;
+    }
+    size_t data_size = snapshot_chunks(t, n, NULL, NULL);
+    size_t total = sizeof(SnapshotHeader) + data_size;
+    if (total > partition->size)
+    {
+        ESP_LOGW(TAG, "Snapshot of %d tokens needs %zu bytes, %s has %lu", n, total, LLM_SNAPSHOT_PARTITION,
+                 (unsigned long)partition->size);
+        return;
+    }
+    size_t erase = (total + partition->erase_size - 1) / partition->erase_size * partition->erase_size;
+    SaveCursor cursor = {partition, sizeof(SnapshotHeader), 0, esp_partition_erase_range(partition, 0, erase)};
+    snapshot_chunks(t, n, save_chunk, &cursor);
+    SnapshotHeader header = {LLM_SNAPSHOT_MAGIC, snapshot_key(t, tokens, n), n, sizeof(kv_t), data_size, cursor.crc};
+    if (cursor.err == ESP_OK)
+    {
+        cursor.err = esp_partition_write(partition, 0, &header, sizeof(header));
+    }
+    if (cursor.err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to save the snapshot (%s)", esp_err_to_name(cursor.err));
+        return;
+    }
+    ESP_LOGI(TAG, "Saved %d prompt tokens, %zu bytes", n, total);
+}
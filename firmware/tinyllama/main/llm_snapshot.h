@@ -0,0 +1,64 @@
+#ifndef LLM_SNAPSHOT_H
+#define LLM_SNAPSHOT_H
+
+/**
+ * Prompt prefix snapshots: the kv cache and logits left by prefilling a
+ * prompt, kept in the raw "kvsnap" flash partition (see partitions.csv).
+ *
+ * A snapshot is keyed by an FNV-1a hash of the model (its Config, kv cache
+ * precision and a CRC-32 of the whole checkpoint, see snapshot_init()) and
+ * of the prompt tokens. When generate() gets a prompt whose key matches the
+ * stored one, it copies the cache positions and logits back out of the flash
+ * mapping instead of running the prefill. Otherwise it prefills as usual and
+ * saves the result over the previous snapshot, so the partition always holds
+ * the last prompt used.
+ *
+ * Layout: SnapshotHeader, then the logits (vocab_size floats), then for each
+ * layer the keys and values of positions [0, n_tokens) and, with an int8
+ * cache, their scales. The header is written last, so a snapshot cut short
+ * by a power loss is never mistaken for a valid one; a CRC-32 over the data
+ * guards against the rest.
+ */
+
+#include <stdint.h>
+#include "sdkconfig.h"
+#include "llm.h"
+
+// menuconfig: "Snapshot the prompt's KV cache to flash"
+#ifndef LLM_KV_SNAPSHOT
+#if CONFIG_LLM_KV_SNAPSHOT
+#define LLM_KV_SNAPSHOT 1
+#else
+#define LLM_KV_SNAPSHOT 0
+#endif
+#endif
+
+#define LLM_SNAPSHOT_PARTITION "kvsnap"
+#define LLM_SNAPSHOT_MAGIC 0x70616e73 // "snap" in ASCII
+
+typedef struct
+{
+    uint32_t magic;     // LLM_SNAPSHOT_MAGIC, 0xffffffff while the partition is erased
+    uint32_t key;       // snapshot_key() of the model and prompt
+    int32_t n_tokens;   // prompt positions in the cache
+    int32_t kv_bytes;   // sizeof(kv_t) of the build that wrote it
+    uint32_t data_size; // bytes following the header
+    uint32_t crc32;     // of those bytes
+} SnapshotHeader;
+
+// Fill in t->model_crc once the checkpoint is loaded: the container's own CRC when it has
+// one, otherwise a CRC-32 of the whole file, which reads it once. Skipped, leaving 0, when
+// there is no snapshot partition
+void snapshot_init(Transformer *t);
+
+// Hash of the model and tokens[0..n)
+uint32_t snapshot_key(Transformer *t, const int *tokens, int n);
+
+// Restore the cache positions and logits saved for tokens[0..n); returns the logits,
+// or NULL when there is no matching snapshot
+float *snapshot_restore(Transformer *t, const int *tokens, int n);
+
+// Save the cache positions [0, n) and the current logits as the snapshot of tokens[0..n)
+void snapshot_save(Transformer *t, const int *tokens, int n);
+
+#endif // LLM_SNAPSHOT_H
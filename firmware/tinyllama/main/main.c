@@ -1,16 +1,36 @@
 #include <stdio.h>
+#include <stdbool.h>
 #include <inttypes.h>
 #include "esp_spiffs.h"
 #include "sdkconfig.h"
 #include "esp_err.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include <time.h>
 #include "llm.h"
 #include "led.h"
+#include "led_queue.h"
+#include "llm_pool.h"
 #include <string.h>
 
 static const char *TAG = "MAIN";
 
+#if CONFIG_COMPILER_OPTIMIZATION_PERF
+#define BUILD_OPTIMIZATION "-O2"
+#elif CONFIG_COMPILER_OPTIMIZATION_SIZE
+#define BUILD_OPTIMIZATION "-Os"
+#elif CONFIG_COMPILER_OPTIMIZATION_NONE
+#define BUILD_OPTIMIZATION "-O0"
+#else
+#define BUILD_OPTIMIZATION "-Og"
+#endif
+
+#if CONFIG_LLM_IRAM_HOT_ONLY
+#define BUILD_IRAM "hot path"
+#else
+#define BUILD_IRAM "all of main"
+#endif
+
 
 /**
  * @brief intializes SPIFFS storage
@@ -67,37 +87,43 @@ void init_storage(void)
 void generate_complete_cb(float tk_s)
 {
     ESP_LOGI(TAG, "Generation complete: %.2f tok/s", tk_s);
+    led_queue_log_stats();
 }
 
 /**
- * @brief Callback for each generated token - displays on LED strip
+ * @brief Callback for each generated token - queues it for the LED strip
  * 
  * @param token_str The generated token string
  */
 void on_token_generated(const char* token_str)
 {
+    static bool first_token = true;
     if (!token_str) return;
-    
-    ESP_LOGI(TAG, "Token generated: '%s' (len=%d)", token_str, strlen(token_str));
-    
-    // Debug: print each character's ASCII value
-    for (int i = 0; i < strlen(token_str); i++) {
-        ESP_LOGI(TAG, "  Char %d: '%c' (ASCII %d)", i, token_str[i], (int)token_str[i]);
+
+    if (first_token) {
+        first_token = false;
+        ESP_LOGI(TAG, "Boot to first token: %lld ms", esp_timer_get_time() / 1000);
     }
     
-    // Display the token on LED strip
-    // For single characters, show directly
-    if (strlen(token_str) == 1) {
-        led_show_character(token_str[0]);
-    } else {
-        // For multi-character tokens, show each character sequentially
-        led_show_text_sequence(token_str, LED_COLOR_WHITE);
+#if LLM_TRACE_LEVEL >= LLM_TRACE_TOKENS
+    ESP_LOGI(TAG, "Token generated: '%s' (len=%d)", token_str, (int)strlen(token_str));
+#endif
+#if LLM_TRACE_LEVEL >= LLM_TRACE_BYTES
+    for (int i = 0; token_str[i] != '\0'; i++) {
+        ESP_LOGI(TAG, "  Char %d: '%c' (ASCII %d)", i, token_str[i], (int)token_str[i]);
     }
+#endif
+
+    // The render task animates the characters on core 0, generation carries on meanwhile
+    led_queue_push(token_str);
 }
 
 void app_main(void)
 {
     ESP_LOGI(TAG, "Starting ESP32 LLM application");
+    // the build profile, so tok/s from different sdkconfigs can be told apart in the logs
+    ESP_LOGI(TAG, "Build: %s, PSRAM %d MHz, dcache line %d B, %s in IRAM", BUILD_OPTIMIZATION,
+             CONFIG_SPIRAM_SPEED, CONFIG_ESP32S3_DATA_CACHE_LINE_SIZE, BUILD_IRAM);
     ESP_LOGI(TAG, "Loading Model...");
     init_storage();
     
@@ -113,15 +139,23 @@ void app_main(void)
         // You can adjust this value to control the overall brightness
         led_set_brightness(128);  // 50% brightness - adjust as needed
         ESP_LOGI(TAG, "LED brightness set to %d", led_get_brightness());
+
+        // Characters that arrive while the render task is LED_QUEUE_LENGTH behind replace
+        // the oldest pending ones; LED_QUEUE_PAUSE would throttle generation instead
+        ret = led_queue_init(LED_QUEUE_COALESCE);
+        if (ret != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to start LED render task: %s", esp_err_to_name(ret));
+        }
     }
 
     // default parameters
-    char *checkpoint_path = "/data/stories260K.bin"; // e.g. out/model.bin
+    char *checkpoint_partition = "model"; // raw partition the checkpoint is flashed to, see main/CMakeLists.txt
     char *tokenizer_path = "/data/tok512.bin";
     float temperature = 1.0f;        // 0.0 = greedy deterministic. 1.0 = original. don't set higher
     float topp = 0.9f;               // top-p in nucleus sampling. 1.0 = off. 0.9 works well, but slower
-    int steps = 500;                  // number of steps to run for
+    int steps = 500;                  // number of steps to run for, -1 keeps the oracle going forever
     char *prompt = "Once upon a time"; // prompt string
+    int led_only = 1;                // sample only tokens with a letter or digit to light up
     unsigned long long rng_seed = 0; // seed rng with time by default
 
     // parameter validation/overrides
@@ -130,9 +164,13 @@ void app_main(void)
 
     // build the Transformer via the model .bin file
     Transformer transformer;
-    ESP_LOGI(TAG, "LLM Path is %s", checkpoint_path);
-    build_transformer(&transformer, checkpoint_path);
-    if (steps == 0 || steps > transformer.config.seq_len)
+    ESP_LOGI(TAG, "LLM partition is %s", checkpoint_partition);
+    int64_t load_start = esp_timer_get_time();
+    build_transformer_from_partition(&transformer, checkpoint_partition);
+    ESP_LOGI(TAG, "Model loaded in %lld ms", (esp_timer_get_time() - load_start) / 1000);
+    ESP_LOGI(TAG, "Parallel dispatch overhead: %.2f us", llm_pool_benchmark(1000));
+    // runs past seq_len shift the kv cache instead of stopping
+    if (steps == 0)
         steps = transformer.config.seq_len; // override to ~max length
 
     // build the Tokenizer via the tokenizer .bin file
@@ -142,6 +180,8 @@ void app_main(void)
     // build the Sampler
     Sampler sampler;
     build_sampler(&sampler, transformer.config.vocab_size, temperature, topp, rng_seed);
+    if (led_only)
+        sampler_restrict(&sampler, tokenizer.led_tokens, tokenizer.n_led_tokens);
 
     // run!
     ESP_LOGI(TAG, "Starting text generation with prompt: '%s'", prompt);
@@ -0,0 +1,123 @@
+#!/usr/bin/env python3
+"""
+Converts a legacy llama2.c fp32 checkpoint (as shipped in models/) into the
+version 3 container that main/llm_container.h describes:
+
+    header (256 bytes): uint32 magic "ak42", int32 version 3, 7 x int32 Config,
+                        uint32 flags, int32 group_size, uint32 n_tensors,
+                        uint32 alignment, uint32 total_size, uint32 crc32, zero padding
+    tensor table:       n_tensors x 64 bytes: char name[32], uint8 dtype, uint8 n_dims,
+                        uint16 reserved, 4 x int32 shape, uint32 offset,
+                        uint32 scale_offset, uint32 size
+    tensor data:        each tensor, and each block of q8 scales, at a multiple of alignment
+
+The rmsnorm weights are always fp32. With --q8 every other tensor is stored as
+int8 with one fp32 scale per group, like export_q8.py does. The unused RoPE
+frequency blocks of the legacy format are dropped, and flag bit 0 replaces the
+negative vocab size that signals a shared classifier.
+
+usage: python3 tools/export_checkpoint.py models/stories260K.bin models/stories260K_v3.bin [--q8] [--group-size 64] [--alignment 64]
+"""
+import argparse
+import struct
+import sys
+import zlib
+from array import array
+
+from export_q8 import MAGIC, pick_group_size, quantize_q80, read_legacy
+
+VERSION = 3
+HEADER_SIZE = 256
+TENSOR_ENTRY_SIZE = 64
+FLAG_SHARED_CLASSIFIER = 1
+DTYPE_F32 = 0
+DTYPE_Q8 = 1
+
+
+def f32_bytes(t):
+    t = array("f", t)
+    if sys.byteorder != "little":
+        t.byteswap()
+    return t.tobytes()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("input", help="legacy fp32 checkpoint")
+    parser.add_argument("output", help="container to write")
+    parser.add_argument("--q8", action="store_true", help="store the matmul weights and embeddings as int8")
+    parser.add_argument("--group-size", type=int, default=64, help="largest q8 group size to try (default 64)")
+    parser.add_argument("--alignment", type=int, default=64, help="tensor alignment in bytes, a multiple of 16 (default 64)")
+    args = parser.parse_args()
+    if args.alignment < 16 or args.alignment % 16:
+        sys.exit("alignment must be a multiple of 16")
+
+    config, shared, w = read_legacy(args.input)
+    dim, hidden_dim, n_layers, n_heads, n_kv_heads, vocab_size, _ = config
+    kv_dim = n_kv_heads * (dim // n_heads)
+    gs = 0
+    if args.q8:
+        gs = pick_group_size(args.group_size, dim, hidden_dim)
+        if gs != args.group_size:
+            print("group size reduced to %d to divide dim=%d and hidden_dim=%d" % (gs, dim, hidden_dim))
+
+    # (name, shape, values, quantized)
+    tensors = [
+        ("tok_embeddings", (vocab_size, dim), w["tok"], args.q8),
+        ("rms_att", (n_layers, dim), w["rms_att"], False),
+        ("wq", (n_layers, dim, dim), w["wq"], args.q8),
+        ("wk", (n_layers, kv_dim, dim), w["wk"], args.q8),
+        ("wv", (n_layers, kv_dim, dim), w["wv"], args.q8),
+        ("wo", (n_layers, dim, dim), w["wo"], args.q8),
+        ("rms_ffn", (n_layers, dim), w["rms_ffn"], False),
+        ("w1", (n_layers, hidden_dim, dim), w["w1"], args.q8),
+        ("w2", (n_layers, dim, hidden_dim), w["w2"], args.q8),
+        ("w3", (n_layers, hidden_dim, dim), w["w3"], args.q8),
+        ("rms_final", (dim,), w["rms_final"], False),
+    ]
+    if not shared:
+        tensors.append(("wcls", (vocab_size, dim), w["wcls"], args.q8))
+
+    data = bytearray()
+    data_start = HEADER_SIZE + len(tensors) * TENSOR_ENTRY_SIZE
+
+    def place(blob):
+        # pad so the blob lands on an aligned file offset, return that offset
+        pad = -(data_start + len(data)) % args.alignment
+        data.extend(b"\0" * pad)
+        offset = data_start + len(data)
+        data.extend(blob)
+        return offset
+
+    table = bytearray()
+    worst = 0.0
+    for name, shape, values, quantized in tensors:
+        if quantized:
+            q, s, err = quantize_q80(values, gs)
+            worst = max(worst, err)
+            offset = place(q.tobytes())
+            scale_offset = place(f32_bytes(s))
+            dtype, size = DTYPE_Q8, len(q)
+        else:
+            offset = place(f32_bytes(values))
+            scale_offset = 0
+            dtype, size = DTYPE_F32, 4 * len(values)
+        dims = tuple(shape) + (0,) * (4 - len(shape))
+        table += struct.pack("<32sBBH4iIII", name.encode(), dtype, len(shape), 0, *dims, offset, scale_offset, size)
+        print("%-16s %-4s %-18s offset %d" % (name, "q8" if quantized else "f32", "x".join(map(str, shape)), offset))
+
+    body = bytes(table) + bytes(data)
+    total_size = HEADER_SIZE + len(body)
+    header = struct.pack("<Ii", MAGIC, VERSION) + struct.pack("<7i", *config)
+    header += struct.pack("<IiIIII", FLAG_SHARED_CLASSIFIER if shared else 0, gs, len(tensors), args.alignment,
+                          total_size, zlib.crc32(body) & 0xffffffff)
+    with open(args.output, "wb") as out:
+        out.write(header + b"\0" * (HEADER_SIZE - len(header)))
+        out.write(body)
+
+    kind = "q8, group size %d, worst max abs error %.6f" % (gs, worst) if args.q8 else "fp32"
+    print("wrote %s: %d bytes, %s" % (args.output, total_size, kind))
+
+
+if __name__ == "__main__":
+    main()
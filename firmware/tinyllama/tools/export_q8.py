@@ -0,0 +1,160 @@
+#!/usr/bin/env python3
+"""
+Converts a legacy llama2.c fp32 checkpoint (as shipped in models/) into the
+int8 "version 2" layout that read_checkpoint() in main/llm.c detects by its
+magic number:
+
+    header (256 bytes): uint32 magic "ak42", int32 version, 7 x int32 Config,
+                        uint8 shared_classifier, int32 group_size, uint8 layout, zero padding
+    fp32:  rms_att_weight (layer, dim), rms_ffn_weight (layer, dim), rms_final_weight (dim,)
+    int8 + fp32 scales per tensor: token embeddings, then per layer wq, wk, wv,
+                        wo, w1, w2, w3, then wcls when it isn't shared
+
+With --fuse the layout byte is set and the layer tensors are written layer by layer
+in the order forward() uses them: [wq;wk;wv], wo, [w1;w3], w2. The stacked tensors
+are quantized as one, which gives the same values since groups never straddle a row.
+
+Only the standard library is needed so this runs anywhere the firmware is built.
+
+usage: python3 tools/export_q8.py models/stories260K.bin models/stories260K_q8.bin [--group-size 64] [--fuse]
+"""
+import argparse
+import struct
+import sys
+from array import array
+
+MAGIC = 0x616B3432  # "ak42"
+VERSION = 2
+HEADER_SIZE = 256
+LAYOUT_FUSED = 1
+
+
+def read_legacy(path):
+    with open(path, "rb") as f:
+        data = f.read()
+    dim, hidden_dim, n_layers, n_heads, n_kv_heads, vocab_size, seq_len = struct.unpack_from("7i", data, 0)
+    # negative vocab size signals unshared classifier weights
+    shared = vocab_size > 0
+    vocab_size = abs(vocab_size)
+    config = (dim, hidden_dim, n_layers, n_heads, n_kv_heads, vocab_size, seq_len)
+
+    floats = array("f")
+    floats.frombytes(data[28:])
+    if sys.byteorder != "little":
+        floats.byteswap()
+
+    head_size = dim // n_heads
+    kv_dim = n_kv_heads * head_size
+    offset = 0
+
+    def take(n):
+        nonlocal offset
+        t = floats[offset:offset + n]
+        offset += n
+        return t
+
+    w = {}
+    w["tok"] = take(vocab_size * dim)
+    w["rms_att"] = take(n_layers * dim)
+    w["wq"] = take(n_layers * dim * dim)
+    w["wk"] = take(n_layers * dim * kv_dim)
+    w["wv"] = take(n_layers * dim * kv_dim)
+    w["wo"] = take(n_layers * dim * dim)
+    w["rms_ffn"] = take(n_layers * dim)
+    w["w1"] = take(n_layers * dim * hidden_dim)
+    w["w2"] = take(n_layers * hidden_dim * dim)
+    w["w3"] = take(n_layers * dim * hidden_dim)
+    w["rms_final"] = take(dim)
+    take(seq_len * head_size)  # skip what used to be freq_cis_real and freq_cis_imag (for RoPE)
+    w["wcls"] = None if shared else take(vocab_size * dim)
+    return config, shared, w
+
+
+def pick_group_size(requested, dim, hidden_dim):
+    # groups never straddle a matmul row, so they have to divide both row lengths;
+    # anything below 4 would leave the fp32 scales misaligned
+    gs = requested
+    while gs >= 4 and (dim % gs or hidden_dim % gs):
+        gs //= 2
+    if gs < 4:
+        sys.exit("dim %d and hidden_dim %d have no common group size >= 4" % (dim, hidden_dim))
+    return gs
+
+
+def quantize_q80(w, gs):
+    """symmetric int8 quantization with one fp32 scale per group of gs values"""
+    q = array("b", bytes(len(w)))
+    s = array("f", bytes(4 * (len(w) // gs)))
+    max_err = 0.0
+    for g in range(len(w) // gs):
+        group = w[g * gs:(g + 1) * gs]
+        scale = max(abs(v) for v in group) / 127.0
+        s[g] = scale
+        for i, v in enumerate(group):
+            qv = int(round(v / scale)) if scale > 0 else 0
+            q[g * gs + i] = qv
+            max_err = max(max_err, abs(v - qv * scale))
+    return q, s, max_err
+
+
+def write_f32(out, t):
+    if sys.byteorder != "little":
+        t = array("f", t)
+        t.byteswap()
+    out.write(t.tobytes())
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("input", help="legacy fp32 checkpoint")
+    parser.add_argument("output", help="Q8 checkpoint to write")
+    parser.add_argument("--group-size", type=int, default=64, help="largest group size to try (default 64)")
+    parser.add_argument("--fuse", action="store_true", help="store each layer's qkv and w1/w3 weights stacked")
+    args = parser.parse_args()
+
+    config, shared, w = read_legacy(args.input)
+    dim, hidden_dim, n_layers = config[0], config[1], config[2]
+    gs = pick_group_size(args.group_size, dim, hidden_dim)
+    if gs != args.group_size:
+        print("group size reduced to %d to divide dim=%d and hidden_dim=%d" % (gs, dim, hidden_dim))
+
+    with open(args.output, "wb") as out:
+        header = struct.pack("<Ii", MAGIC, VERSION) + struct.pack("<7i", *config)
+        header += struct.pack("<B", int(shared)) + struct.pack("<i", gs)
+        header += struct.pack("<B", LAYOUT_FUSED if args.fuse else 0)
+        out.write(header + b"\0" * (HEADER_SIZE - len(header)))
+
+        for name in ("rms_att", "rms_ffn", "rms_final"):
+            write_f32(out, w[name])
+
+        def layer(name, l):
+            per_layer = len(w[name]) // n_layers
+            return w[name][l * per_layer:(l + 1) * per_layer]
+
+        tensors = [("tok", w["tok"])]
+        if args.fuse:
+            for l in range(n_layers):
+                tensors.append(("wqkv.%d" % l, layer("wq", l) + layer("wk", l) + layer("wv", l)))
+                tensors.append(("wo.%d" % l, layer("wo", l)))
+                tensors.append(("w13.%d" % l, layer("w1", l) + layer("w3", l)))
+                tensors.append(("w2.%d" % l, layer("w2", l)))
+        else:
+            for name in ("wq", "wk", "wv", "wo", "w1", "w2", "w3"):
+                tensors += [("%s.%d" % (name, l), layer(name, l)) for l in range(n_layers)]
+        if not shared:
+            tensors.append(("wcls", w["wcls"]))
+
+        worst = 0.0
+        for name, t in tensors:
+            q, s, err = quantize_q80(t, gs)
+            out.write(q.tobytes())
+            write_f32(out, s)
+            worst = max(worst, err)
+            print("%-8s %8d values, max abs error %.6f" % (name, len(t), err))
+
+        size = out.tell()
+    print("wrote %s: %d bytes, group size %d, worst max abs error %.6f" % (args.output, size, gs, worst))
+
+
+if __name__ == "__main__":
+    main()